@@ -87,9 +87,10 @@ import (
 // panics. If copyUp fails because any step (above) fails, a generic
 // error is returned.
 //
-// copyUp currently makes no attempt to optimize copying up file content.
-// For large files, this means that copyUp blocks until the entire file
-// is copied synchronously.
+// Regular files of an immutable lower filesystem that are larger than a
+// block are copied up lazily, see lazyCopy. Other files are copied up
+// synchronously: for large files, this means that copyUp blocks until the
+// entire file is copied.
 func copyUp(ctx context.Context, d *Dirent) error {
 	renameMu.RLock()
 	defer renameMu.RUnlock()
@@ -246,8 +247,15 @@ func copyUpLocked(ctx context.Context, parent *Dirent, next *Dirent) error {
 		return syserror.EIO
 	}
 
-	// Copy the entire file.
-	if err := copyContentsLocked(ctx, childUpperInode, next.Inode.overlay.lower, attrs.Size); err != nil {
+	// Copy the entire file, or only set its size if its contents can be
+	// copied lazily.
+	var lazy *lazyCopy
+	if canCopyUpLazily(next, attrs.Size) {
+		lazy, err = newLazyCopy(ctx, childUpperInode, next.Inode.overlay.lower, attrs.Size)
+	} else {
+		err = copyContentsLocked(ctx, childUpperInode, next.Inode.overlay.lower, attrs.Size)
+	}
+	if err != nil {
 		log.Warningf("copy up failed to copy up contents: %v", err)
 		cleanupUpper(ctx, parentUpper, next.name)
 		return syserror.EIO
@@ -257,6 +265,9 @@ func copyUpLocked(ctx context.Context, parent *Dirent, next *Dirent) error {
 	upperMappable := childUpperInode.Mappable()
 	if lowerMappable != nil && upperMappable == nil {
 		log.Warningf("copy up failed: cannot ensure memory mapping coherence")
+		if lazy != nil {
+			lazy.DecRef()
+		}
 		cleanupUpper(ctx, parentUpper, next.name)
 		return syserror.EIO
 	}
@@ -279,6 +290,9 @@ func copyUpLocked(ctx context.Context, parent *Dirent, next *Dirent) error {
 							upperMappable.RemoveMapping(ctx, m.MappingSpace, m.AddrRange, mr.Start, m.Writable)
 						}
 					}
+					if lazy != nil {
+						lazy.DecRef()
+					}
 					return err
 				}
 				added[m] = struct{}{}
@@ -292,8 +306,15 @@ func copyUpLocked(ctx context.Context, parent *Dirent, next *Dirent) error {
 	next.Inode.overlay.dataMu.Lock()
 	childUpperInode.IncRef()
 	next.Inode.overlay.upper = childUpperInode
+	next.Inode.overlay.lazy = lazy
 	next.Inode.overlay.dataMu.Unlock()
 
+	// Keep track of the lazy copy for as long as the upper file exists,
+	// in case next is looked up again.
+	if lazy != nil {
+		next.Inode.MountSource.MountSourceOperations.(*overlayMountSourceOperations).addLazyCopy(childUpperInode, lazy)
+	}
+
 	// Invalidate existing translations through the lower Inode.
 	next.Inode.overlay.mappings.InvalidateAll(memmap.InvalidateOpts{})
 
@@ -318,9 +339,13 @@ func cleanupUpper(ctx context.Context, parent *Inode, name string) {
 	}
 }
 
-// copyUpBuffers is a buffer pool for copying file content. The buffer
-// size is the same used by io.Copy.
-var copyUpBuffers = sync.Pool{New: func() interface{} { return make([]byte, 8*usermem.PageSize) }}
+// copyUpBlockSize is the size of the buffers used to copy file content,
+// which is the same used by io.Copy, and of the blocks in which lazily
+// copied-up files are copied.
+const copyUpBlockSize = 8 * usermem.PageSize
+
+// copyUpBuffers is a buffer pool for copying file content.
+var copyUpBuffers = sync.Pool{New: func() interface{} { return make([]byte, copyUpBlockSize) }}
 
 // copyContentsLocked copies the contents of lower to upper. It panics if
 // less than size bytes can be copied.
@@ -348,12 +373,13 @@ func copyContentsLocked(ctx context.Context, upper *Inode, lower *Inode, size in
 	buf := copyUpBuffers.Get().([]byte)
 	defer copyUpBuffers.Put(buf)
 
-	// Transfer the contents.
+	// Transfer the contents, straight from internal mappings of the lower
+	// file if it can be mapped.
 	//
 	// One might be able to optimize this by doing parallel reads, parallel writes and reads, larger
 	// buffers, etc. But we really don't know anything about the underlying implementation, so these
 	// optimizations could be self-defeating. So we leave this as simple as possible.
-	var offset int64
+	offset := copyMapped(ctx, upperFile, lower.Mappable(), 0, size)
 	for {
 		nr, err := lowerFile.FileOperations.Read(ctx, lowerFile, usermem.BytesIOSequence(buf), offset)
 		if err != nil && err != io.EOF {
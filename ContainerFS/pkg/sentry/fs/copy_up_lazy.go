@@ -0,0 +1,337 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package fs
+
+import (
+	"io"
+	"math"
+	"sync"
+
+	"gvisor.googlesource.com/gvisor/pkg/refs"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+)
+
+// lazyCopy tracks the contents of a regular file that is copied up lazily.
+//
+// Copying up the contents of a large file can take seconds, and the operation
+// that triggered the copy up (usually opening the file for writing) blocks
+// until it is done. If the lower filesystem is immutable (see
+// MountSourceFlags.Immutable), so that the lower file cannot change, copy up
+// instead only creates the upper file with the size of the lower file, and
+// its contents are copied one block of copyUpBlockSize at a time, when first
+// written:
+//
+//   - Reads of blocks that have not been copied are served by the lower file,
+//     and reads of copied blocks, or past the lower contents, by the upper file.
+//
+//   - A write first copies every block it touches, so that the upper file holds
+//     all of their contents even if the write is short.
+//
+//   - Truncating the file discards the lower contents past the new size.
+//
+// The upper filesystem can't map contents it doesn't have, so a file is
+// copied in full before it is memory mapped, and files that may be memory
+// mapped are never copied lazily (see overlayEntry.mapped). Likewise a file is
+// copied in full before it is hard linked, since the new name has no lower
+// file to read from.
+//
+// The Dirent of a file may be evicted and the file looked up again, so the
+// lazyCopy of a file is held by the overlay mount for as long as the upper
+// file exists, by upper Inode. This requires the upper filesystem to keep its
+// Inodes in memory, as tmpfs does, so files are only copied lazily to a
+// static upper (see overlayUpperStatic).
+//
+// +stateify savable
+type lazyCopy struct {
+	refs.AtomicRefCount
+
+	// mu protects the fields below. Reads of the file hold it for reading,
+	// and writes and truncations for writing.
+	mu sync.RWMutex `state:"nosave"`
+
+	// size is the end of the lower contents still visible: bytes before
+	// size are read from the lower file unless their block has been
+	// copied. It only ever shrinks, and is 0 once the file is copied in
+	// full.
+	size int64
+
+	// copied has a bit for every block of [0, size) that has been copied
+	// to the upper file.
+	copied []uint64
+
+	// lower is a handle on the lower file, to copy from, and upper a
+	// handle on the upper file, to copy to. They are released once the
+	// file is copied in full.
+	lower *File
+	upper *File
+}
+
+// newLazyCopy sets the size of upper, the new upper Inode of lower, to size,
+// the size of lower, and returns a lazyCopy of lower to it.
+func newLazyCopy(ctx context.Context, upper *Inode, lower *Inode, size int64) (*lazyCopy, error) {
+	upperFile, err := overlayFile(ctx, upper, FileFlags{Write: true})
+	if err != nil {
+		return nil, err
+	}
+	lowerFile, err := overlayFile(ctx, lower, FileFlags{Read: true})
+	if err != nil {
+		upperFile.DecRef()
+		return nil, err
+	}
+	if err := upper.InodeOperations.Truncate(ctx, upper, size); err != nil {
+		upperFile.DecRef()
+		lowerFile.DecRef()
+		return nil, err
+	}
+	blocks := (size + copyUpBlockSize - 1) / copyUpBlockSize
+	return &lazyCopy{
+		size:   size,
+		copied: make([]uint64, (blocks+63)/64),
+		lower:  lowerFile,
+		upper:  upperFile,
+	}, nil
+}
+
+// DecRef drops a reference on l, and releases its file handles once there
+// are none left.
+func (l *lazyCopy) DecRef() {
+	l.DecRefWithDestructor(l.releaseFiles)
+}
+
+// releaseFiles releases the file handles of l.
+func (l *lazyCopy) releaseFiles() {
+	if l.lower != nil {
+		l.lower.DecRef()
+		l.lower = nil
+	}
+	if l.upper != nil {
+		l.upper.DecRef()
+		l.upper = nil
+	}
+}
+
+// copiedLocked returns true if block b has been copied.
+//
+// Preconditions: l.mu must be locked, and b must be a block of [0, l.size).
+func (l *lazyCopy) copiedLocked(b int64) bool {
+	return l.copied[b/64]&(1<<uint(b%64)) != 0
+}
+
+// runLocked returns the end of the run of bytes from offset that are all
+// read from the same file, and whether it is the lower file.
+//
+// Preconditions: l.mu must be locked.
+func (l *lazyCopy) runLocked(offset int64) (int64, bool) {
+	if offset >= l.size {
+		return math.MaxInt64, false
+	}
+	b := offset / copyUpBlockSize
+	copied := l.copiedLocked(b)
+	for b++; b*copyUpBlockSize < l.size && l.copiedLocked(b) == copied; b++ {
+	}
+	if end := b * copyUpBlockSize; end < l.size {
+		return end, !copied
+	}
+	if copied {
+		return math.MaxInt64, false
+	}
+	return l.size, true
+}
+
+// copyLocked copies the blocks holding [start, end) that have not been copied
+// yet.
+//
+// Preconditions: l.mu must be locked for writing.
+func (l *lazyCopy) copyLocked(ctx context.Context, start, end int64) error {
+	if end > l.size {
+		end = l.size
+	}
+	if start >= end {
+		return nil
+	}
+	var buf []byte
+	for b := start / copyUpBlockSize; b*copyUpBlockSize < end; b++ {
+		if l.copiedLocked(b) {
+			continue
+		}
+		off := b * copyUpBlockSize
+		blockEnd := off + copyUpBlockSize
+		if blockEnd > l.size {
+			blockEnd = l.size
+		}
+		if off = copyMapped(ctx, l.upper, l.lower.Dirent.Inode.Mappable(), off, blockEnd); off < blockEnd {
+			if buf == nil {
+				buf = copyUpBuffers.Get().([]byte)
+				defer copyUpBuffers.Put(buf)
+			}
+			if err := copyRange(ctx, l.upper, l.lower, buf[:blockEnd-off], off); err != nil {
+				return err
+			}
+		}
+		l.copied[b/64] |= 1 << uint(b%64)
+	}
+	return nil
+}
+
+// copyRange copies len(buf) bytes at offset from src to dst through buf.
+func copyRange(ctx context.Context, dst, src *File, buf []byte, offset int64) error {
+	for done := 0; done < len(buf); {
+		n, err := src.FileOperations.Read(ctx, src, usermem.BytesIOSequence(buf[done:]), offset+int64(done))
+		if n == 0 && err == nil {
+			err = io.ErrUnexpectedEOF
+		}
+		if err != nil && (err != io.EOF || n == 0) {
+			return err
+		}
+		done += int(n)
+	}
+	for done := 0; done < len(buf); {
+		n, err := dst.FileOperations.Write(ctx, dst, usermem.BytesIOSequence(buf[done:]), offset+int64(done))
+		if err != nil {
+			return err
+		}
+		done += int(n)
+	}
+	return nil
+}
+
+// read reads from the file at offset, the blocks that have not been copied
+// from the lower file and the rest from upper, a handle on the upper file.
+func (l *lazyCopy) read(ctx context.Context, upper *File, dst usermem.IOSequence, offset int64) (int64, error) {
+	l.mu.RLock()
+	defer l.mu.RUnlock()
+
+	var done int64
+	for dst.NumBytes() > 0 {
+		end, lower := l.runLocked(offset)
+		f := upper
+		if lower {
+			f = l.lower
+		}
+		run := dst
+		if end-offset < dst.NumBytes() {
+			run = dst.TakeFirst64(end - offset)
+		}
+		n, err := f.FileOperations.Read(ctx, f, run, offset)
+		done += n
+		offset += n
+		dst = dst.DropFirst64(n)
+		if err != nil || n < run.NumBytes() {
+			return done, err
+		}
+	}
+	return done, nil
+}
+
+// write copies the blocks src overwrites at offset, then writes src through
+// upper, a handle on the upper file.
+func (l *lazyCopy) write(ctx context.Context, upper *File, src usermem.IOSequence, offset int64) (int64, error) {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+	if err := l.copyLocked(ctx, offset, offset+src.NumBytes()); err != nil {
+		return 0, err
+	}
+	return upper.FileOperations.Write(ctx, upper, src, offset)
+}
+
+// truncate truncates upper, the upper Inode of the file, to size, discarding
+// the lower contents past size.
+func (l *lazyCopy) truncate(ctx context.Context, upper *Inode, size int64) error {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+	if err := upper.InodeOperations.Truncate(ctx, upper, size); err != nil {
+		return err
+	}
+	if size < l.size {
+		l.size = size
+	}
+	return nil
+}
+
+// finish copies the blocks that have not been copied yet, after which the
+// upper file holds the whole file.
+func (l *lazyCopy) finish(ctx context.Context) error {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+	if err := l.copyLocked(ctx, 0, l.size); err != nil {
+		return err
+	}
+	l.size = 0
+	l.copied = nil
+	l.releaseFiles()
+	return nil
+}
+
+// canCopyUpLazily returns true if the contents of d, a file of size bytes,
+// can be copied up lazily. See lazyCopy.
+//
+// Preconditions: d.Inode.overlay.copyMu must be locked.
+func canCopyUpLazily(d *Dirent, size int64) bool {
+	o := d.Inode.overlay
+	if d.Inode.StableAttr.Type != RegularFile || size <= copyUpBlockSize || o.mapped {
+		return false
+	}
+	// The lazyCopy of the file is found again by its upper Inode (see
+	// lazyCopyOf), which only a static upper, such as tmpfs, keeps for as
+	// long as the file exists.
+	return mountImmutable(o.lower.MountSource) && overlayUpperStatic(d.Inode.MountSource)
+}
+
+// addLazyCopy records that upper, an upper Inode of the overlay, is copied
+// up lazily by l. It takes a reference on l.
+func (o *overlayMountSourceOperations) addLazyCopy(upper *Inode, l *lazyCopy) {
+	o.lazyMu.Lock()
+	defer o.lazyMu.Unlock()
+	if o.lazy == nil {
+		o.lazy = make(map[*Inode]*lazyCopy)
+	}
+	l.IncRef()
+	o.lazy[upper] = l
+}
+
+// lazyCopyOf returns the lazyCopy of upper, an upper Inode of the overlay of
+// msrc, with a reference taken on it, or nil if upper isn't copied up
+// lazily.
+func lazyCopyOf(msrc *MountSource, upper *Inode) *lazyCopy {
+	o, ok := msrc.MountSourceOperations.(*overlayMountSourceOperations)
+	if !ok {
+		return nil
+	}
+	o.lazyMu.Lock()
+	defer o.lazyMu.Unlock()
+	l, ok := o.lazy[upper]
+	if !ok {
+		return nil
+	}
+	l.IncRef()
+	return l
+}
+
+// forgetLazyCopy forgets the lazyCopy of upper, an upper Inode of the
+// overlay of msrc that has been removed from the upper filesystem. Files still
+// open keep using it.
+func forgetLazyCopy(msrc *MountSource, upper *Inode) {
+	o, ok := msrc.MountSourceOperations.(*overlayMountSourceOperations)
+	if !ok || upper == nil {
+		return
+	}
+	o.lazyMu.Lock()
+	defer o.lazyMu.Unlock()
+	if l, ok := o.lazy[upper]; ok {
+		delete(o.lazy, upper)
+		l.DecRef()
+	}
+}
@@ -0,0 +1,237 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package fs
+
+import (
+	"sync/atomic"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/memmap"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/platform"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/safemem"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+	"gvisor.googlesource.com/gvisor/pkg/syserror"
+)
+
+// copyMappedChunkSize is the size of the ranges of a lower file that
+// copyMapped translates at once.
+const copyMappedChunkSize = usermem.HugePageSize
+
+// directMappable is implemented by Mappables that may translate straight to
+// the pages holding their data, such as the host mapping of an image file.
+// Other Mappables may allocate and fill pages to translate, which copy up
+// would then copy a second time, so only those implementing directMappable
+// are copied up through translations.
+type directMappable interface {
+	// MapsDirectly returns true if the translations of the Mappable refer
+	// to pages that exist whether or not they are mapped.
+	MapsDirectly() bool
+}
+
+// mapsDirectly returns true if m is a directMappable that maps directly.
+func mapsDirectly(m memmap.Mappable) bool {
+	d, ok := m.(directMappable)
+	return ok && d.MapsDirectly()
+}
+
+// copyMapped copies the bytes [offset, end) of a lower file that can be memory
+// mapped, whose Mappable is m, to upperFile. If m maps directly (see
+// directMappable), the data is written to the upper file straight from
+// internal mappings of the pages m translates to, so that it is copied once,
+// by the upper filesystem, rather than read into a buffer and copied again
+// from it.
+//
+// It returns the offset up to which the data was copied, which is offset if m
+// is nil or doesn't map directly; the caller copies the rest by reading the
+// lower file.
+func copyMapped(ctx context.Context, upperFile *File, m memmap.Mappable, offset, end int64) int64 {
+	if m == nil || offset >= end || !mapsDirectly(m) {
+		return offset
+	}
+
+	// Translations are only valid for a mapping of the translated range,
+	// so map the pages of [offset, end), and only those.
+	ms := &copyUpMappingSpace{}
+	first := uint64(usermem.Addr(offset).RoundDown())
+	last := OffsetPageEnd(end)
+	ar := usermem.AddrRange{0, usermem.Addr(last - first)}
+	if err := m.AddMapping(ctx, ms, ar, first, false); err != nil {
+		log.Debugf("copy up can't map lower file: %v", err)
+		return offset
+	}
+	defer m.RemoveMapping(ctx, ms, ar, first, false)
+
+	for offset < end {
+		start := uint64(usermem.Addr(offset).RoundDown())
+		mr := memmap.MappableRange{start, start + copyMappedChunkSize}
+		if mr.End > last {
+			mr.End = last
+		}
+		ts, terr := m.Translate(ctx, mr, mr, usermem.Read)
+		for _, t := range ts {
+			if atomic.LoadUint32(&ms.invalidated) != 0 {
+				return offset
+			}
+			var err error
+			if offset, err = copyTranslation(ctx, upperFile, t, offset, end); err != nil {
+				log.Debugf("copy up can't copy mapped lower file: %v", err)
+				return offset
+			}
+		}
+		if terr != nil {
+			log.Debugf("copy up can't translate lower file: %v", terr)
+			return offset
+		}
+	}
+	return offset
+}
+
+// CopyMappedForTesting calls copyMapped. It is only for tests of the fs
+// package, which can't otherwise copy up from a Mappable of their own.
+func CopyMappedForTesting(ctx context.Context, upperFile *File, m memmap.Mappable, offset, end int64) int64 {
+	return copyMapped(ctx, upperFile, m, offset, end)
+}
+
+// copyTranslation copies the bytes of t from offset, up to end, to upperFile,
+// and returns the offset up to which they were copied.
+func copyTranslation(ctx context.Context, upperFile *File, t memmap.Translation, offset, end int64) (int64, error) {
+	if uint64(offset) < t.Source.Start || uint64(offset) >= t.Source.End {
+		return offset, nil
+	}
+	last := uint64(end)
+	if last > t.Source.End {
+		last = t.Source.End
+	}
+	pages := platform.FileRange{t.Offset, t.Offset + t.Source.Length()}
+	fr := platform.FileRange{t.Offset + uint64(offset) - t.Source.Start, t.Offset + last - t.Source.Start}
+
+	// Hold a reference on the pages while they are mapped.
+	t.File.IncRef(pages)
+	defer t.File.DecRef(pages)
+	ims, err := t.File.MapInternal(fr, usermem.Read)
+	if err != nil {
+		return offset, err
+	}
+	src := usermem.IOSequence{
+		IO:    &blockSeqIO{ims},
+		Addrs: usermem.AddrRangeSeqOf(usermem.AddrRange{0, usermem.Addr(ims.NumBytes())}),
+	}
+	for src.NumBytes() > 0 {
+		n, err := upperFile.FileOperations.Write(ctx, upperFile, src, offset)
+		offset += n
+		if err != nil {
+			return offset, err
+		}
+		if n == 0 {
+			return offset, syserror.EIO
+		}
+		src = src.DropFirst64(n)
+	}
+	return offset, nil
+}
+
+// copyUpMappingSpace implements memmap.MappingSpace for the mapping of a
+// lower file established by copyMapped.
+type copyUpMappingSpace struct {
+	// invalidated is set once translations of the mapping have been
+	// invalidated. It is accessed atomically.
+	invalidated uint32
+}
+
+// Invalidate implements memmap.MappingSpace.Invalidate.
+func (ms *copyUpMappingSpace) Invalidate(ar usermem.AddrRange, opts memmap.InvalidateOpts) {
+	atomic.StoreUint32(&ms.invalidated, 1)
+}
+
+// blockSeqIO implements usermem.IO for reading from a safemem.BlockSeq.
+// Addresses are interpreted as offsets into the sequence. Writes return
+// EFAULT.
+type blockSeqIO struct {
+	bs safemem.BlockSeq
+}
+
+// blocks returns the blocks of b at ars.
+func (b *blockSeqIO) blocks(ars usermem.AddrRangeSeq) (safemem.BlockSeq, error) {
+	var blocks []safemem.Block
+	for ; !ars.IsEmpty(); ars = ars.Tail() {
+		ar := ars.Head()
+		if uint64(ar.Start) > b.bs.NumBytes() {
+			return safemem.BlockSeqFromSlice(blocks), syserror.EFAULT
+		}
+		bs := b.bs.DropFirst64(uint64(ar.Start))
+		if uint64(ar.Length()) > bs.NumBytes() {
+			return safemem.BlockSeqFromSlice(blocks), syserror.EFAULT
+		}
+		for bs = bs.TakeFirst64(uint64(ar.Length())); !bs.IsEmpty(); bs = bs.Tail() {
+			blocks = append(blocks, bs.Head())
+		}
+	}
+	return safemem.BlockSeqFromSlice(blocks), nil
+}
+
+// CopyOut implements usermem.IO.CopyOut.
+func (b *blockSeqIO) CopyOut(ctx context.Context, addr usermem.Addr, src []byte, opts usermem.IOOpts) (int, error) {
+	return 0, syserror.EFAULT
+}
+
+// CopyIn implements usermem.IO.CopyIn.
+func (b *blockSeqIO) CopyIn(ctx context.Context, addr usermem.Addr, dst []byte, opts usermem.IOOpts) (int, error) {
+	srcs, rngErr := b.blocks(usermem.AddrRangeSeqOf(usermem.AddrRange{addr, addr + usermem.Addr(len(dst))}))
+	n, err := safemem.CopySeq(safemem.BlockSeqOf(safemem.BlockFromSafeSlice(dst)), srcs)
+	if err != nil {
+		return int(n), err
+	}
+	return int(n), rngErr
+}
+
+// ZeroOut implements usermem.IO.ZeroOut.
+func (b *blockSeqIO) ZeroOut(ctx context.Context, addr usermem.Addr, toZero int64, opts usermem.IOOpts) (int64, error) {
+	return 0, syserror.EFAULT
+}
+
+// CopyOutFrom implements usermem.IO.CopyOutFrom.
+func (b *blockSeqIO) CopyOutFrom(ctx context.Context, ars usermem.AddrRangeSeq, src safemem.Reader, opts usermem.IOOpts) (int64, error) {
+	return 0, syserror.EFAULT
+}
+
+// CopyInTo implements usermem.IO.CopyInTo.
+func (b *blockSeqIO) CopyInTo(ctx context.Context, ars usermem.AddrRangeSeq, dst safemem.Writer, opts usermem.IOOpts) (int64, error) {
+	srcs, rngErr := b.blocks(ars)
+	n, err := dst.WriteFromBlocks(srcs)
+	if err != nil {
+		return int64(n), err
+	}
+	return int64(n), rngErr
+}
+
+// SwapUint32 implements usermem.IO.SwapUint32.
+func (b *blockSeqIO) SwapUint32(ctx context.Context, addr usermem.Addr, new uint32, opts usermem.IOOpts) (uint32, error) {
+	return 0, syserror.EFAULT
+}
+
+// CompareAndSwapUint32 implements usermem.IO.CompareAndSwapUint32.
+func (b *blockSeqIO) CompareAndSwapUint32(ctx context.Context, addr usermem.Addr, old, new uint32, opts usermem.IOOpts) (uint32, error) {
+	return 0, syserror.EFAULT
+}
+
+// LoadUint32 implements usermem.IO.LoadUint32.
+func (b *blockSeqIO) LoadUint32(ctx context.Context, addr usermem.Addr, opts usermem.IOOpts) (uint32, error) {
+	var buf [4]byte
+	if _, err := b.CopyIn(ctx, addr, buf[:], opts); err != nil {
+		return 0, err
+	}
+	return usermem.ByteOrder.Uint32(buf[:]), nil
+}
@@ -22,9 +22,13 @@ import (
 	"sync"
 	"testing"
 
+	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
 	_ "gvisor.googlesource.com/gvisor/pkg/sentry/fs/tmpfs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/kernel/contexttest"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/memmap"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/platform"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/safemem"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
 )
 
@@ -181,3 +185,356 @@ func makeOverlayTestFiles(t *testing.T) []*overlayTestFile {
 
 	return files
 }
+
+// newTestOverlay returns the root of an overlay of two tmpfs mounts and the
+// roots of its upper and lower mounts. The lower mount has lowerFlags and
+// holds files, by name. If upperRevalidates is set, the upper mount
+// revalidates its Dirents, as if it could change behind the overlay. Tests
+// change the mounts behind the overlay through their roots; see writeTestFile.
+func newTestOverlay(ctx context.Context, t *testing.T, lowerFlags fs.MountSourceFlags, upperRevalidates bool, files map[string][]byte) (root, upperRoot, lowerRoot *fs.Dirent) {
+	t.Helper()
+	fsys, _ := fs.FindFilesystem("tmpfs")
+	lower, err := fsys.Mount(ctx, "", fs.MountSourceFlags{}, "", nil)
+	if err != nil {
+		t.Fatalf("failed to mount tmpfs: %v", err)
+	}
+	lowerRoot = fs.NewDirent(lower, "")
+	for name, content := range files {
+		writeTestFile(ctx, t, lowerRoot, name, content, 0)
+	}
+	lower.MountSource.Flags = lowerFlags
+
+	upper, err := fsys.Mount(ctx, "", fs.MountSourceFlags{}, "", nil)
+	if err != nil {
+		t.Fatalf("failed to mount tmpfs: %v", err)
+	}
+	if upperRevalidates {
+		upper.MountSource.MountSourceOperations = fs.NewRevalidatingMountSource(nil, fs.MountSourceFlags{}).MountSourceOperations
+	}
+	overlay, err := fs.NewOverlayRoot(ctx, upper, lower, fs.MountSourceFlags{})
+	if err != nil {
+		t.Fatalf("failed to construct overlay root: %v", err)
+	}
+	mns, err := fs.NewMountNamespace(ctx, overlay)
+	if err != nil {
+		t.Fatalf("failed to construct mount manager: %v", err)
+	}
+	return mns.Root(), fs.NewDirent(upper, ""), lowerRoot
+}
+
+// writeTestFile writes content at offset to the file name in dir, creating it
+// if needed, even if its mount is read-only.
+func writeTestFile(ctx context.Context, t *testing.T, dir *fs.Dirent, name string, content []byte, offset int64) {
+	t.Helper()
+	msrc := dir.Inode.MountSource
+	readOnly := msrc.Flags.ReadOnly
+	msrc.Flags.ReadOnly = false
+	defer func() { msrc.Flags.ReadOnly = readOnly }()
+
+	flags := fs.FileFlags{Read: true, Write: true}
+	var f *fs.File
+	d, err := dir.Walk(ctx, dir, name)
+	if err == nil {
+		f, err = d.Inode.GetFile(ctx, d, flags)
+		d.DecRef()
+	} else {
+		f, err = dir.Create(ctx, dir, name, flags, fs.FilePermsFromMode(0666))
+	}
+	if err != nil {
+		t.Fatalf("failed to open file %q: %v", name, err)
+	}
+	defer f.DecRef()
+	if _, err := f.Pwritev(ctx, usermem.BytesIOSequence(content), offset); err != nil {
+		t.Fatalf("failed to write to file %q: %v", name, err)
+	}
+}
+
+// checkContent checks that f holds want.
+func checkContent(ctx context.Context, t *testing.T, f *fs.File, want []byte) {
+	t.Helper()
+	got := make([]byte, len(want)+10)
+	n, err := f.Preadv(ctx, usermem.BytesIOSequence(got), 0)
+	if err != nil && err != io.EOF {
+		t.Fatalf("read got error %v, want nil", err)
+	}
+	if !bytes.Equal(got[:n], want) {
+		t.Fatalf("file content differs: read %d bytes, want %d", n, len(want))
+	}
+}
+
+// TestLazyCopyUp checks that a large file of an immutable lower filesystem
+// reads back its lower contents, plus what was written to it, while only the
+// blocks written have been copied up. An upper filesystem that may not keep
+// its Inodes in memory can't track which blocks were copied, so the file is
+// then copied up in full.
+func TestLazyCopyUp(t *testing.T) {
+	for _, test := range []struct {
+		desc             string
+		upperRevalidates bool
+		lazy             bool
+	}{
+		{
+			desc: "static upper",
+			lazy: true,
+		},
+		{
+			desc:             "revalidating upper",
+			upperRevalidates: true,
+		},
+	} {
+		t.Run(test.desc, func(t *testing.T) {
+			ctx := contexttest.Context(t)
+
+			// Create a file of a few 32 KiB blocks and a half in an
+			// immutable lower mount.
+			content := make([]byte, 4*32<<10+100)
+			if _, err := rand.Read(content); err != nil {
+				t.Fatalf("failed to read from /dev/urandom: %v", err)
+			}
+			root, _, lowerRoot := newTestOverlay(ctx, t, fs.MountSourceFlags{ReadOnly: true, Immutable: true}, test.upperRevalidates, map[string][]byte{"file": content})
+			defer root.DecRef()
+			d, err := root.Walk(ctx, root, "file")
+			if err != nil {
+				t.Fatalf("failed to find file: %v", err)
+			}
+			defer d.DecRef()
+			f, err := d.Inode.GetFile(ctx, d, fs.FileFlags{Read: true, Write: true})
+			if err != nil {
+				t.Fatalf("failed to open file: %v", err)
+			}
+			defer f.DecRef()
+
+			// Straddle the first two blocks.
+			want := append([]byte(nil), content...)
+			patch := []byte("lazily copied up")
+			off := int64(32<<10 - 5)
+			if _, err := f.Pwritev(ctx, usermem.BytesIOSequence(patch), off); err != nil {
+				t.Fatalf("failed to write to file: %v", err)
+			}
+			copy(want[off:], patch)
+			checkContent(ctx, t, f, want)
+
+			// Blocks that haven't been copied are still read from
+			// the lower file, and copied ones aren't. The test
+			// changes the lower file behind the overlay to tell them
+			// apart.
+			lowerPatch := []byte("still in the lower")
+			writeTestFile(ctx, t, lowerRoot, "file", lowerPatch, 2*32<<10)
+			if test.lazy {
+				copy(want[2*32<<10:], lowerPatch)
+			}
+			writeTestFile(ctx, t, lowerRoot, "file", lowerPatch, 0)
+			checkContent(ctx, t, f, want)
+
+			// Truncating then extending the file must not bring back
+			// lower contents.
+			if err := d.Inode.Truncate(ctx, d, 3*32<<10+7); err != nil {
+				t.Fatalf("failed to truncate file: %v", err)
+			}
+			if err := d.Inode.Truncate(ctx, d, int64(len(content))); err != nil {
+				t.Fatalf("failed to truncate file: %v", err)
+			}
+			for i := 3*32<<10 + 7; i < len(want); i++ {
+				want[i] = 0
+			}
+			checkContent(ctx, t, f, want)
+		})
+	}
+}
+
+// TestCopyUpMutableLower checks that a large file of a read-only lower
+// filesystem that isn't immutable, like a revalidating gofer mount, is copied
+// up in full, so that later changes to the lower file don't show through.
+func TestCopyUpMutableLower(t *testing.T) {
+	ctx := contexttest.Context(t)
+
+	content := make([]byte, 4*32<<10+100)
+	if _, err := rand.Read(content); err != nil {
+		t.Fatalf("failed to read from /dev/urandom: %v", err)
+	}
+	root, _, lowerRoot := newTestOverlay(ctx, t, fs.MountSourceFlags{ReadOnly: true}, false, map[string][]byte{"file": content})
+	defer root.DecRef()
+	d, err := root.Walk(ctx, root, "file")
+	if err != nil {
+		t.Fatalf("failed to find file: %v", err)
+	}
+	defer d.DecRef()
+	f, err := d.Inode.GetFile(ctx, d, fs.FileFlags{Read: true, Write: true})
+	if err != nil {
+		t.Fatalf("failed to open file: %v", err)
+	}
+	defer f.DecRef()
+
+	writeTestFile(ctx, t, lowerRoot, "file", []byte("changed behind the overlay"), 2*32<<10)
+	checkContent(ctx, t, f, content)
+}
+
+// testMappable is a memmap.Mappable of data that maps directly, to test
+// copying up from translations.
+type testMappable struct {
+	data []byte
+
+	// direct is returned by MapsDirectly.
+	direct bool
+
+	// ms and ar are the mapping of the file, if any.
+	ms memmap.MappingSpace
+	ar usermem.AddrRange
+
+	// invalidateAt is the offset of the page whose internal mapping
+	// invalidates the mapping of the file, if not zero.
+	invalidateAt uint64
+}
+
+// MapsDirectly implements fs.directMappable.MapsDirectly.
+func (m *testMappable) MapsDirectly() bool {
+	return m.direct
+}
+
+// AddMapping implements memmap.Mappable.AddMapping.
+func (m *testMappable) AddMapping(ctx context.Context, ms memmap.MappingSpace, ar usermem.AddrRange, offset uint64, writable bool) error {
+	m.ms, m.ar = ms, ar
+	return nil
+}
+
+// RemoveMapping implements memmap.Mappable.RemoveMapping.
+func (m *testMappable) RemoveMapping(ctx context.Context, ms memmap.MappingSpace, ar usermem.AddrRange, offset uint64, writable bool) {
+	m.ms = nil
+}
+
+// CopyMapping implements memmap.Mappable.CopyMapping.
+func (m *testMappable) CopyMapping(ctx context.Context, ms memmap.MappingSpace, srcAR, dstAR usermem.AddrRange, offset uint64, writable bool) error {
+	return m.AddMapping(ctx, ms, dstAR, offset, writable)
+}
+
+// Translate implements memmap.Mappable.Translate. It translates every page
+// separately.
+func (m *testMappable) Translate(ctx context.Context, required, optional memmap.MappableRange, at usermem.AccessType) ([]memmap.Translation, error) {
+	var ts []memmap.Translation
+	for start := optional.Start; start < optional.End; start += usermem.PageSize {
+		ts = append(ts, memmap.Translation{
+			Source: memmap.MappableRange{Start: start, End: start + usermem.PageSize},
+			File:   m,
+			Offset: start,
+		})
+	}
+	return ts, nil
+}
+
+// InvalidateUnsavable implements memmap.Mappable.InvalidateUnsavable.
+func (m *testMappable) InvalidateUnsavable(ctx context.Context) error {
+	return nil
+}
+
+// IncRef implements platform.File.IncRef.
+func (m *testMappable) IncRef(platform.FileRange) {}
+
+// DecRef implements platform.File.DecRef.
+func (m *testMappable) DecRef(platform.FileRange) {}
+
+// MapInternal implements platform.File.MapInternal.
+func (m *testMappable) MapInternal(fr platform.FileRange, at usermem.AccessType) (safemem.BlockSeq, error) {
+	if m.invalidateAt != 0 && fr.Start >= m.invalidateAt && m.ms != nil {
+		m.ms.Invalidate(m.ar, memmap.InvalidateOpts{})
+	}
+	return safemem.BlockSeqOf(safemem.BlockFromSafeSlice(m.data[fr.Start:fr.End])), nil
+}
+
+// FD implements platform.File.FD.
+func (m *testMappable) FD() int {
+	return -1
+}
+
+// TestCopyMapped checks that copy up copies a lower file from its
+// translations if it maps directly, until they are invalidated.
+func TestCopyMapped(t *testing.T) {
+	for _, tc := range []struct {
+		name string
+
+		// direct is returned by MapsDirectly.
+		direct bool
+
+		// invalidateAt is the page whose internal mapping invalidates
+		// the mapping of the lower file.
+		invalidateAt uint64
+
+		// offset and end are the range to copy.
+		offset, end int64
+
+		// want is the offset up to which the range is copied.
+		want int64
+	}{
+		{
+			name:   "not direct",
+			offset: 100,
+			end:    4*usermem.PageSize - 50,
+			want:   100,
+		},
+		{
+			name:   "direct",
+			direct: true,
+			offset: 100,
+			end:    4*usermem.PageSize - 50,
+			want:   4*usermem.PageSize - 50,
+		},
+		{
+			// The page being copied when the mapping is invalidated is
+			// still copied, as its reference keeps it valid, but the
+			// rest is left to the caller to read.
+			name:         "invalidated",
+			direct:       true,
+			invalidateAt: 2 * usermem.PageSize,
+			offset:       100,
+			end:          4*usermem.PageSize - 50,
+			want:         3 * usermem.PageSize,
+		},
+	} {
+		t.Run(tc.name, func(t *testing.T) {
+			ctx := contexttest.Context(t)
+			m := &testMappable{
+				data:         make([]byte, 4*usermem.PageSize),
+				direct:       tc.direct,
+				invalidateAt: tc.invalidateAt,
+			}
+			if _, err := rand.Read(m.data); err != nil {
+				t.Fatalf("failed to read from /dev/urandom: %v", err)
+			}
+
+			fsys, _ := fs.FindFilesystem("tmpfs")
+			upper, err := fsys.Mount(ctx, "", fs.MountSourceFlags{}, "", nil)
+			if err != nil {
+				t.Fatalf("failed to mount tmpfs: %v", err)
+			}
+			upperRoot := fs.NewDirent(upper, "")
+			defer upperRoot.DecRef()
+			f, err := upperRoot.Create(ctx, upperRoot, "file", fs.FileFlags{Read: true, Write: true}, fs.FilePermsFromMode(0666))
+			if err != nil {
+				t.Fatalf("failed to create file: %v", err)
+			}
+			defer f.DecRef()
+
+			if got := fs.CopyMappedForTesting(ctx, f, m, tc.offset, tc.end); got != tc.want {
+				t.Errorf("copyMapped got offset %d, want %d", got, tc.want)
+			}
+			if m.ms != nil {
+				t.Errorf("copyMapped left the lower file mapped at %v", m.ar)
+			}
+			got := make([]byte, len(m.data))
+			n, err := f.Preadv(ctx, usermem.BytesIOSequence(got), 0)
+			if err != nil && err != io.EOF {
+				t.Fatalf("read got error %v, want nil", err)
+			}
+			// Nothing is written if nothing is copied.
+			wantSize := tc.want
+			if tc.want == tc.offset {
+				wantSize = 0
+			}
+			if n != wantSize {
+				t.Fatalf("upper file holds %d bytes, want %d", n, wantSize)
+			}
+			if !bytes.Equal(got[tc.offset:tc.want], m.data[tc.offset:tc.want]) {
+				t.Errorf("upper file content differs from the lower file in [%d, %d)", tc.offset, tc.want)
+			}
+		})
+	}
+}
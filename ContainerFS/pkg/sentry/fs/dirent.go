@@ -23,6 +23,7 @@ import (
 	"syscall"
 
 	"gvisor.googlesource.com/gvisor/pkg/abi/linux"
+	"gvisor.googlesource.com/gvisor/pkg/metric"
 	"gvisor.googlesource.com/gvisor/pkg/refs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/kernel/auth"
@@ -58,6 +59,55 @@ var allDirents = globalDirentMap{
 	dirents: map[*Dirent]struct{}{},
 }
 
+// direntWalkStripes is the number of stripes of a direntWalkCounter.
+const direntWalkStripes = 16
+
+// direntWalkCounter counts walks in Dirent.walk. Each walk is counted in a
+// stripe chosen by the inode of the directory walked, so that walks in
+// different directories don't contend on one counter; walks in the same
+// directory already serialize on its Dirent.mu.
+type direntWalkCounter struct {
+	stripes [direntWalkStripes]struct {
+		n uint64
+
+		// Pad each stripe to its own cache line.
+		_ [56]byte
+	}
+}
+
+// mustCreateDirentWalkCounter returns a direntWalkCounter exported as the
+// metric name.
+func mustCreateDirentWalkCounter(name, description string) *direntWalkCounter {
+	c := &direntWalkCounter{}
+	metric.MustRegisterCustomUint64Metric(name, false /* sync */, description, c.value)
+	return c
+}
+
+// increment counts a walk in dir.
+func (c *direntWalkCounter) increment(dir *Dirent) {
+	atomic.AddUint64(&c.stripes[dir.Inode.StableAttr.InodeID%direntWalkStripes].n, 1)
+}
+
+// value returns the number of walks counted.
+func (c *direntWalkCounter) value() uint64 {
+	var v uint64
+	for i := range c.stripes {
+		v += atomic.LoadUint64(&c.stripes[i].n)
+	}
+	return v
+}
+
+var (
+	// direntChildHits counts the walks that found the child, possibly a
+	// negative Dirent, among the children of its parent Dirent. These are
+	// not lookups in a DirentCache, which only keeps Dirents alive.
+	direntChildHits = mustCreateDirentWalkCounter("/fs/dirent/child_hits", "Number of walks that found the Dirent of the child, possibly negative, among the children of its parent Dirent.")
+
+	// direntChildMisses counts the walks that looked the child up in the
+	// inode of its parent.
+	direntChildMisses = mustCreateDirentWalkCounter("/fs/dirent/child_misses", "Number of walks that looked the child up in the inode of its parent, as it had no valid Dirent for it.")
+)
+
 // renameMu protects the parent of *all* Dirents. (See explanation in
 // lockForRename.)
 //
@@ -495,6 +545,7 @@ func (d *Dirent) walk(ctx context.Context, root *Dirent, name string, walkMayUnl
 				// hard reference on them, and they contain virtually no state). But this is
 				// good house-keeping.
 				child.DecRef()
+				direntChildHits.increment(d)
 				return nil, syscall.ENOENT
 			}
 
@@ -504,6 +555,7 @@ func (d *Dirent) walk(ctx context.Context, root *Dirent, name string, walkMayUnl
 			// to unexpectedly drop out before umount.
 			if cd.mounted || !cd.Inode.MountSource.Revalidate(ctx, name, d.Inode, cd.Inode) {
 				// Good to go. This is the fast-path.
+				direntChildHits.increment(d)
 				return cd, nil
 			}
 
@@ -534,6 +586,7 @@ func (d *Dirent) walk(ctx context.Context, root *Dirent, name string, walkMayUnl
 
 	// Slow path: load the InodeOperations into memory. Since this is a hot path and the lookup may be
 	// expensive, if possible release the lock and re-acquire it.
+	direntChildMisses.increment(d)
 	if walkMayUnlock {
 		d.mu.Unlock()
 	}
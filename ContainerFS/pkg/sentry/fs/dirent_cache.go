@@ -17,12 +17,33 @@ package fs
 import (
 	"fmt"
 	"sync"
+
+	"gvisor.googlesource.com/gvisor/pkg/metric"
+)
+
+var direntCacheEvictions = metric.MustCreateNewUint64Metric("/fs/dirent_cache/evictions", false /* sync */, "Number of Dirents evicted from full dirent caches.")
+
+const (
+	// direntCacheShardSize is the smallest number of Dirents a shard of a
+	// DirentCache holds, so that small caches keep a single, exact LRU.
+	direntCacheShardSize = 64
+
+	// maxDirentCacheShards is the maximum number of shards of a
+	// DirentCache.
+	maxDirentCacheShards = 16
 )
 
 // DirentCache is an LRU cache of Dirents. The Dirent's refCount is
 // incremented when it is added to the cache, and decremented when it is
 // removed.
 //
+// Every Dirent added to a cache bumps or evicts an entry, so that lookups in
+// a busy mount would all serialize on a single lock. Caches of more than
+// direntCacheShardSize Dirents are instead split into shards, each an LRU of
+// its share of maxSize with its own lock, and Dirents are spread across them
+// by inode number. Eviction is then only approximately LRU across the whole
+// cache.
+//
 // A nil DirentCache corresponds to a cache with size 0. All methods can be
 // called, but nothing is actually cached.
 //
@@ -32,66 +53,106 @@ type DirentCache struct {
 	// when cache is nil.
 	maxSize uint64
 
-	// mu protects currentSize and direntList.
-	mu sync.Mutex `state:"nosave"`
+	// shards are the shards of the cache. They are rebuilt empty on
+	// restore, since the cache must be empty on Save.
+	shards []direntCacheShard `state:"nosave"`
+}
+
+// direntCacheShard is a shard of a DirentCache.
+type direntCacheShard struct {
+	// mu protects the fields below.
+	mu sync.Mutex
 
-	// currentSize is the number of elements in the cache. It must be zero (i.e.
-	// the cache must be empty) on Save.
-	currentSize uint64 `state:"zerovalue"`
+	// maxSize is the number of Dirents the shard holds at most.
+	maxSize uint64
+
+	// currentSize is the number of elements in the shard.
+	currentSize uint64
 
 	// list is a direntList, an ilist of Dirents. New Dirents are added
 	// to the front of the list. Old Dirents are removed from the back of
-	// the list. It must be zerovalue (i.e. the cache must be empty) on Save.
-	list direntList `state:"zerovalue"`
+	// the list.
+	list direntList
 }
 
 // NewDirentCache returns a new DirentCache with the given maxSize. If maxSize
-// is 0, nil is returned.
+// is 0, the cache holds nothing.
 func NewDirentCache(maxSize uint64) *DirentCache {
 	return &DirentCache{
 		maxSize: maxSize,
+		shards:  newDirentCacheShards(maxSize),
 	}
 }
 
+// newDirentCacheShards returns the shards of a cache of maxSize Dirents,
+// whose sizes add up to maxSize.
+func newDirentCacheShards(maxSize uint64) []direntCacheShard {
+	n := maxSize / direntCacheShardSize
+	if n < 1 {
+		n = 1
+	}
+	if n > maxDirentCacheShards {
+		n = maxDirentCacheShards
+	}
+	shards := make([]direntCacheShard, n)
+	for i := range shards {
+		shards[i].maxSize = maxSize / n
+		if uint64(i) < maxSize%n {
+			shards[i].maxSize++
+		}
+	}
+	return shards
+}
+
+// shard returns the shard of c that holds d.
+func (c *DirentCache) shard(d *Dirent) *direntCacheShard {
+	if len(c.shards) == 1 || d.Inode == nil {
+		return &c.shards[0]
+	}
+	return &c.shards[d.Inode.StableAttr.InodeID%uint64(len(c.shards))]
+}
+
 // Add adds the element to the cache and increments the refCount. If the
 // argument is already in the cache, it is moved to the front. An element is
-// removed from the back if the cache is over capacity.
+// removed from the back of its shard if the shard is over capacity.
 func (c *DirentCache) Add(d *Dirent) {
 	if c == nil || c.maxSize == 0 {
 		return
 	}
 
-	c.mu.Lock()
-	if c.contains(d) {
+	s := c.shard(d)
+	s.mu.Lock()
+	if s.contains(d) {
 		// d is already in cache. Bump it to the front.
 		// currentSize and refCount are unaffected.
-		c.list.Remove(d)
-		c.list.PushFront(d)
-		c.mu.Unlock()
+		s.list.Remove(d)
+		s.list.PushFront(d)
+		s.mu.Unlock()
 		return
 	}
 
 	// d is not in cache. Add it and take a reference.
-	c.list.PushFront(d)
+	s.list.PushFront(d)
 	d.IncRef()
-	c.currentSize++
+	s.currentSize++
 
 	// Remove the oldest until we are under the size limit.
-	for c.maxSize > 0 && c.currentSize > c.maxSize {
-		c.remove(c.list.Back())
+	for s.currentSize > s.maxSize {
+		s.remove(s.list.Back())
+		direntCacheEvictions.Increment()
 	}
-	c.mu.Unlock()
+	s.mu.Unlock()
 }
 
-func (c *DirentCache) remove(d *Dirent) {
-	if !c.contains(d) {
+func (s *direntCacheShard) remove(d *Dirent) {
+	if !s.contains(d) {
 		panic(fmt.Sprintf("trying to remove %v, which is not in the dirent cache", d))
 	}
-	c.list.Remove(d)
+	s.list.Remove(d)
 	d.SetPrev(nil)
 	d.SetNext(nil)
 	d.DecRef()
-	c.currentSize--
+	s.currentSize--
 }
 
 // Remove removes the element from the cache and decrements its refCount. It
@@ -101,13 +162,14 @@ func (c *DirentCache) Remove(d *Dirent) {
 	if c == nil || c.maxSize == 0 {
 		return
 	}
-	c.mu.Lock()
-	if !c.contains(d) {
-		c.mu.Unlock()
+	s := c.shard(d)
+	s.mu.Lock()
+	if !s.contains(d) {
+		s.mu.Unlock()
 		return
 	}
-	c.remove(d)
-	c.mu.Unlock()
+	s.remove(d)
+	s.mu.Unlock()
 }
 
 // Size returns the number of elements in the cache.
@@ -115,20 +177,31 @@ func (c *DirentCache) Size() uint64 {
 	if c == nil {
 		return 0
 	}
-	c.mu.Lock()
-	size := c.currentSize
-	c.mu.Unlock()
+	var size uint64
+	for i := range c.shards {
+		s := &c.shards[i]
+		s.mu.Lock()
+		size += s.currentSize
+		s.mu.Unlock()
+	}
 	return size
 }
 
 func (c *DirentCache) contains(d *Dirent) bool {
+	s := c.shard(d)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return s.contains(d)
+}
+
+func (s *direntCacheShard) contains(d *Dirent) bool {
 	// If d has a Prev or Next element, then it is in the cache.
 	if d.Prev() != nil || d.Next() != nil {
 		return true
 	}
 	// Otherwise, d is in the cache if it is the only element (and thus the
 	// first element).
-	return c.list.Front() == d
+	return s.list.Front() == d
 }
 
 // Invalidate removes all Dirents from the cache, caling DecRef on each.
@@ -136,9 +209,12 @@ func (c *DirentCache) Invalidate() {
 	if c == nil {
 		return
 	}
-	c.mu.Lock()
-	for c.list.Front() != nil {
-		c.remove(c.list.Front())
+	for i := range c.shards {
+		s := &c.shards[i]
+		s.mu.Lock()
+		for s.list.Front() != nil {
+			s.remove(s.list.Front())
+		}
+		s.mu.Unlock()
 	}
-	c.mu.Unlock()
 }
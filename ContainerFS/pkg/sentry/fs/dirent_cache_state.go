@@ -12,11 +12,9 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-package imgfs
+package fs
 
-import (
-	"gvisor.googlesource.com/gvisor/pkg/sentry/device"
-)
-
-// imgfsFileDevice is the host file virtual device.
-var imgfsFileDevice = device.NewAnonDevice()
+// afterLoad is invoked by stateify.
+func (c *DirentCache) afterLoad() {
+	c.shards = newDirentCacheShards(c.maxSize)
+}
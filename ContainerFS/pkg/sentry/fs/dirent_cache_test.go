@@ -16,6 +16,8 @@ package fs
 
 import (
 	"testing"
+
+	"gvisor.googlesource.com/gvisor/pkg/sentry/context/contexttest"
 )
 
 func TestDirentCache(t *testing.T) {
@@ -110,8 +112,8 @@ func TestDirentCache(t *testing.T) {
 	if got, want := c.Size(), uint64(0); got != want {
 		t.Errorf("c.Size() got %v, want %v", got, want)
 	}
-	if got, want := c.list.Empty(), true; got != want {
-		t.Errorf("c.list.Empty() got %v, want %v", got, want)
+	if got, want := c.shards[0].list.Empty(), true; got != want {
+		t.Errorf("c.shards[0].list.Empty() got %v, want %v", got, want)
 	}
 
 	// Fill cache with maxSize dirents.
@@ -120,6 +122,44 @@ func TestDirentCache(t *testing.T) {
 	}
 }
 
+// TestDirentCacheShards tests that a large cache is split into shards, whose
+// sizes add up to the size of the cache.
+func TestDirentCacheShards(t *testing.T) {
+	const maxSize = 1000
+
+	c := NewDirentCache(maxSize)
+	if len(c.shards) < 2 {
+		t.Fatalf("len(c.shards) got %d, want more than 1", len(c.shards))
+	}
+
+	ctx := contexttest.Context(t)
+	msrc := NewMockMountSource(nil)
+	var ds []*Dirent
+	for i := 0; i < 2*maxSize; i++ {
+		d := NewDirent(NewMockInode(ctx, msrc, StableAttr{InodeID: uint64(i)}), "")
+		c.Add(d)
+		ds = append(ds, d)
+	}
+
+	// Every shard is full.
+	if got, want := c.Size(), uint64(maxSize); got != want {
+		t.Errorf("c.Size() got %v, want %v", got, want)
+	}
+
+	// The oldest Dirents were evicted, the newest were not.
+	if got, want := c.contains(ds[0]), false; got != want {
+		t.Errorf("c.contains(ds[0]) got %v want %v", got, want)
+	}
+	if got, want := c.contains(ds[len(ds)-1]), true; got != want {
+		t.Errorf("c.contains(ds[len(ds)-1]) got %v want %v", got, want)
+	}
+
+	c.Invalidate()
+	if got, want := c.Size(), uint64(0); got != want {
+		t.Errorf("c.Size() got %v, want %v", got, want)
+	}
+}
+
 // TestNilDirentCache tests that a nil cache supports all cache operations, but
 // treats them as noop.
 func TestNilDirentCache(t *testing.T) {
@@ -137,6 +137,28 @@ func TestWalkNegative(t *testing.T) {
 	}
 }
 
+// TestWalkCounts tests that walks that find a child among the children of a
+// Dirent, even a negative one, are counted as hits, and others as misses.
+func TestWalkCounts(t *testing.T) {
+	ctx := contexttest.Context(t)
+	root := NewDirent(NewEmptyDir(ctx, nil), "root")
+	defer root.DecRef()
+
+	hits, misses := direntChildHits.value(), direntChildMisses.value()
+	name := "d"
+	for i := 0; i < 3; i++ {
+		if _, err := root.walk(ctx, root, name, false); err != syscall.ENOENT {
+			t.Fatalf("root.walk(root, %q) got %v, want %v", name, err, syscall.ENOENT)
+		}
+	}
+	if got := direntChildHits.value() - hits; got != 2 {
+		t.Errorf("got %d hits, want %d", got, 2)
+	}
+	if got := direntChildMisses.value() - misses; got != 1 {
+		t.Errorf("got %d misses, want %d", got, 1)
+	}
+}
+
 type mockInodeOperationsLookupNegative struct {
 	*MockInodeOperations
 	releaseCalled bool
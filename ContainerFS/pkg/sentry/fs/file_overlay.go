@@ -188,7 +188,12 @@ func (f *overlayFileOperations) Readdir(ctx context.Context, file *File, seriali
 	// readdirEntries holds o.copyUpMu to ensure that copy-up does not
 	// occur while calculating the readir results.
 	//
-	// However, it is possible for a copy-up to occur after the call to
+	// The entries are cached in o until the upper directory is modified,
+	// if the lower directory is immutable, so the upper and lower
+	// directories are not read again on every open of a directory that
+	// doesn't change.
+	//
+	// It is possible for a copy-up to occur after the call to
 	// readdirEntries, but before setting f.dirCache. This is OK, since
 	// copy-up only does not change the children in a way that would affect
 	// the children returned in dirCache. Copy-up only moves
@@ -200,7 +205,7 @@ func (f *overlayFileOperations) Readdir(ctx context.Context, file *File, seriali
 	// the newly created file may or may not appear in the readdir results.
 	// But this can only be caused by a real race between readdir and
 	// create syscalls, so it's also OK.
-	dirCache, err := readdirEntries(ctx, o)
+	dirCache, err := readdirEntries(ctx, o, overlayUpperStatic(file.Dirent.Inode.MountSource))
 	if err != nil {
 		return file.Offset(), err
 	}
@@ -242,6 +247,9 @@ func (f *overlayFileOperations) Read(ctx context.Context, file *File, dst userme
 			}
 		}
 		f.upperMu.Unlock()
+		if o.lazy != nil {
+			return o.lazy.read(ctx, f.upper, dst, offset)
+		}
 		return f.upper.FileOperations.Read(ctx, f.upper, dst, offset)
 	}
 	return f.lower.FileOperations.Read(ctx, f.lower, dst, offset)
@@ -252,6 +260,12 @@ func (f *overlayFileOperations) Write(ctx context.Context, file *File, src userm
 	// f.upper must be non-nil. See inode_overlay.go:overlayGetFile, where the
 	// file is copied up and opened in the upper filesystem if FileFlags.Write.
 	// Write cannot be called if !FileFlags.Write, see FileOperations.Write.
+	//
+	// The file was copied up before f.upper was opened, so o.lazy is set
+	// by now if its contents are copied lazily.
+	if o := file.Dirent.Inode.overlay; o.lazy != nil {
+		return o.lazy.write(ctx, f.upper, src, offset)
+	}
 	return f.upper.FileOperations.Write(ctx, f.upper, src, offset)
 }
 
@@ -293,6 +307,14 @@ func (f *overlayFileOperations) Flush(ctx context.Context, file *File) error {
 func (*overlayFileOperations) ConfigureMMap(ctx context.Context, file *File, opts *memmap.MMapOpts) error {
 	o := file.Dirent.Inode.overlay
 
+	// The upper file can only be mapped once it holds all of the contents
+	// of the file.
+	if o.lower != nil {
+		if err := o.markMapped(ctx); err != nil {
+			return err
+		}
+	}
+
 	o.copyMu.RLock()
 	defer o.copyMu.RUnlock()
 
@@ -344,7 +366,12 @@ func (*overlayFileOperations) Ioctl(ctx context.Context, io usermem.IO, args arc
 
 // readdirEntries returns a sorted map of directory entries from the
 // upper and/or lower filesystem.
-func readdirEntries(ctx context.Context, o *overlayEntry) (*SortedDentryMap, error) {
+//
+// If cache is set, the upper directory can only be modified through the
+// overlay. If the lower directory is also immutable, the map is then cached
+// in o until the upper directory is modified (see invalidateDir). The map
+// must not be modified.
+func readdirEntries(ctx context.Context, o *overlayEntry, cache bool) (*SortedDentryMap, error) {
 	o.copyMu.RLock()
 	defer o.copyMu.RUnlock()
 
@@ -352,6 +379,16 @@ func readdirEntries(ctx context.Context, o *overlayEntry) (*SortedDentryMap, err
 	if o.upper == nil && o.lower == nil {
 		panic("invalid overlayEntry, needs at least one Inode")
 	}
+	lowerImmutable := o.lower != nil && mountImmutable(o.lower.MountSource)
+	cache = cache && (o.lower == nil || lowerImmutable)
+
+	// dirMu is held while reading the directories so that a modification
+	// that completes meanwhile resets the cache after it is set.
+	o.dirMu.Lock()
+	defer o.dirMu.Unlock()
+	if o.dirCache != nil {
+		return o.dirCache, nil
+	}
 	entries := make(map[string]DentAttr)
 
 	// Try the upper filesystem first.
@@ -365,15 +402,22 @@ func readdirEntries(ctx context.Context, o *overlayEntry) (*SortedDentryMap, err
 
 	// Try the lower filesystem next.
 	if o.lower != nil {
-		lowerEntries, err := readdirOne(ctx, NewTransientDirent(o.lower))
-		if err != nil {
-			return nil, err
+		lowerEntries := o.lowerEntries
+		if lowerEntries == nil {
+			var err error
+			lowerEntries, err = readdirOne(ctx, NewTransientDirent(o.lower))
+			if err != nil {
+				return nil, err
+			}
+			if lowerImmutable {
+				o.lowerEntries = lowerEntries
+			}
 		}
 		for name, entry := range lowerEntries {
 			// Skip this name if it is a negative entry in the
 			// upper or there exists a whiteout for it.
 			if o.upper != nil {
-				if overlayHasWhiteout(o.upper, name) {
+				if o.hasWhiteout(name, cache) {
 					continue
 				}
 			}
@@ -386,7 +430,25 @@ func readdirEntries(ctx context.Context, o *overlayEntry) (*SortedDentryMap, err
 	}
 
 	// Sort and return the entries.
-	return NewSortedDentryMap(entries), nil
+	dirCache := NewSortedDentryMap(entries)
+	if cache {
+		o.dirCache = dirCache
+	}
+	return dirCache, nil
+}
+
+// invalidateDir resets the cached entries and negative lookups of o, a
+// directory whose upper directory has been modified. Copy up doesn't need to
+// reset them, since it only moves files between layers.
+func (o *overlayEntry) invalidateDir() {
+	o.dirMu.Lock()
+	o.dirCache = nil
+	o.dirMu.Unlock()
+
+	o.lookupMu.Lock()
+	o.lookupGen++
+	o.negative = nil
+	o.lookupMu.Unlock()
 }
 
 // readdirOne reads all of the directory entries from d.
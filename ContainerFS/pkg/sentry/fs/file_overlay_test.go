@@ -22,6 +22,7 @@ import (
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/fsutil"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/ramfs"
+	_ "gvisor.googlesource.com/gvisor/pkg/sentry/fs/tmpfs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/kernel/contexttest"
 )
 
@@ -258,6 +259,97 @@ func TestReaddirOverlayFrozen(t *testing.T) {
 	}
 }
 
+// TestReaddirCached tests that the merged entries of an overlay directory are
+// cached until the directory is modified through the overlay, if the upper
+// directory can't change behind the overlay and the lower one is immutable,
+// and that the entries of an immutable lower directory are cached for good.
+func TestReaddirCached(t *testing.T) {
+	for _, test := range []struct {
+		desc             string
+		lowerFlags       fs.MountSourceFlags
+		upperRevalidates bool
+		dirCached        bool
+		lowerCached      bool
+	}{
+		{
+			desc:        "immutable lower",
+			lowerFlags:  fs.MountSourceFlags{ReadOnly: true, Immutable: true},
+			dirCached:   true,
+			lowerCached: true,
+		},
+		{
+			desc:       "read-only lower",
+			lowerFlags: fs.MountSourceFlags{ReadOnly: true},
+		},
+		{
+			desc:             "revalidating upper",
+			lowerFlags:       fs.MountSourceFlags{ReadOnly: true, Immutable: true},
+			upperRevalidates: true,
+			lowerCached:      true,
+		},
+	} {
+		t.Run(test.desc, func(t *testing.T) {
+			ctx := contexttest.Context(t)
+			root, upperRoot, lowerRoot := newTestOverlay(ctx, t, test.lowerFlags, test.upperRevalidates, map[string][]byte{"a": nil, "b": nil})
+			defer root.DecRef()
+			ctx = &rootContext{
+				Context: ctx,
+				root:    root,
+			}
+
+			// check checks that the overlay lists names, along with
+			// "y" and "z", added behind the overlay to the lower and
+			// upper directories, once they are seen.
+			lowerSeen, upperSeen := false, false
+			check := func(names ...string) {
+				t.Helper()
+				want := append([]string{".", ".."}, names...)
+				if lowerSeen {
+					want = append(want, "y")
+				}
+				if upperSeen {
+					want = append(want, "z")
+				}
+				rootFile, err := root.Inode.GetFile(ctx, root, fs.FileFlags{Read: true})
+				if err != nil {
+					t.Fatalf("root.Inode.GetFile failed: %v", err)
+				}
+				defer rootFile.DecRef()
+				ser := &fs.CollectEntriesSerializer{}
+				if err := rootFile.Readdir(ctx, ser); err != nil {
+					t.Fatalf("rootFile.Readdir failed: %v", err)
+				}
+				if got := ser.Order; !reflect.DeepEqual(got, want) {
+					t.Errorf("Readdir got names %v, want %v", got, want)
+				}
+			}
+			check("a", "b")
+			writeTestFile(ctx, t, lowerRoot, "y", nil, 0)
+			writeTestFile(ctx, t, upperRoot, "z", nil, 0)
+			lowerSeen, upperSeen = !test.lowerCached, !test.dirCached
+			check("a", "b")
+
+			// Modifications through the overlay are visible, and
+			// the upper directory is then read again.
+			f, err := root.Create(ctx, root, "c", fs.FileFlags{Read: true}, fs.FilePermsFromMode(0666))
+			if err != nil {
+				t.Fatalf("failed to create file: %v", err)
+			}
+			f.DecRef()
+			upperSeen = true
+			check("a", "b", "c")
+			if err := root.Remove(ctx, root, "a"); err != nil {
+				t.Fatalf("failed to remove file: %v", err)
+			}
+			check("b", "c")
+			if err := fs.Rename(ctx, root, root, "b", root, "d"); err != nil {
+				t.Fatalf("failed to rename file: %v", err)
+			}
+			check("c", "d")
+		})
+	}
+}
+
 type rootContext struct {
 	context.Context
 	root *fs.Dirent
@@ -140,6 +140,13 @@ type MountSourceFlags struct {
 	// cache, even when the platform supports direct mapped I/O. This
 	// doesn't correspond to any Linux mount options.
 	ForcePageCache bool
+
+	// Immutable indicates that the files of the filesystem never change,
+	// neither through the mount nor behind it, so that overlays may cache
+	// what they read from it. A read-only mount isn't necessarily
+	// immutable: the remote files of a gofer mount can still change. This
+	// doesn't correspond to any Linux mount options.
+	Immutable bool
 }
 
 // GenericMountSourceOptions splits a string containing comma separated tokens of the
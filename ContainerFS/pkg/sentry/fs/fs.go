@@ -41,7 +41,7 @@
 //   renameMu
 //     Dirent.dirMu
 //       Dirent.mu
-//         DirentCache.mu
+//         direntCacheShard.mu
 //         Locks in InodeOperations implementations or overlayEntry
 //         Inode.Watches.mu (see `Inotify` for other lock ordering)
 //         MountSource.mu
@@ -0,0 +1,207 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"bytes"
+	"compress/flate"
+	"container/list"
+	"fmt"
+	"io"
+	"sync"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/safemem"
+	"gvisor.googlesource.com/gvisor/pkg/syserror"
+)
+
+// defaultChunkCacheSize is the default limit of the chunk cache of an image,
+// in bytes.
+const defaultChunkCacheSize = 64 << 20
+
+// chunkCache is a cache of decompressed chunks of a compressed image, or of
+// the blocks of file data read in pread mode, shared by all files of the
+// image. It holds at most limit bytes of chunks and evicts the least recently
+// used chunks first.
+type chunkCache struct {
+	limit int64
+
+	mu sync.Mutex
+
+	// size is the total size of the cached chunks.
+	//
+	// size is protected by mu.
+	size int64
+
+	// lru holds the cached chunks, most recently used first.
+	//
+	// lru is protected by mu.
+	lru list.List
+
+	// chunks maps chunk numbers to their element in lru.
+	//
+	// chunks is protected by mu.
+	chunks map[int64]*list.Element
+}
+
+// cachedChunk is a decompressed chunk.
+type cachedChunk struct {
+	chunk int64
+	data  []byte
+}
+
+func newChunkCache(limit int64) *chunkCache {
+	return &chunkCache{
+		limit:  limit,
+		chunks: make(map[int64]*list.Element),
+	}
+}
+
+// get returns the data of chunk c, if it is cached.
+func (cc *chunkCache) get(c int64) ([]byte, bool) {
+	cc.mu.Lock()
+	defer cc.mu.Unlock()
+	e, ok := cc.chunks[c]
+	if !ok {
+		return nil, false
+	}
+	cc.lru.MoveToFront(e)
+	return e.Value.(*cachedChunk).data, true
+}
+
+// add caches data as the contents of chunk c. Chunks are immutable, so
+// slices returned by get remain valid after their chunk is evicted.
+func (cc *chunkCache) add(c int64, data []byte) {
+	cc.mu.Lock()
+	defer cc.mu.Unlock()
+	if _, ok := cc.chunks[c]; ok {
+		// Decompressed concurrently by another reader.
+		return
+	}
+	cc.chunks[c] = cc.lru.PushFront(&cachedChunk{chunk: c, data: data})
+	cc.size += int64(len(data))
+	for cc.size > cc.limit && cc.lru.Len() > 1 {
+		e := cc.lru.Back()
+		old := cc.lru.Remove(e).(*cachedChunk)
+		delete(cc.chunks, old.chunk)
+		cc.size -= int64(len(old.data))
+	}
+}
+
+// flateReaders holds decompressors for reuse.
+var flateReaders sync.Pool
+
+// decompress decompresses src, which holds size bytes of data.
+func decompress(src []byte, size int64) ([]byte, error) {
+	var r io.ReadCloser
+	if v := flateReaders.Get(); v != nil {
+		r = v.(io.ReadCloser)
+		if err := r.(flate.Resetter).Reset(bytes.NewReader(src), nil); err != nil {
+			return nil, err
+		}
+	} else {
+		r = flate.NewReader(bytes.NewReader(src))
+	}
+	defer flateReaders.Put(r)
+
+	data := make([]byte, size)
+	if _, err := io.ReadFull(r, data); err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// chunkSize returns the size of the chunks readChunks reads file data in: the
+// compression chunk size of a compressed image, or bufferBlockSize for an
+// uncompressed image in pread mode, whose chunks are just blocks of the
+// image.
+func (img *imageFile) chunkSize() int64 {
+	if t := img.idx.chunks; t != nil {
+		return t.size
+	}
+	return bufferBlockSize
+}
+
+// chunk returns the data of chunk c of img, decompressed.
+func (img *imageFile) chunk(c int64) ([]byte, error) {
+	if data, ok := img.chunkCache.get(c); ok {
+		return data, nil
+	}
+	var start, end, size int64
+	if t := img.idx.chunks; t != nil {
+		var err error
+		if start, end, size, err = t.chunk(c); err != nil {
+			return nil, err
+		}
+	} else {
+		start = c * bufferBlockSize
+		end = start + bufferBlockSize
+		if end > img.idx.size {
+			end = img.idx.size
+		}
+		if start < 0 || start >= end {
+			return nil, fmt.Errorf("block %d out of range", c)
+		}
+		size = end - start
+	}
+	stored, err := img.readStored(start, end)
+	if err != nil {
+		return nil, err
+	}
+	if end-start == size {
+		// Stored uncompressed; use it in place if it is mapped.
+		if img.mmap == nil {
+			img.chunkCache.add(c, stored)
+		}
+		return stored, nil
+	}
+	data, err := decompress(stored, size)
+	if err != nil {
+		return nil, err
+	}
+	img.chunkCache.add(c, data)
+	return data, nil
+}
+
+// readChunks copies the file data [begin, end) of img to dsts chunk by chunk,
+// for compressed images and images in pread mode.
+func (img *imageFile) readChunks(dsts safemem.BlockSeq, begin, end int64) (uint64, error) {
+	chunkSize := img.chunkSize()
+	var done uint64
+	for off := begin; off < end && !dsts.IsEmpty(); {
+		c := off / chunkSize
+		data, err := img.chunk(c)
+		if err != nil {
+			log.Warningf("imgfs: can't read chunk %d: %v", c, err)
+			return done, syserror.EIO
+		}
+		lo := off - c*chunkSize
+		hi := int64(len(data))
+		if end-c*chunkSize < hi {
+			hi = end - c*chunkSize
+		}
+		if lo >= hi {
+			return done, syserror.EIO
+		}
+		n, err := safemem.CopySeq(dsts, safemem.BlockSeqOf(safemem.BlockFromSafeSlice(data[lo:hi])))
+		done += n
+		off += int64(n)
+		dsts = dsts.DropFirst64(n)
+		if err != nil {
+			return done, err
+		}
+	}
+	return done, nil
+}
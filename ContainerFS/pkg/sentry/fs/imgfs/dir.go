@@ -0,0 +1,296 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"fmt"
+	"strings"
+
+	"gvisor.googlesource.com/gvisor/pkg/abi/linux"
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/fsutil"
+	ktime "gvisor.googlesource.com/gvisor/pkg/sentry/kernel/time"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/socket/unix/transport"
+	"gvisor.googlesource.com/gvisor/pkg/syserror"
+)
+
+// dirInodeOperations implements fs.InodeOperations for a directory of a
+// lazily mounted image, or of a layered mount.
+//
+// Lookup and Readdir are served directly from the image index, or from the
+// merged directory of a layered mount. The inode of
+// a child is only created when it is looked up, and is owned by the Dirent
+// returned from Lookup, so it is released once the Dirent is evicted from the
+// mount's Dirent cache and has no other references.
+type dirInodeOperations struct {
+	fsutil.InodeGenericChecker `state:"nosave"`
+	fsutil.InodeIsDirTruncate  `state:"nosave"`
+	fsutil.InodeNoopRelease    `state:"nosave"`
+	fsutil.InodeNoopWriteOut   `state:"nosave"`
+	fsutil.InodeNotMappable    `state:"nosave"`
+	fsutil.InodeNotRenameable  `state:"nosave"`
+	fsutil.InodeNotSocket      `state:"nosave"`
+	fsutil.InodeNotSymlink     `state:"nosave"`
+	fsutil.InodeVirtual        `state:"nosave"`
+
+	fsutil.InodeSimpleAttributes
+
+	// img is the image this directory belongs to.
+	img *image
+
+	// entry is the index entry of this directory.
+	entry uint32
+
+	// merged is the merged directory if this is a directory of a layered
+	// mount, in which case img and entry are its topmost layer.
+	merged *mergedDir
+}
+
+var _ fs.InodeOperations = (*dirInodeOperations)(nil)
+
+// newDir returns a new fs.Inode for directory i of img.
+func newDir(ctx context.Context, msrc *fs.MountSource, img *image, i uint32) *fs.Inode {
+	return newDirInode(ctx, msrc, img, i, nil)
+}
+
+// newMergedDir returns a new fs.Inode for merged directory m.
+func newMergedDir(ctx context.Context, msrc *fs.MountSource, m *mergedDir) *fs.Inode {
+	return newDirInode(ctx, msrc, m.img, m.entry, m)
+}
+
+// newDirInode returns a new fs.Inode for directory i of img, which is the
+// topmost layer of merged if it isn't nil.
+func newDirInode(ctx context.Context, msrc *fs.MountSource, img *image, i uint32, merged *mergedDir) *fs.Inode {
+	t := ktime.FromNanoseconds(img.idx.modTime(i))
+	owner, perms, links := img.attr(i, fs.RootOwner)
+	if merged != nil {
+		links = 2 + merged.subdirs()
+	}
+	d := &dirInodeOperations{
+		InodeSimpleAttributes: fsutil.NewInodeSimpleAttributesWithUnstable(fs.UnstableAttr{
+			Owner:            owner,
+			Perms:            perms,
+			AccessTime:       t,
+			ModificationTime: t,
+			StatusChangeTime: t,
+			Links:            links,
+		}, linux.TMPFS_MAGIC),
+		img:    img,
+		entry:  i,
+		merged: merged,
+	}
+	return fs.NewInode(d, msrc, stableAttr(img, i, fs.Directory))
+}
+
+// StatFS implements fs.InodeOperations.StatFS.
+func (d *dirInodeOperations) StatFS(context.Context) (fs.Info, error) {
+	return *d.img.info, nil
+}
+
+// newEntryInode returns a new fs.Inode for entry i of img.
+func newEntryInode(ctx context.Context, msrc *fs.MountSource, img *image, i uint32) (*fs.Inode, error) {
+	switch t := img.idx.fileType(i); t {
+	case ImgFSRegularFile:
+		return newInode(ctx, msrc, img, i)
+	case ImgFSDirectory:
+		return newDir(ctx, msrc, img, i), nil
+	case ImgFSSymlink:
+		return newSymlink(ctx, msrc, img, i), nil
+	default:
+		return nil, fmt.Errorf("can't create inode for entry %d of type %v", i, t)
+	}
+}
+
+// inodeType returns the fs.InodeType of index entries of type t.
+func inodeType(t fileType) fs.InodeType {
+	switch t {
+	case ImgFSDirectory:
+		return fs.Directory
+	case ImgFSSymlink:
+		return fs.Symlink
+	default:
+		return fs.RegularFile
+	}
+}
+
+// Lookup implements fs.InodeOperations.Lookup.
+func (d *dirInodeOperations) Lookup(ctx context.Context, dir *fs.Inode, name string) (*fs.Dirent, error) {
+	if d.merged != nil {
+		c, ok := d.merged.lookup(name)
+		if !ok {
+			return fs.NewNegativeDirent(name), nil
+		}
+		if c.dir != nil {
+			return fs.NewDirent(newMergedDir(ctx, dir.MountSource, c.dir), name), nil
+		}
+		inode, err := newEntryInode(ctx, dir.MountSource, c.img, c.entry)
+		if err != nil {
+			log.Warningf("imgfs: lookup of %q failed: %v", name, err)
+			return nil, syserror.EIO
+		}
+		return fs.NewDirent(inode, name), nil
+	}
+
+	i, ok := d.img.idx.lookup(d.entry, name)
+	if !ok || d.img.idx.fileType(i) == ImgFSWhiteoutFile {
+		// Images are immutable, so misses can always be cached.
+		return fs.NewNegativeDirent(name), nil
+	}
+	inode, err := newEntryInode(ctx, dir.MountSource, d.img, i)
+	if err != nil {
+		log.Warningf("imgfs: lookup of %q failed: %v", name, err)
+		return nil, syserror.EIO
+	}
+	return fs.NewDirent(inode, name), nil
+}
+
+// Create implements fs.InodeOperations.Create.
+func (*dirInodeOperations) Create(context.Context, *fs.Inode, string, fs.FileFlags, fs.FilePermissions) (*fs.File, error) {
+	return nil, syserror.EACCES
+}
+
+// CreateDirectory implements fs.InodeOperations.CreateDirectory.
+func (*dirInodeOperations) CreateDirectory(context.Context, *fs.Inode, string, fs.FilePermissions) error {
+	return syserror.EACCES
+}
+
+// CreateLink implements fs.InodeOperations.CreateLink.
+func (*dirInodeOperations) CreateLink(context.Context, *fs.Inode, string, string) error {
+	return syserror.EACCES
+}
+
+// CreateHardLink implements fs.InodeOperations.CreateHardLink.
+func (*dirInodeOperations) CreateHardLink(context.Context, *fs.Inode, *fs.Inode, string) error {
+	return syserror.EACCES
+}
+
+// CreateFifo implements fs.InodeOperations.CreateFifo.
+func (*dirInodeOperations) CreateFifo(context.Context, *fs.Inode, string, fs.FilePermissions) error {
+	return syserror.EACCES
+}
+
+// Remove implements fs.InodeOperations.Remove.
+func (*dirInodeOperations) Remove(context.Context, *fs.Inode, string) error {
+	return syserror.EACCES
+}
+
+// RemoveDirectory implements fs.InodeOperations.RemoveDirectory.
+func (*dirInodeOperations) RemoveDirectory(context.Context, *fs.Inode, string) error {
+	return syserror.EACCES
+}
+
+// Bind implements fs.InodeOperations.Bind.
+func (*dirInodeOperations) Bind(context.Context, *fs.Inode, string, transport.BoundEndpoint, fs.FilePermissions) (*fs.Dirent, error) {
+	return nil, syserror.EACCES
+}
+
+// Getxattr implements fs.InodeOperations.Getxattr. The only extended
+// attributes of an image directory are the overlay whiteouts recorded in the
+// index. Directories of a layered mount have none, since their whiteouts are
+// applied by the merge.
+func (d *dirInodeOperations) Getxattr(_ *fs.Inode, name string) ([]byte, error) {
+	if d.merged != nil || !strings.HasPrefix(name, fs.XattrOverlayWhiteoutPrefix) {
+		return nil, syserror.ENOATTR
+	}
+	i, ok := d.img.idx.lookup(d.entry, strings.TrimPrefix(name, fs.XattrOverlayWhiteoutPrefix))
+	if !ok || d.img.idx.fileType(i) != ImgFSWhiteoutFile {
+		return nil, syserror.ENOATTR
+	}
+	return []byte("y"), nil
+}
+
+// Setxattr implements fs.InodeOperations.Setxattr.
+func (*dirInodeOperations) Setxattr(*fs.Inode, string, []byte) error {
+	return syserror.EPERM
+}
+
+// Listxattr implements fs.InodeOperations.Listxattr.
+func (d *dirInodeOperations) Listxattr(*fs.Inode) (map[string]struct{}, error) {
+	names := make(map[string]struct{})
+	if d.merged != nil {
+		return names, nil
+	}
+	first, count := d.img.idx.children(d.entry)
+	for i := first; i < first+count; i++ {
+		if d.img.idx.fileType(i) == ImgFSWhiteoutFile {
+			names[fs.XattrOverlayWhiteout(string(d.img.idx.name(i)))] = struct{}{}
+		}
+	}
+	return names, nil
+}
+
+// GetFile implements fs.InodeOperations.GetFile.
+func (d *dirInodeOperations) GetFile(ctx context.Context, dirent *fs.Dirent, flags fs.FileFlags) (*fs.File, error) {
+	flags.Pread = true
+	return fs.NewFile(ctx, dirent, flags, &dirFileOperations{iops: d}), nil
+}
+
+// dirFileOperations implements fs.FileOperations for a directory of a lazily
+// mounted image.
+type dirFileOperations struct {
+	fsutil.DirFileOperations `state:"nosave"`
+
+	// iops is the directory being read.
+	iops *dirInodeOperations
+}
+
+var _ fs.FileOperations = (*dirFileOperations)(nil)
+
+// IterateDir implements fs.DirIterator.IterateDir. The offset is the
+// position in the directory's child range of the index, or in the children
+// of the merged directory, which are stable because images never change.
+func (dfo *dirFileOperations) IterateDir(ctx context.Context, dirCtx *fs.DirCtx, offset int) (int, error) {
+	if m := dfo.iops.merged; m != nil {
+		for ; offset < len(m.children); offset++ {
+			c := &m.children[offset]
+			if err := dirCtx.DirEmit(string(c.name), fs.DentAttr{
+				Type:    inodeType(c.img.idx.fileType(c.entry)),
+				InodeID: c.img.inodeID(c.entry),
+			}); err != nil {
+				return offset, err
+			}
+		}
+		return offset, nil
+	}
+
+	idx := dfo.iops.img.idx
+	first, count := idx.children(dfo.iops.entry)
+	for ; offset < int(count); offset++ {
+		i := first + uint32(offset)
+		t := idx.fileType(i)
+		if t == ImgFSWhiteoutFile {
+			continue
+		}
+		if err := dirCtx.DirEmit(string(idx.name(i)), fs.DentAttr{
+			Type:    inodeType(t),
+			InodeID: dfo.iops.img.inodeID(i),
+		}); err != nil {
+			return offset, err
+		}
+	}
+	return offset, nil
+}
+
+// Readdir implements fs.FileOperations.Readdir.
+func (dfo *dirFileOperations) Readdir(ctx context.Context, file *fs.File, serializer fs.DentrySerializer) (int64, error) {
+	root := fs.RootFromContext(ctx)
+	defer root.DecRef()
+	dirCtx := &fs.DirCtx{
+		Serializer: serializer,
+	}
+	return fs.DirentReaddir(ctx, file.Dirent, dfo, root, dirCtx, file.Offset())
+}
@@ -54,5 +54,9 @@ func (r *regularFileOperations) Write(ctx context.Context, file *fs.File, src us
 
 // ConfigureMMap implements fs.FileOperations.ConfigureMMap.
 func (r *regularFileOperations) ConfigureMMap(ctx context.Context, file *fs.File, opts *memmap.MMapOpts) error {
+	// Image files are read-only: shared mappings can never be written.
+	if !opts.Private {
+		opts.MaxPerms.Write = false
+	}
 	return fsutil.GenericConfigureMMap(file, r.iops, opts)
 }
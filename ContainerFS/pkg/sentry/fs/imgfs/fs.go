@@ -17,19 +17,23 @@
 package imgfs
 
 import (
-	"bytes"
-	"encoding/binary"
-	"encoding/gob"
+	"crypto/sha256"
+	"encoding/hex"
 	"fmt"
 	"strconv"
+	"strings"
+	"sync"
 	"syscall"
 
 	// "gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/refs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/device"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/fsutil"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/ramfs"
-	"gvisor.googlesource.com/gvisor/pkg/log"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+	"gvisor.googlesource.com/gvisor/pkg/log"
 )
 
 // FilesystemName is the name under which Filesystem is registered.
@@ -38,6 +42,40 @@ const FilesystemName = "imgfs"
 const (
 	// packageFDKey is the mount option containing an int of package FD
 	packageFDKey = "packageFD"
+
+	// lazyKey is the mount option that enables lazy mode. In lazy mode
+	// inodes are only created when they are looked up, instead of for the
+	// whole image at mount time.
+	lazyKey = "lazy"
+
+	// chunkCacheKey is the mount option limiting the size in bytes of the
+	// decompressed chunk cache of a compressed image.
+	chunkCacheKey = "chunkCacheSize"
+
+	// traceFDKey is the mount option containing the host FD to write an
+	// access trace of the image to. See accessTrace.
+	traceFDKey = "traceFD"
+
+	// prefetchKey is the mount option that enables prefetching the hot
+	// ranges of the image in the background at mount. It defaults to true.
+	prefetchKey = "prefetch"
+
+	// layerFDs is the mount option containing the host FDs of the images of
+	// a layered mount, separated by colons, from the bottom layer to the top
+	// one. It replaces packageFD; see mergedDir. Layered mounts are always
+	// lazy.
+	layerFDsKey = "layerFDs"
+
+	// verityDigestKey is the mount option containing the trusted digests
+	// of the images, printed by zar -verity, in hex and separated by colons
+	// like layerFDs. An image with a digest must have it; images with a
+	// hash tree are verified against it either way. See verityTree.
+	verityDigestKey = "verityDigest"
+
+	// preadKey is the mount option that enables pread mode, in which only
+	// the index of the images is mapped and file data is read with pread
+	// into the chunk cache, whose size bounds it. See mapIndex.
+	preadKey = "pread"
 )
 
 // Filesystem is a pseudo file system that is only available during the setup
@@ -60,13 +98,84 @@ const(
 	ImgFSWhiteoutFile
 )
 
-type fileMetadata struct {
-	Begin int64
-	End int64
-	Name string
-	Link string
-	ModTime int64
-	Type fileType
+// image is a mounted zar image. It is shared by all inodes of a mount.
+type image struct {
+	// imageFile is the open image file, which is shared by every mount of
+	// the image. See openImageFile.
+	*imageFile
+
+	// info is the file system information of the mount, which spans
+	// every layer of a layered mount. See statFS.
+	info *fs.Info
+
+	// trace records accesses to the files of the image, if enabled.
+	trace *accessTrace
+
+	// dev is the device of the mount. Inode numbers are derived from index
+	// entry numbers rather than allocated, so an inode that is dropped and
+	// recreated keeps its number.
+	dev *device.Device
+
+	// inoBase is added to the inode numbers of the image, so that the
+	// layers of a layered mount, which share dev, don't share inode
+	// numbers.
+	inoBase uint64
+}
+
+// imageFile is an open zar image file: its mapping, its index and the state
+// derived from its contents. It is referenced by the mounts that use it, and
+// unmapped once the last of them is released. See openImageFile.
+type imageFile struct {
+	refs.AtomicRefCount
+
+	// id identifies the image file.
+	id imageID
+
+	// idx is the index of the image.
+	idx *imageIndex
+
+	// mmap is the read-only mapping of the whole image. Its length is
+	// rounded up to a page boundary. See mapImageFile. It is nil in pread
+	// mode, where only the index is mapped.
+	mmap []byte
+
+	// mapping is the mapping made for the image: the whole image, like
+	// mmap, or only its index in pread mode. It is unmapped on release.
+	mapping []byte
+
+	// size is the size of the image file.
+	size int64
+
+	// packageFD is the host FD of the image file.
+	packageFD int
+
+	// mapper maps the parts of the image that application mappings
+	// reference into the sentry, in pread mode.
+	mapper *fsutil.HostFileMapper
+
+	// chunkCache caches decompressed chunks if the image is compressed,
+	// and blocks of file data in pread mode.
+	chunkCache *chunkCache
+
+	// verity verifies the blocks of the image as they are first used, if
+	// the image has a hash tree.
+	verity *verityTree
+
+	// prefetched ensures the hot ranges of the image are only prefetched
+	// once. See startPrefetch.
+	prefetched sync.Once
+}
+
+// newImage returns a mount of f whose inode numbers are allocated on dev from
+// inoBase.
+func newImage(f *imageFile, dev *device.Device, inoBase uint64) *image {
+	info := statFS(f.size, f.idx.len())
+	return &image{imageFile: f, info: &info, dev: dev, inoBase: inoBase}
+}
+
+// inodeID returns the inode number of entry i.
+func (img *image) inodeID(i uint32) uint64 {
+	return img.inoBase + uint64(i) + 1
 }
 
 var _ fs.Filesystem = (*Filesystem)(nil)
@@ -97,6 +206,18 @@ func (f *Filesystem) Mount(ctx context.Context, _ string, flags fs.MountSourceFl
 	// Parse generic comma-separated key=value options.
 	options := fs.GenericMountSourceOptions(data)
 
+	var layerFDs []int
+	if v, ok := options[layerFDsKey]; ok {
+		for _, s := range strings.Split(v, ":") {
+			fd, err := strconv.ParseInt(s, 10, 32)
+			if err != nil || fd <= 0 {
+				return nil, fmt.Errorf("invalid value for %q: %q", layerFDsKey, v)
+			}
+			layerFDs = append(layerFDs, int(fd))
+		}
+		delete(options, layerFDsKey)
+	}
+
 	// Grab the packageFD if one was specified.
 	if packageFD, ok := options[packageFDKey]; ok {
 		v, err := strconv.ParseInt(packageFD, 10, 32)
@@ -107,101 +228,251 @@ func (f *Filesystem) Mount(ctx context.Context, _ string, flags fs.MountSourceFl
 		delete(options, packageFDKey)
 	}
 
+	if layerFDs != nil {
+		f.packageFD = layerFDs[len(layerFDs)-1]
+	}
 	if (f.packageFD <= 0) {
 		return nil, fmt.Errorf("invalid packageFD when mounting imgfs: %v", f.packageFD)
 	}
 
 	log.Infof("imgfs.packageFD: %v", f.packageFD)
 
+	lazy := false
+	if v, ok := options[lazyKey]; ok {
+		var err error
+		if lazy, err = strconv.ParseBool(v); err != nil {
+			return nil, fmt.Errorf("invalid value for %q: %v", lazyKey, err)
+		}
+		delete(options, lazyKey)
+	}
+
+	chunkCacheSize := int64(defaultChunkCacheSize)
+	if v, ok := options[chunkCacheKey]; ok {
+		var err error
+		if chunkCacheSize, err = strconv.ParseInt(v, 10, 64); err != nil || chunkCacheSize < 0 {
+			return nil, fmt.Errorf("invalid value for %q: %q", chunkCacheKey, v)
+		}
+		delete(options, chunkCacheKey)
+	}
+
+	traceFD := -1
+	if v, ok := options[traceFDKey]; ok {
+		fd, err := strconv.ParseInt(v, 10, 32)
+		if err != nil || fd < 0 {
+			return nil, fmt.Errorf("invalid value for %q: %q", traceFDKey, v)
+		}
+		traceFD = int(fd)
+		delete(options, traceFDKey)
+	}
+
+	prefetch := true
+	if v, ok := options[prefetchKey]; ok {
+		var err error
+		if prefetch, err = strconv.ParseBool(v); err != nil {
+			return nil, fmt.Errorf("invalid value for %q: %v", prefetchKey, err)
+		}
+		delete(options, prefetchKey)
+	}
+
+	pread := false
+	if v, ok := options[preadKey]; ok {
+		var err error
+		if pread, err = strconv.ParseBool(v); err != nil {
+			return nil, fmt.Errorf("invalid value for %q: %v", preadKey, err)
+		}
+		delete(options, preadKey)
+	}
+
+	var digests [][]byte
+	if v, ok := options[verityDigestKey]; ok {
+		for _, s := range strings.Split(v, ":") {
+			d, err := hex.DecodeString(s)
+			if err != nil || (len(d) != 0 && len(d) != sha256.Size) {
+				return nil, fmt.Errorf("invalid value for %q: %q", verityDigestKey, v)
+			}
+			if len(d) == 0 {
+				d = nil
+			}
+			digests = append(digests, d)
+		}
+		delete(options, verityDigestKey)
+	}
+	images := 1
+	if layerFDs != nil {
+		images = len(layerFDs)
+	}
+	if digests == nil {
+		digests = make([][]byte, images)
+	} else if len(digests) != images {
+		return nil, fmt.Errorf("%q has %d digests for %d images", verityDigestKey, len(digests), images)
+	}
+
 	// Fail if the caller passed us more options than we know about.
 	if len(options) > 0 {
 		return nil, fmt.Errorf("unsupported mount options: %v", options)
 	}
 
-	// Construct img file system mount and inode.
-	msrc := fs.NewCachingMountSource(f, flags)
+	fds := layerFDs
+	if fds == nil {
+		fds = []int{f.packageFD}
+	} else if traceFD >= 0 {
+		return nil, fmt.Errorf("%q can't be combined with %q", traceFDKey, layerFDsKey)
+	}
+	files := make([]*imageFile, 0, len(fds))
+	for n, fd := range fds {
+		file, err := openImageFile(fd, digests[n], chunkCacheSize, pread)
+		if err != nil {
+			releaseImageFiles(files)
+			return nil, err
+		}
+		if prefetch {
+			file.startPrefetch()
+		}
+		files = append(files, file)
+	}
 
+	// Images never change, so overlays may cache what they read from
+	// them.
+	flags.Immutable = true
+	mount := func() (*fs.Inode, error) {
+		// Construct img file system mount and inode.
+		msrc := fs.NewCachingMountSource(f, flags)
+		if layerFDs != nil {
+			return mountLayers(ctx, msrc, files), nil
+		}
+		img := newImage(files[0], device.NewAnonDevice(), 0)
+		if traceFD >= 0 {
+			log.Infof("imgfs: tracing accesses to FD %d", traceFD)
+			img.trace = newAccessTrace(img.idx, traceFD)
+		}
+		if lazy {
+			return newDir(ctx, msrc, img, rootEntry), nil
+		}
+		return MountImgRecursive(ctx, msrc, img, rootEntry)
+	}
+	// A traced mount records the accesses of its own container only.
+	key := mountKey(files, lazy || layerFDs != nil, flags)
+	if traceFD >= 0 {
+		key = ""
+	}
+	return shareMount(key, files, mount)
+}
+
+// loadImageFile maps the image open at packageFD, or only its index in pread
+// mode, and reads its index. If digest isn't nil, the image must have a hash
+// tree and that digest.
+func loadImageFile(packageFD int, digest []byte, chunkCacheSize int64, pread bool) (*imageFile, error) {
 	var s syscall.Stat_t
-	err := syscall.Fstat(int(f.packageFD), &s)
+	err := syscall.Fstat(packageFD, &s)
 	if err != nil {
 		return nil, fmt.Errorf("unable to stat package file: %v", err)
 	}
 	log.Infof("stat package file size: %v", s.Size)
 	length := int(s.Size)
-    if length == 0 {
-        return nil, fmt.Errorf("the image file size shouldn't be zero")
-    }
-	// mmap, err := syscall.Mmap(int(f.packageFD), 0, length, syscall.PROT_READ|syscall.PROT_EXEC, syscall.MAP_SHARED)
-	mmap, err := syscall.Mmap(int(f.packageFD), 0, length, syscall.PROT_READ, syscall.MAP_SHARED)
+	if length == 0 {
+		return nil, fmt.Errorf("the image file size shouldn't be zero")
+	}
+	// Map whole pages, so that the last page of the image can be handed out
+	// by MapInternal like any other; the kernel zero fills it past EOF.
+	mapLength, ok := usermem.Addr(length).RoundUp()
+	if !ok {
+		return nil, fmt.Errorf("image file too large: %v bytes", length)
+	}
+	var (
+		mmap []byte
+		base uint64
+	)
+	if pread {
+		mmap, base, err = mapIndex(packageFD, int64(length))
+	} else {
+		mmap, err = mapImageFile(packageFD, int(mapLength))
+	}
 	if err != nil {
-        return nil, fmt.Errorf("can't mmap the package image file, packageFD: %v, length: %v, err: %v", int(f.packageFD), length, err)
+		return nil, fmt.Errorf("can't mmap the package image file, packageFD: %v, length: %v, err: %v", packageFD, length, err)
 	}
-	headerLoc := mmap[length - 10 : length]
-	headerReader := bytes.NewReader(headerLoc)
-	n, err := binary.ReadVarint(headerReader)
+	idx, err := parseImageIndex(mmap[:uint64(length)-base], base)
 	if err != nil {
-		return nil, fmt.Errorf("can't read header location, err: %v", err)
+		unmapImageFile(mmap)
+		return nil, fmt.Errorf("can't read image index, err: %v", err)
 	}
-	header := mmap[int(n) : length - 10]
-	metadataReader := bytes.NewReader(header)
-	var metadata []fileMetadata
-	dec := gob.NewDecoder(metadataReader)
-	errDec := dec.Decode(&metadata)
-	if errDec != nil {
-		  return nil, fmt.Errorf("can't decode metadata data, err: %v", errDec)
+	img := &imageFile{
+		idx:       idx,
+		mapping:   mmap,
+		size:      int64(length),
+		packageFD: packageFD,
 	}
-
-	i := 0
-	return MountImgRecursive(ctx, msrc, metadata, mmap, f.packageFD, &i, len(metadata))
+	readBlock := func(b int64, buf []byte) ([]byte, error) {
+		off := b * verityBlockSize
+		return img.mmap[off : off+int64(len(buf))], nil
+	}
+	if pread {
+		img.mapper = fsutil.NewHostFileMapper()
+		readBlock = func(b int64, buf []byte) ([]byte, error) {
+			return buf, preadFull(packageFD, buf, b*verityBlockSize)
+		}
+		log.Infof("imgfs: mapped the index of the image, [%d, %d)", base, length)
+	} else {
+		img.mmap = mmap
+	}
+	if idx.chunks != nil || pread {
+		img.chunkCache = newChunkCache(chunkCacheSize)
+	}
+	if idx.verity != nil {
+		if img.verity, err = parseVerity(idx.verity, idx.verityOff, idx.table, idx.tableOff, digest, readBlock); err != nil {
+			unmapImageFile(mmap)
+			return nil, fmt.Errorf("can't verify image: %v", err)
+		}
+		// The index is used from now on.
+		if err := img.verity.verify(int64(idx.indexOff), int64(idx.verityOff)); err != nil {
+			unmapImageFile(mmap)
+			return nil, fmt.Errorf("image index is corrupted")
+		}
+		log.Infof("imgfs: verifying image blocks against its hash tree")
+	} else if digest != nil {
+		unmapImageFile(mmap)
+		return nil, fmt.Errorf("image has no hash tree to verify its digest against")
+	}
+	return img, nil
 }
 
-func MountImgRecursive(ctx context.Context, msrc *fs.MountSource, metadata []fileMetadata, mmap []byte, packageFD int, i *int, length int) (*fs.Inode, error) {
+// MountImgRecursive builds the directory inode for index entry dir and,
+// recursively, for everything below it.
+func MountImgRecursive(ctx context.Context, msrc *fs.MountSource, img *image, dir uint32) (*fs.Inode, error) {
 	contents := map[string]*fs.Inode{}
 	var whitoutFiles []string
-	for *i < length {
-		offsetBegin := metadata[*i].Begin
-		offsetEnd := metadata[*i].End
-		fileName := metadata[*i].Name
-		fileType := metadata[*i].Type
-		fileModTime := metadata[*i].ModTime
+	first, count := img.idx.children(dir)
+	for i := first; i < first+count; i++ {
+		fileName := string(img.idx.name(i))
+		fileType := img.idx.fileType(i)
 
 		if fileType == ImgFSRegularFile {
-			inode, err := newInode(ctx, msrc, offsetBegin, offsetEnd, fileModTime, packageFD, mmap)
+			inode, err := newInode(ctx, msrc, img, i)
 			if err != nil {
 				return nil, fmt.Errorf("can't create inode file %v, err: %v", fileName, err)
 			}
 			contents[fileName] = inode
-			*i = *i + 1
 		} else if fileType == ImgFSDirectory {
-			*i = *i + 1
-			if fileName != ".." {
-				var err error
-				contents[fileName], err = MountImgRecursive(ctx, msrc, metadata, mmap, packageFD, i, length)
-				if err != nil {
-					return nil, fmt.Errorf("can't create recursive folder %v, err: %v", fileName, err)
-				}
-			} else {
-				break
+			var err error
+			contents[fileName], err = MountImgRecursive(ctx, msrc, img, i)
+			if err != nil {
+				return nil, fmt.Errorf("can't create recursive folder %v, err: %v", fileName, err)
 			}
 		} else if fileType == ImgFSSymlink {
-			link := metadata[*i].Link
-			inode := newSymlink(ctx, msrc, link)
+			inode := newSymlink(ctx, msrc, img, i)
 			contents[fileName] = inode
-			*i = *i + 1
 		} else if fileType == ImgFSWhiteoutFile {
 			whitoutFiles = append(whitoutFiles, fileName)
-			*i = *i + 1
 		} else {
 			return nil, fmt.Errorf("unknown file type %v (type: %v)", fileName, fileType)
 		}
 	}
-	d := ramfs.NewDir(ctx, contents, fs.RootOwner, fs.FilePermsFromMode(0555))
-	newinode := fs.NewInode(d, msrc, fs.StableAttr{
-		DeviceID:  imgfsFileDevice.DeviceID(),
-		InodeID:   imgfsFileDevice.NextIno(),
-		BlockSize: usermem.PageSize,
-		Type:      fs.Directory,
-	})
+	owner, perms, links := img.attr(dir, fs.RootOwner)
+	d := &ramDir{Dir: ramfs.NewDir(ctx, contents, owner, perms), img: img}
+	// NewDir only counts the directory's own link.
+	for n := uint64(1); n < links; n++ {
+		d.AddLink()
+	}
+	newinode := fs.NewInode(d, msrc, stableAttr(img, dir, fs.Directory))
 
 	for _, fn := range whitoutFiles {
 		newinode.InodeOperations.Setxattr(newinode, fs.XattrOverlayWhiteout(fn), []byte("y"))
@@ -209,6 +480,19 @@ func MountImgRecursive(ctx context.Context, msrc *fs.MountSource, metadata []fil
 	return newinode, nil
 }
 
+// ramDir is a directory of an image mounted eagerly, by MountImgRecursive,
+// whose children are all created at mount.
+type ramDir struct {
+	*ramfs.Dir
+
+	img *image
+}
+
+// StatFS implements fs.InodeOperations.StatFS.
+func (d *ramDir) StatFS(context.Context) (fs.Info, error) {
+	return *d.img.info, nil
+}
+
 func init() {
 	fs.RegisterFilesystem(&Filesystem{})
 }
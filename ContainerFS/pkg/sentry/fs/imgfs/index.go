@@ -0,0 +1,437 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+)
+
+// The image index layout is defined by zar (imgGen/src/fileio/index); see
+// that package for a full description. In short, an image ends with a fixed
+// size trailer pointing at a table of sections, and the metadata is held in
+// an entries section of fixed-width records plus a string table. Everything
+// is read in place from the mapped image.
+const (
+	// imageVersion is the only index version imgfs understands. Version 1
+	// images carried an encoding/gob header and are no longer supported.
+	imageVersion = 2
+
+	trailerSize = 24
+	sectionSize = 24
+	entrySize   = 56
+)
+
+// imageMagic is the last 8 bytes of every image.
+var imageMagic = []byte("zarimage")
+
+// Section kinds.
+const (
+	sectionEntries uint32 = iota + 1
+	sectionStrings
+	sectionChunks
+	sectionHot
+	sectionVerity
+	sectionAttrs
+)
+
+// hotRangeSize is the size of a record of the hot section.
+const hotRangeSize = 16
+
+// attrSize is the size of a record of the attrs section.
+const attrSize = 16
+
+// chunkFlate is the only chunk compression algorithm, raw DEFLATE.
+const chunkFlate = 1
+
+// chunksHeaderSize is the size of the chunks section before the table of
+// chunk offsets.
+const chunksHeaderSize = 16
+
+// Entries section flags.
+const (
+	// entriesSorted indicates that the children of every directory are
+	// sorted by name.
+	entriesSorted = 1 << iota
+
+	// entriesPageAligned indicates that the data of every regular file
+	// but the packed ones starts on a page boundary and is zero padded up
+	// to the next one.
+	entriesPageAligned
+)
+
+// Offsets of the fields of an entry record.
+const (
+	entryBegin      = 0
+	entryEnd        = 8
+	entryModTime    = 16
+	entryNameOffset = 24
+	entryNameLen    = 28
+	entryLinkOffset = 32
+	entryLinkLen    = 36
+	entryFirstChild = 40
+	entryChildCount = 44
+	entryType       = 48
+	entryFlags      = 52
+)
+
+// Entry flags.
+const (
+	// entryOpaque is the flag of a directory that hides the directories of
+	// the same name in lower layers.
+	entryOpaque = 1 << iota
+
+	// entryPacked is the flag of a regular file of a page aligned image
+	// whose data is packed into pages shared with other files.
+	entryPacked
+)
+
+// rootEntry is the index of the root directory entry.
+const rootEntry = 0
+
+// imageIndex is a read-only view of the index of a mapped image. It holds no
+// decoded state: all accessors read the mapped records directly.
+type imageIndex struct {
+	entries []byte
+	strings []byte
+
+	// sorted is true if the children of every directory are sorted by
+	// name, which allows lookups to binary search them.
+	sorted bool
+
+	// pageAligned is true if file data is page aligned in the image, which
+	// allows file pages to be mapped directly from the image.
+	pageAligned bool
+
+	// chunks describes the compressed file data, and is nil if the file
+	// data is stored uncompressed.
+	chunks *chunkTable
+
+	// hot holds the hot section: the ranges of file data accessed at
+	// startup, in the order they were first accessed.
+	hot []byte
+
+	// attrs holds the attrs section, the ownership, permissions and link
+	// count of every entry, or is nil for images that predate it.
+	attrs []byte
+
+	// size is the size of the file data (the whole image if it isn't
+	// compressed), used to validate data ranges.
+	size int64
+
+	// verity holds the verity section, at verityOff, if the image has
+	// one; see verityTree.
+	verity    []byte
+	verityOff uint64
+
+	// table holds the section table and the trailer.
+	table []byte
+
+	// tableOff is the offset of the section table, and indexOff the offset
+	// of the first section other than the verity section: [indexOff,
+	// verityOff) holds the index read at mount.
+	tableOff uint64
+	indexOff uint64
+}
+
+// chunkTable is the table of chunks of a compressed image. Chunk i holds the
+// file data [i*size, (i+1)*size).
+type chunkTable struct {
+	// size is the uncompressed size of all chunks but the last.
+	size int64
+
+	// dataSize is the uncompressed size of the file data.
+	dataSize int64
+
+	// offsets holds the little endian uint64 offset in the image of every
+	// chunk, followed by the end of the last chunk.
+	offsets []byte
+
+	// imageSize is the size of the image.
+	imageSize int64
+}
+
+// parseChunkTable parses the chunks section b of an image of size imageSize.
+func parseChunkTable(b []byte, imageSize int64) (*chunkTable, error) {
+	if len(b) < chunksHeaderSize || (len(b)-chunksHeaderSize)%8 != 0 {
+		return nil, fmt.Errorf("bad chunks section size %d", len(b))
+	}
+	if a := binary.LittleEndian.Uint32(b[4:]); a != chunkFlate {
+		return nil, fmt.Errorf("unsupported chunk compression %d", a)
+	}
+	t := &chunkTable{
+		size:      int64(binary.LittleEndian.Uint32(b[0:])),
+		dataSize:  int64(binary.LittleEndian.Uint64(b[8:])),
+		offsets:   b[chunksHeaderSize:],
+		imageSize: imageSize,
+	}
+	if t.size == 0 || t.dataSize < 0 || int64(len(t.offsets)/8) != (t.dataSize+t.size-1)/t.size+1 {
+		return nil, fmt.Errorf("bad chunk table: %d offsets for %d bytes in chunks of %d", len(t.offsets)/8, t.dataSize, t.size)
+	}
+	return t, nil
+}
+
+// chunk returns the range of chunk c in the image, and its uncompressed
+// size.
+func (t *chunkTable) chunk(c int64) (start, end, size int64, err error) {
+	start = int64(binary.LittleEndian.Uint64(t.offsets[c*8:]))
+	end = int64(binary.LittleEndian.Uint64(t.offsets[(c+1)*8:]))
+	if start < 0 || end < start || end > t.imageSize {
+		return 0, 0, 0, fmt.Errorf("chunk %d [%d, %d) out of range", c, start, end)
+	}
+	size = t.size
+	if rest := t.dataSize - c*t.size; rest < size {
+		size = rest
+	}
+	return start, end, size, nil
+}
+
+// parseImageIndex locates the index of the image whose bytes from offset base
+// to the end are mapped at m. Every section must lie in m.
+func parseImageIndex(m []byte, base uint64) (*imageIndex, error) {
+	if len(m) < trailerSize {
+		return nil, fmt.Errorf("image too small: %d bytes", len(m))
+	}
+	trailer := m[len(m)-trailerSize:]
+	if !bytes.Equal(trailer[16:], imageMagic) {
+		return nil, fmt.Errorf("bad image magic, image must be rebuilt with zar version %d", imageVersion)
+	}
+	if v := binary.LittleEndian.Uint32(trailer[12:]); v != imageVersion {
+		return nil, fmt.Errorf("unsupported image version %d", v)
+	}
+	tableOff := binary.LittleEndian.Uint64(trailer[0:])
+	count := uint64(binary.LittleEndian.Uint32(trailer[8:]))
+	limit := base + uint64(len(m)-trailerSize)
+	if tableOff < base || tableOff > limit || count*sectionSize > limit-tableOff {
+		return nil, fmt.Errorf("section table [%d, +%d) out of range", tableOff, count*sectionSize)
+	}
+
+	imageSize := int64(base) + int64(len(m))
+	x := &imageIndex{size: imageSize, table: m[tableOff-base:], tableOff: tableOff, indexOff: tableOff}
+	for i := uint64(0); i < count; i++ {
+		desc := m[tableOff-base+i*sectionSize:]
+		kind := binary.LittleEndian.Uint32(desc[0:])
+		flags := binary.LittleEndian.Uint32(desc[4:])
+		off := binary.LittleEndian.Uint64(desc[8:])
+		size := binary.LittleEndian.Uint64(desc[16:])
+		if off < base || off > limit || size > limit-off {
+			return nil, fmt.Errorf("section %d [%d, +%d) out of range", kind, off, size)
+		}
+		if kind != sectionVerity && off < x.indexOff {
+			x.indexOff = off
+		}
+		section := m[off-base : off-base+size]
+		switch kind {
+		case sectionEntries:
+			x.entries = section
+			x.sorted = flags&entriesSorted != 0
+			x.pageAligned = flags&entriesPageAligned != 0
+		case sectionStrings:
+			x.strings = section
+		case sectionChunks:
+			t, err := parseChunkTable(section, imageSize)
+			if err != nil {
+				return nil, err
+			}
+			x.chunks = t
+		case sectionHot:
+			if size%hotRangeSize != 0 {
+				return nil, fmt.Errorf("bad hot section size %d", size)
+			}
+			x.hot = section
+		case sectionAttrs:
+			x.attrs = section
+		case sectionVerity:
+			x.verity = section
+			x.verityOff = off
+		}
+	}
+	if len(x.entries) == 0 || len(x.entries)%entrySize != 0 {
+		return nil, fmt.Errorf("bad entries section size %d", len(x.entries))
+	}
+	if x.attrs != nil && len(x.attrs) != len(x.entries)/entrySize*attrSize {
+		return nil, fmt.Errorf("bad attrs section size %d", len(x.attrs))
+	}
+	if x.chunks != nil {
+		// Compressed data can't be mapped from the image.
+		x.size = x.chunks.dataSize
+		x.pageAligned = false
+	}
+	if x.fileType(rootEntry) != ImgFSDirectory {
+		return nil, fmt.Errorf("root entry is not a directory")
+	}
+	return x, nil
+}
+
+// len returns the number of entries.
+func (x *imageIndex) len() uint32 {
+	return uint32(len(x.entries) / entrySize)
+}
+
+func (x *imageIndex) uint32At(i uint32, field int) uint32 {
+	return binary.LittleEndian.Uint32(x.entries[int(i)*entrySize+field:])
+}
+
+func (x *imageIndex) int64At(i uint32, field int) int64 {
+	return int64(binary.LittleEndian.Uint64(x.entries[int(i)*entrySize+field:]))
+}
+
+func (x *imageIndex) str(off, n uint32) []byte {
+	if uint64(off)+uint64(n) > uint64(len(x.strings)) {
+		return nil
+	}
+	return x.strings[off : off+n]
+}
+
+// name returns the name of entry i. It aliases the mapped image and must not
+// be modified.
+func (x *imageIndex) name(i uint32) []byte {
+	return x.str(x.uint32At(i, entryNameOffset), x.uint32At(i, entryNameLen))
+}
+
+// link returns the symlink target of entry i.
+func (x *imageIndex) link(i uint32) string {
+	return string(x.str(x.uint32At(i, entryLinkOffset), x.uint32At(i, entryLinkLen)))
+}
+
+// fileType returns the type of entry i.
+func (x *imageIndex) fileType(i uint32) fileType {
+	return fileType(x.uint32At(i, entryType))
+}
+
+// opaque returns true if directory i hides the directories of the same name
+// in lower layers.
+func (x *imageIndex) opaque(i uint32) bool {
+	return x.uint32At(i, entryFlags)&entryOpaque != 0
+}
+
+// packed returns true if the data of regular file i shares its pages with
+// other files, even though the image is page aligned.
+func (x *imageIndex) packed(i uint32) bool {
+	return x.uint32At(i, entryFlags)&entryPacked != 0
+}
+
+// modTime returns the modification time of entry i in nanoseconds.
+func (x *imageIndex) modTime(i uint32) int64 {
+	return x.int64At(i, entryModTime)
+}
+
+// entryAttr holds the attributes zar recorded for an entry.
+type entryAttr struct {
+	mode  uint32
+	uid   uint32
+	gid   uint32
+	links uint32
+}
+
+// attr returns the attributes of entry i, or false if the image doesn't
+// record attributes.
+func (x *imageIndex) attr(i uint32) (entryAttr, bool) {
+	if x.attrs == nil {
+		return entryAttr{}, false
+	}
+	r := x.attrs[int(i)*attrSize:]
+	return entryAttr{
+		mode:  binary.LittleEndian.Uint32(r[0:]),
+		uid:   binary.LittleEndian.Uint32(r[4:]),
+		gid:   binary.LittleEndian.Uint32(r[8:]),
+		links: binary.LittleEndian.Uint32(r[12:]),
+	}, true
+}
+
+// subdirs returns the number of subdirectories of directory i.
+func (x *imageIndex) subdirs(i uint32) uint64 {
+	var n uint64
+	first, count := x.children(i)
+	for c := first; c < first+count; c++ {
+		if x.fileType(c) == ImgFSDirectory {
+			n++
+		}
+	}
+	return n
+}
+
+// extent returns the data range of regular file i in the image, or in the
+// uncompressed file data if the image is compressed. Files with identical
+// contents may share an extent; since the image is read-only, each file can
+// still be read and mapped independently, and mappings of such files share
+// the same page cache pages.
+func (x *imageIndex) extent(i uint32) (begin, end int64, err error) {
+	begin = x.int64At(i, entryBegin)
+	end = x.int64At(i, entryEnd)
+	if begin < 0 || end < begin || end > x.size {
+		return 0, 0, fmt.Errorf("entry %d has invalid extent [%d, %d)", i, begin, end)
+	}
+	return begin, end, nil
+}
+
+// hotRanges returns the number of ranges in the hot section.
+func (x *imageIndex) hotRanges() int {
+	return len(x.hot) / hotRangeSize
+}
+
+// hotRange returns hot range r, clamped to the file data.
+func (x *imageIndex) hotRange(r int) (begin, end int64) {
+	b := x.hot[r*hotRangeSize:]
+	off := binary.LittleEndian.Uint64(b[0:])
+	n := binary.LittleEndian.Uint64(b[8:])
+	if off > uint64(x.size) {
+		return 0, 0
+	}
+	if n > uint64(x.size)-off {
+		n = uint64(x.size) - off
+	}
+	return int64(off), int64(off + n)
+}
+
+// children returns the range of child entries of directory i. Children
+// always follow their parent; anything else yields an empty range so that a
+// corrupt image can cause neither out of bounds accesses nor loops.
+func (x *imageIndex) children(i uint32) (first, count uint32) {
+	first = x.uint32At(i, entryFirstChild)
+	count = x.uint32At(i, entryChildCount)
+	if n := x.len(); first <= i || first > n || count > n-first {
+		return 0, 0
+	}
+	return first, count
+}
+
+// lookup returns the child of directory dir called name. It doesn't allocate,
+// and takes O(log n) name comparisons for images with sorted directories.
+func (x *imageIndex) lookup(dir uint32, name string) (uint32, bool) {
+	first, count := x.children(dir)
+	if x.sorted {
+		lo, hi := first, first+count
+		for lo < hi {
+			mid := lo + (hi-lo)/2
+			if string(x.name(mid)) < name {
+				lo = mid + 1
+			} else {
+				hi = mid
+			}
+		}
+		if lo < first+count && string(x.name(lo)) == name {
+			return lo, true
+		}
+		return 0, false
+	}
+	for i := first; i < first+count; i++ {
+		if string(x.name(i)) == name {
+			return i, true
+		}
+	}
+	return 0, false
+}
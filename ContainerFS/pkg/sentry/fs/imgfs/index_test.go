@@ -0,0 +1,405 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"encoding/binary"
+	"io/ioutil"
+	"path/filepath"
+	"testing"
+)
+
+// testdata/image.img was written by zar -w -dir src/ from this tree:
+//
+//	printf 'hello, imgfs\n' > src/a
+//	seq 1 2000 > src/big
+//	mkdir src/dir && printf 'nested file\n' > src/dir/b
+//	ln -s dir/b src/link
+
+// readTestImage returns the contents of the test image name.
+func readTestImage(t *testing.T, name string) []byte {
+	t.Helper()
+	img, err := ioutil.ReadFile(filepath.Join("testdata", name))
+	if err != nil {
+		t.Fatalf("can't read test image: %v", err)
+	}
+	return img
+}
+
+// sectionDesc returns the offset in img of the descriptor of its section of
+// kind.
+func sectionDesc(t *testing.T, img []byte, kind uint32) int {
+	t.Helper()
+	trailer := img[len(img)-trailerSize:]
+	tableOff := binary.LittleEndian.Uint64(trailer[0:])
+	count := binary.LittleEndian.Uint32(trailer[8:])
+	for i := uint32(0); i < count; i++ {
+		off := int(tableOff) + int(i)*sectionSize
+		if binary.LittleEndian.Uint32(img[off:]) == kind {
+			return off
+		}
+	}
+	t.Fatalf("test image has no section of kind %d", kind)
+	return 0
+}
+
+// entryField returns the offset in img of field of entry i.
+func entryField(t *testing.T, img []byte, i uint32, field int) int {
+	t.Helper()
+	off := binary.LittleEndian.Uint64(img[sectionDesc(t, img, sectionEntries)+8:])
+	return int(off) + int(i)*entrySize + field
+}
+
+// mustLookup returns the entry at path, a sequence of names from the root.
+func mustLookup(t *testing.T, x *imageIndex, path ...string) uint32 {
+	t.Helper()
+	i := uint32(rootEntry)
+	for _, name := range path {
+		var ok bool
+		if i, ok = x.lookup(i, name); !ok {
+			t.Fatalf("lookup(%d, %q) found nothing", i, name)
+		}
+	}
+	return i
+}
+
+// walkIndex reads every field of every entry reachable from dir, down to
+// depth levels below it, as imgfs does at mount.
+func walkIndex(x *imageIndex, dir uint32, depth int) {
+	if depth == 0 {
+		return
+	}
+	first, count := x.children(dir)
+	for i := first; i < first+count; i++ {
+		x.lookup(dir, string(x.name(i)))
+		x.link(i)
+		x.extent(i)
+		x.attr(i)
+		x.subdirs(i)
+		if x.fileType(i) == ImgFSDirectory {
+			walkIndex(x, i, depth-1)
+		}
+	}
+}
+
+// TestParseImageIndex checks that imgfs reads back the index of an image
+// written by zar.
+func TestParseImageIndex(t *testing.T) {
+	img := readTestImage(t, "image.img")
+	x, err := parseImageIndex(img, 0)
+	if err != nil {
+		t.Fatalf("parseImageIndex failed: %v", err)
+	}
+	if !x.sorted {
+		t.Errorf("index isn't sorted")
+	}
+	if got, want := x.len(), uint32(6); got != want {
+		t.Errorf("index has %d entries, want %d", got, want)
+	}
+
+	var names []string
+	first, count := x.children(rootEntry)
+	for i := first; i < first+count; i++ {
+		names = append(names, string(x.name(i)))
+	}
+	if got, want := names, []string{"a", "big", "dir", "link"}; !equalStrings(got, want) {
+		t.Errorf("root has children %q, want %q", got, want)
+	}
+	if _, ok := x.lookup(rootEntry, "missing"); ok {
+		t.Errorf("lookup of a missing name succeeded")
+	}
+
+	for _, f := range []struct {
+		path []string
+		data string
+	}{
+		{[]string{"a"}, "hello, imgfs\n"},
+		{[]string{"dir", "b"}, "nested file\n"},
+	} {
+		i := mustLookup(t, x, f.path...)
+		if ft := x.fileType(i); ft != ImgFSRegularFile {
+			t.Errorf("%q has type %d, want a regular file", f.path, ft)
+		}
+		begin, end, err := x.extent(i)
+		if err != nil {
+			t.Fatalf("extent of %q failed: %v", f.path, err)
+		}
+		if got := string(img[begin:end]); got != f.data {
+			t.Errorf("%q holds %q, want %q", f.path, got, f.data)
+		}
+	}
+
+	dir := mustLookup(t, x, "dir")
+	if ft := x.fileType(dir); ft != ImgFSDirectory {
+		t.Errorf("dir has type %d, want a directory", ft)
+	}
+	if first, count := x.children(dir); count != 1 || string(x.name(first)) != "b" {
+		t.Errorf("dir has children [%d, +%d), want only b", first, count)
+	}
+	if got := x.subdirs(rootEntry); got != 1 {
+		t.Errorf("root has %d subdirectories, want 1", got)
+	}
+
+	link := mustLookup(t, x, "link")
+	if ft := x.fileType(link); ft != ImgFSSymlink {
+		t.Errorf("link has type %d, want a symlink", ft)
+	}
+	if got, want := x.link(link), "dir/b"; got != want {
+		t.Errorf("link points to %q, want %q", got, want)
+	}
+}
+
+func equalStrings(a, b []string) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
+// TestParseImageIndexCorrupt checks that corrupt trailers and section tables
+// are rejected.
+func TestParseImageIndexCorrupt(t *testing.T) {
+	good := readTestImage(t, "image.img")
+	trailer := len(good) - trailerSize
+	for _, test := range []struct {
+		desc    string
+		corrupt func(img []byte) []byte
+	}{
+		{
+			desc:    "truncated image",
+			corrupt: func(img []byte) []byte { return img[:trailerSize-1] },
+		},
+		{
+			desc:    "truncated trailer",
+			corrupt: func(img []byte) []byte { return img[:len(img)-1] },
+		},
+		{
+			desc: "bad magic",
+			corrupt: func(img []byte) []byte {
+				img[len(img)-1] ^= 0xff
+				return img
+			},
+		},
+		{
+			desc: "bad version",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint32(img[trailer+12:], imageVersion+1)
+				return img
+			},
+		},
+		{
+			desc: "section table past the end",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[trailer:], uint64(len(img)))
+				return img
+			},
+		},
+		{
+			desc: "section table offset overflow",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[trailer:], ^uint64(0))
+				return img
+			},
+		},
+		{
+			desc: "section count past the end",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint32(img[trailer+8:], 1<<20)
+				return img
+			},
+		},
+		{
+			desc: "section count overflow",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint32(img[trailer+8:], ^uint32(0))
+				return img
+			},
+		},
+		{
+			desc: "entries section past the end",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[sectionDesc(t, img, sectionEntries)+8:], uint64(len(img)))
+				return img
+			},
+		},
+		{
+			desc: "entries section offset overflow",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[sectionDesc(t, img, sectionEntries)+8:], ^uint64(0))
+				return img
+			},
+		},
+		{
+			desc: "entries section size overflow",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[sectionDesc(t, img, sectionEntries)+16:], ^uint64(0))
+				return img
+			},
+		},
+		{
+			desc: "partial entry",
+			corrupt: func(img []byte) []byte {
+				off := sectionDesc(t, img, sectionEntries) + 16
+				binary.LittleEndian.PutUint64(img[off:], binary.LittleEndian.Uint64(img[off:])-1)
+				return img
+			},
+		},
+		{
+			desc: "no entries",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[sectionDesc(t, img, sectionEntries)+16:], 0)
+				return img
+			},
+		},
+		{
+			desc: "string table past the end",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint64(img[sectionDesc(t, img, sectionStrings)+16:], uint64(len(img)))
+				return img
+			},
+		},
+		{
+			desc: "attrs of fewer entries",
+			corrupt: func(img []byte) []byte {
+				off := sectionDesc(t, img, sectionAttrs) + 16
+				binary.LittleEndian.PutUint64(img[off:], binary.LittleEndian.Uint64(img[off:])-attrSize)
+				return img
+			},
+		},
+		{
+			desc: "root isn't a directory",
+			corrupt: func(img []byte) []byte {
+				binary.LittleEndian.PutUint32(img[entryField(t, img, rootEntry, entryType):], uint32(ImgFSRegularFile))
+				return img
+			},
+		},
+	} {
+		t.Run(test.desc, func(t *testing.T) {
+			img := test.corrupt(append([]byte(nil), good...))
+			if _, err := parseImageIndex(img, 0); err == nil {
+				t.Errorf("parseImageIndex succeeded, want error")
+			}
+		})
+	}
+}
+
+// TestImageIndexCorruptEntries checks that corrupt child ranges, extents and
+// string offsets of entries yield errors or empty results.
+func TestImageIndexCorruptEntries(t *testing.T) {
+	good := readTestImage(t, "image.img")
+	x, err := parseImageIndex(good, 0)
+	if err != nil {
+		t.Fatalf("parseImageIndex failed: %v", err)
+	}
+	a := mustLookup(t, x, "a")
+	dir := mustLookup(t, x, "dir")
+	link := mustLookup(t, x, "link")
+
+	// put returns a corruption that sets field of entry i to v.
+	put := func(i uint32, field int, v uint64) func(img []byte) {
+		return func(img []byte) {
+			off := entryField(t, img, i, field)
+			switch field {
+			case entryBegin, entryEnd, entryModTime:
+				binary.LittleEndian.PutUint64(img[off:], v)
+			default:
+				binary.LittleEndian.PutUint32(img[off:], uint32(v))
+			}
+		}
+	}
+	noChildren := func(i uint32) func(t *testing.T, x *imageIndex) {
+		return func(t *testing.T, x *imageIndex) {
+			if first, count := x.children(i); count != 0 {
+				t.Errorf("children(%d) got [%d, +%d), want none", i, first, count)
+			}
+		}
+	}
+	badExtent := func(t *testing.T, x *imageIndex) {
+		if begin, end, err := x.extent(a); err == nil {
+			t.Errorf("extent got [%d, %d), want error", begin, end)
+		}
+	}
+	noName := func(t *testing.T, x *imageIndex) {
+		if got := x.name(a); got != nil {
+			t.Errorf("name got %q, want nil", got)
+		}
+		if _, ok := x.lookup(rootEntry, "a"); ok {
+			t.Errorf("lookup of a corrupt name succeeded")
+		}
+	}
+	noLink := func(t *testing.T, x *imageIndex) {
+		if got := x.link(link); got != "" {
+			t.Errorf("link got %q, want none", got)
+		}
+	}
+	for _, test := range []struct {
+		desc    string
+		corrupt func(img []byte)
+		check   func(t *testing.T, x *imageIndex)
+	}{
+		{"root is its own child", put(rootEntry, entryFirstChild, rootEntry), noChildren(rootEntry)},
+		{"child precedes its parent", put(dir, entryFirstChild, uint64(dir)), noChildren(dir)},
+		{"children past the end", put(dir, entryFirstChild, uint64(x.len()+1)), noChildren(dir)},
+		{"child count past the end", put(rootEntry, entryChildCount, uint64(x.len())), noChildren(rootEntry)},
+		{"child count overflow", put(dir, entryChildCount, uint64(^uint32(0))), noChildren(dir)},
+		{"negative extent", put(a, entryBegin, ^uint64(0)), badExtent},
+		{"extent ending before it begins", put(a, entryBegin, uint64(len(good)-1)), badExtent},
+		{"extent past the end", put(a, entryEnd, uint64(len(good)+1)), badExtent},
+		{"name offset past the end", put(a, entryNameOffset, uint64(len(good))), noName},
+		{"name offset overflow", put(a, entryNameOffset, uint64(^uint32(0))), noName},
+		{"name length past the end", put(a, entryNameLen, uint64(^uint32(0))), noName},
+		{"link offset past the end", put(link, entryLinkOffset, uint64(^uint32(0))), noLink},
+		{"link length past the end", put(link, entryLinkLen, uint64(len(good))), noLink},
+	} {
+		t.Run(test.desc, func(t *testing.T) {
+			img := append([]byte(nil), good...)
+			test.corrupt(img)
+			x, err := parseImageIndex(img, 0)
+			if err != nil {
+				t.Fatalf("parseImageIndex failed: %v", err)
+			}
+			test.check(t, x)
+			walkIndex(x, rootEntry, 8)
+		})
+	}
+}
+
+// TestImageIndexCorruptBytes checks that an image with any one byte of its
+// index corrupted is either rejected or can be walked.
+func TestImageIndexCorruptBytes(t *testing.T) {
+	good := readTestImage(t, "image.img")
+	x, err := parseImageIndex(good, 0)
+	if err != nil {
+		t.Fatalf("parseImageIndex failed: %v", err)
+	}
+	img := make([]byte, len(good))
+	for off := x.indexOff; off < uint64(len(good)); off++ {
+		for _, v := range []byte{0, 0x80, 0xff} {
+			copy(img, good)
+			if img[off] == v {
+				continue
+			}
+			img[off] = v
+			if x, err := parseImageIndex(img, 0); err == nil {
+				walkIndex(x, rootEntry, 8)
+			}
+		}
+	}
+}
@@ -15,17 +15,17 @@
 package imgfs
 
 import (
-	"fmt"
 	"io"
+	"sync"
 
-	"gvisor.googlesource.com/gvisor/pkg/abi/linux"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/fsutil"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/ramfs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/memmap"
-	"gvisor.googlesource.com/gvisor/pkg/sentry/platform"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/pgalloc"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/safemem"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usage"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
 	"gvisor.googlesource.com/gvisor/pkg/syserror"
 )
@@ -44,17 +44,42 @@ type fileInodeOperations struct {
 
 	attr fs.UnstableAttr
 
-	mappings memmap.MappingSet
-
 	mapArea []byte
 	offsetBegin int64
 	offsetEnd int64
 
-	packageFD int
+	// img is the image containing the file, and entry the file's entry in
+	// its index.
+	img   *image `state:"nosave"`
+	entry uint32
+
+	mapsMu sync.Mutex `state:"nosave"`
+
+	// mappings tracks mappings of the file into memmap.MappingSpaces.
+	//
+	// mappings is protected by mapsMu.
+	mappings memmap.MappingSet
+
+	dataMu sync.Mutex `state:"nosave"`
+
+	// cache holds the copied contents of a file that can't be mapped
+	// directly from the image, and mfp provides the memory for it. mfp is
+	// set by the first Translate that needs it.
+	//
+	// cache and mfp are protected by dataMu.
+	cache fsutil.FileRangeSet       `state:"nosave"`
+	mfp   pgalloc.MemoryFileProvider `state:"nosave"`
 }
 
 type Symlink struct {
 	ramfs.Symlink
+
+	img *image
+}
+
+// StatFS implements fs.InodeOperations.StatFS.
+func (s *Symlink) StatFS(context.Context) (fs.Info, error) {
+	return *s.img.info, nil
 }
 
 type ImgReader struct {
@@ -74,21 +99,31 @@ func (r *ImgReader) ReadToBlocks(dsts safemem.BlockSeq) (uint64, error) {
 	if end == r.offset {
 		return 0, nil
 	}
+	if t := r.f.img.trace; t != nil {
+		t.record(r.f.img.idx, r.f.entry, r.f.attr.Size, r.offset, end)
+	}
+	if r.f.img.chunkCache != nil {
+		return r.f.img.readChunks(dsts, r.f.offsetBegin+r.offset, r.f.offsetBegin+end)
+	}
+	if v := r.f.img.verity; v != nil {
+		if err := v.verify(r.f.offsetBegin+r.offset, r.f.offsetBegin+end); err != nil {
+			return 0, err
+		}
+	}
 	src := safemem.BlockSeqOf(safemem.BlockFromSafeSlice(r.f.mapArea[r.f.offsetBegin + r.offset:r.f.offsetEnd]))
 	n, err := safemem.CopySeq(dsts, src)
 	return n, err
 }
 
-var fsInfo = fs.Info{
-	Type: linux.TMPFS_MAGIC,
-
-	// TODO: fsInfo is not correctly implemented for ImgFS
-	TotalBlocks: 0,
-	FreeBlocks:  0,
+// Release implements fs.InodeOperations.Release.
+func (f *fileInodeOperations) Release(context.Context) {
+	f.dataMu.Lock()
+	defer f.dataMu.Unlock()
+	if f.mfp != nil {
+		f.cache.DropAll(f.mfp.MemoryFile())
+	}
 }
 
-func (f *fileInodeOperations) Release(context.Context) {}
-
 // Mappable implements fs.InodeOperations.Mappable.
 func (f *fileInodeOperations) Mappable(*fs.Inode) memmap.Mappable {
 	return f
@@ -151,9 +186,8 @@ func (*fileInodeOperations) IsVirtual() bool {
 }
 
 // StatFS implements fs.InodeOperations.StatFS.
-// TODO: fix fsInfo
-func (*fileInodeOperations) StatFS(context.Context) (fs.Info, error) {
-	return fsInfo, nil
+func (f *fileInodeOperations) StatFS(context.Context) (fs.Info, error) {
+	return *f.img.info, nil
 }
 
 func (f *fileInodeOperations) read(ctx context.Context, file *fs.File, dst usermem.IOSequence, offset int64) (int64, error) {
@@ -171,111 +205,195 @@ func (f *fileInodeOperations) read(ctx context.Context, file *fs.File, dst userm
 }
 
 // AddMapping implements memmap.Mappable.AddMapping.
-// TODO: add mapping support
 func (f *fileInodeOperations) AddMapping(ctx context.Context, ms memmap.MappingSpace, ar usermem.AddrRange, offset uint64, writable bool) error {
-	// f.mappings.AddMapping(ms, ar, offset, false /* writeable */)
+	// Hot path. Avoid defers.
+	f.mapsMu.Lock()
+	mapped := f.mappings.AddMapping(ms, ar, offset, writable)
+	if !usage.IncrementalMappedAccounting && f.direct() {
+		for _, r := range mapped {
+			usage.MemoryAccounting.Inc(r.Length(), usage.Mapped)
+		}
+	}
+	f.mapsMu.Unlock()
 	return nil
 }
 
 // RemoveMapping implements memmap.Mappable.RemoveMapping.
 func (f *fileInodeOperations) RemoveMapping(ctx context.Context, ms memmap.MappingSpace, ar usermem.AddrRange, offset uint64, writable bool) {
-	// f.mappings.RemoveMapping(ms, ar, offset, false /* writeable */)
+	// Hot path. Avoid defers.
+	f.mapsMu.Lock()
+	unmapped := f.mappings.RemoveMapping(ms, ar, offset, writable)
+	if f.direct() {
+		if !usage.IncrementalMappedAccounting {
+			for _, r := range unmapped {
+				usage.MemoryAccounting.Dec(r.Length(), usage.Mapped)
+			}
+		}
+		f.mapsMu.Unlock()
+		return
+	}
+
+	// The image never changes, so copied pages that are no longer mapped
+	// can simply be dropped; they are read again if they are mapped again.
+	f.dataMu.Lock()
+	if f.mfp != nil {
+		mf := f.mfp.MemoryFile()
+		for _, r := range unmapped {
+			f.cache.Drop(r, mf)
+		}
+	}
+	f.dataMu.Unlock()
+	f.mapsMu.Unlock()
 }
 
 // CopyMapping implements memmap.Mappable.CopyMapping.
 func (f *fileInodeOperations) CopyMapping(ctx context.Context, ms memmap.MappingSpace, srcAR, dstAR usermem.AddrRange, offset uint64, writable bool) error {
-	// f.mappings.AddMapping(ctx, ms, dstAR, offset, false /* writeable */)
-	return nil
+	return f.AddMapping(ctx, ms, dstAR, offset, writable)
 }
 
-// IncRef implements platform.File.IncRef.
-func (f *fileInodeOperations) IncRef(fr platform.FileRange) {}
-
-// DecRef implements platform.File.DecRef.
-func (f *fileInodeOperations) DecRef(fr platform.FileRange) {}
+// direct returns true if the file's pages can be mapped straight from the
+// image, which requires the file data to start on a page boundary and its
+// last page to be padded with zeroes rather than followed by other data.
+// Small files packed into shared pages never are, even if they happen to
+// start on a page boundary.
+func (f *fileInodeOperations) direct() bool {
+	return f.img.idx.pageAligned && usermem.Addr(f.offsetBegin).IsPageAligned() && !f.img.idx.packed(f.entry)
+}
 
-func (f *fileInodeOperations) FD() int {
-	return f.packageFD
+// MapsDirectly implements the optional fs.directMappable interface, which
+// lets overlays copy up files translated to the image straight from it. Other
+// files are copied into memory to be translated, and are copied up by reading
+// them instead.
+func (f *fileInodeOperations) MapsDirectly() bool {
+	return f.direct()
 }
 
-func (f *fileInodeOperations) MapInternal(fr platform.FileRange, at usermem.AccessType) (safemem.BlockSeq, error) {
-  const pagesize = uint64(4096)
-	if !fr.WellFormed() || fr.Length() == 0 {
-		panic(fmt.Sprintf("invalid range: %v", fr))
+// Translate implements memmap.Mappable.Translate.
+//
+// Files of page aligned images translate to the image itself, at the
+// absolute offset of the file data. Other files, including the small files
+// packed into shared pages of page aligned images, can't be mapped from the
+// image, since their pages would also map parts of neighbouring files, so
+// their contents are copied into memory on demand instead.
+func (f *fileInodeOperations) Translate(ctx context.Context, required, optional memmap.MappableRange, at usermem.AccessType) ([]memmap.Translation, error) {
+	// Constrain translations to the file size (rounded up), as pages past
+	// that belong to other files or to the index.
+	pgend := fs.OffsetPageEnd(f.attr.Size)
+	var beyondEOF bool
+	if required.End > pgend {
+		if required.Start >= pgend {
+			return nil, &memmap.BusError{io.EOF}
+		}
+		beyondEOF = true
+		required.End = pgend
 	}
-	if at.Execute {
-		return safemem.BlockSeq{}, syserror.EACCES
+	if optional.End > pgend {
+		optional.End = pgend
 	}
-
-	if f.offsetBegin < 0 || f.offsetEnd < 0 {
-		panic(fmt.Sprintf("invalid file offset, don't mmap directory inode"))
+	if t := f.img.trace; t != nil {
+		t.record(f.img.idx, f.entry, f.attr.Size, int64(required.Start), int64(required.End))
 	}
 
-	unsafeBegin := uint64(f.offsetBegin) + fr.Start
-	unsafeEnd := uint64(f.offsetBegin) + fr.End
-
-	boundary := uint64(f.offsetEnd) &^ (pagesize - 1) + pagesize
-
-	if unsafeBegin > boundary {
-		return safemem.BlockSeq{}, syserror.EACCES
+	if f.direct() {
+		if v := f.img.verity; v != nil {
+			// The platform may map the translated pages without going
+			// through MapInternal, so they are verified here. Translate
+			// only what is required, rounded out to huge pages to keep
+			// large mappings cheap, rather than all of optional.
+			window := memmap.MappableRange{uint64(usermem.Addr(required.Start).HugeRoundDown()), required.End}
+			if end, ok := usermem.Addr(required.End).HugeRoundUp(); ok {
+				window.End = uint64(end)
+			}
+			optional = optional.Intersect(window)
+			if err := v.verify(f.offsetBegin+int64(optional.Start), f.offsetBegin+int64(optional.End)); err != nil {
+				return nil, &memmap.BusError{err}
+			}
+		}
+		ts := []memmap.Translation{
+			{
+				Source: optional,
+				File:   f.img,
+				Offset: uint64(f.offsetBegin) + optional.Start,
+			},
+		}
+		if beyondEOF {
+			return ts, &memmap.BusError{io.EOF}
+		}
+		return ts, nil
 	}
 
-	if unsafeEnd > boundary {
-		unsafeEnd = boundary
-		//panic(fmt.Sprintf("invalid unsafeEnd: %v, current boundary: %v, unsafeBegin: %v, unsafeEnd: %v, fr.Start: %v, fr.End: %v, f.offsetBegin: %v, f.offsetEnd: %v\n", unsafeEnd, boundary, unsafeBegin, unsafeEnd, fr.Start, fr.End, f.offsetBegin, f.offsetEnd))
+	f.dataMu.Lock()
+	if f.mfp == nil {
+		f.mfp = pgalloc.MemoryFileProviderFromContext(ctx)
 	}
-
-	/*
-	if unsafeBegin > uint64(f.offsetEnd) {
-		return safemem.BlockSeq{}, syserror.EACCES
+	mf := f.mfp.MemoryFile()
+	cerr := f.cache.Fill(ctx, required, optional, mf, usage.PageCache, f.readToBlocksAt)
+
+	var ts []memmap.Translation
+	var translatedEnd uint64
+	for seg := f.cache.FindSegment(required.Start); seg.Ok() && seg.Start() < required.End; seg, _ = seg.NextNonEmpty() {
+		segMR := seg.Range().Intersect(optional)
+		ts = append(ts, memmap.Translation{
+			Source: segMR,
+			File:   mf,
+			Offset: seg.FileRangeOf(segMR).Start,
+		})
+		translatedEnd = segMR.End
 	}
+	f.dataMu.Unlock()
 
-	if unsafeEnd > uint64(f.offsetEnd) {
-		unsafeEnd = uint64(f.offsetEnd)
+	// Don't return the error returned by f.cache.Fill if it occurred outside
+	// of required.
+	if translatedEnd < required.End && cerr != nil {
+		return ts, &memmap.BusError{cerr}
+	}
+	if beyondEOF {
+		return ts, &memmap.BusError{io.EOF}
 	}
-	*/
-	seq := safemem.BlockSeqOf(safemem.BlockFromSafeSlice(f.mapArea[unsafeBegin:unsafeEnd]))
-	return seq, nil
+	return ts, nil
 }
 
-// Translate implements memmap.Mappable.Translate.
-func (f *fileInodeOperations) Translate(ctx context.Context, required, optional memmap.MappableRange, at usermem.AccessType) ([]memmap.Translation, error) {
-	return []memmap.Translation{
-		{
-			Source: optional,
-			File:   f,
-			Offset: optional.Start,
-		},
-	}, nil
+// readToBlocksAt reads file data at offset into dsts, for f.cache.
+func (f *fileInodeOperations) readToBlocksAt(ctx context.Context, dsts safemem.BlockSeq, offset uint64) (uint64, error) {
+	return (&ImgReader{f, int64(offset)}).ReadToBlocks(dsts)
 }
 
 // InvalidateUnsavable implements memmap.Mappable.InvalidateUnsavable.
 func (f *fileInodeOperations) InvalidateUnsavable(ctx context.Context) error {
+	f.mapsMu.Lock()
+	defer f.mapsMu.Unlock()
 	f.mappings.InvalidateAll(memmap.InvalidateOpts{})
 	return nil
 }
 
-// newInode returns a new fs.Inode
-func newInode(ctx context.Context, msrc *fs.MountSource, begin int64, end int64, modTime int64, packageFD int, m []byte) (*fs.Inode, error) {
-	sattr := stableAttr()
-	uattr := unstableAttr(ctx, begin, end, modTime)
+// newInode returns a new fs.Inode for regular file i of img.
+func newInode(ctx context.Context, msrc *fs.MountSource, img *image, i uint32) (*fs.Inode, error) {
+	begin, end, err := img.idx.extent(i)
+	if err != nil {
+		return nil, err
+	}
+	sattr := stableAttr(img, i, fs.RegularFile)
 	iops := &fileInodeOperations{
-		attr:     uattr,
-		mapArea:	m,
+		mapArea:	img.mmap,
 		offsetBegin:	begin,
 		offsetEnd:		end,
-		packageFD:    packageFD,
+		img:		img,
+		entry:		i,
+	}
+	// Files mapped from the image take whole pages of it.
+	usage := end - begin
+	if iops.direct() {
+		usage = int64(fs.OffsetPageEnd(usage))
+		img.adviseHuge(begin, end)
 	}
+	iops.attr = unstableAttr(ctx, img, i, begin, end, usage)
 	return fs.NewInode(iops, msrc, sattr), nil
 }
 
-// newSymlink returns a new fs.Inode
-func newSymlink(ctx context.Context, msrc *fs.MountSource, target string) *fs.Inode {
-	s := &Symlink{Symlink: *ramfs.NewSymlink(ctx, fs.RootOwner, target)}
-	return fs.NewInode(s, msrc, fs.StableAttr{
-		DeviceID:  imgfsFileDevice.DeviceID(),
-		InodeID:   imgfsFileDevice.NextIno(),
-		BlockSize: usermem.PageSize,
-		Type:      fs.Symlink,
-	})
+// newSymlink returns a new fs.Inode for symlink i of img.
+func newSymlink(ctx context.Context, msrc *fs.MountSource, img *image, i uint32) *fs.Inode {
+	// Symlinks always have permissions 0777.
+	owner, _, _ := img.attr(i, fs.RootOwner)
+	s := &Symlink{Symlink: *ramfs.NewSymlink(ctx, owner, img.idx.link(i)), img: img}
+	return fs.NewInode(s, msrc, stableAttr(img, i, fs.Symlink))
 }
@@ -0,0 +1,168 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"sort"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/device"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
+)
+
+// mergedDir is a directory of a layered mount, which presents the images of
+// several layers as a single tree. It holds the result of looking up every
+// name of the directory through overlays of the layers, computed once at
+// mount, so that path resolution costs the same however many layers there
+// are:
+//
+//   - a name is resolved in the topmost layer that has it;
+//   - a whiteout hides the name in the layers below it;
+//   - a directory is merged with the directories of the same name in the
+//     layers below it, down to the first layer where the name is a whiteout
+//     or not a directory, or where the directory is opaque.
+type mergedDir struct {
+	// img and entry are the directory in the topmost layer that has it,
+	// which gives the merged directory its attributes.
+	img   *image
+	entry uint32
+
+	// children holds the visible children, sorted by name.
+	children []mergedChild
+}
+
+// mergedChild is a child of a mergedDir.
+type mergedChild struct {
+	// name aliases the mapped image.
+	name []byte
+
+	// img and entry are the child in the topmost layer that has it.
+	img   *image
+	entry uint32
+
+	// dir is the merged directory if the child is a directory.
+	dir *mergedDir
+}
+
+// layerDir is a directory of one layer.
+type layerDir struct {
+	img   *image
+	entry uint32
+}
+
+// mergeDirs returns the merged directory of dirs, which are ordered from the
+// top layer down.
+func mergeDirs(dirs []layerDir) *mergedDir {
+	d := &mergedDir{img: dirs[0].img, entry: dirs[0].entry}
+
+	// state tracks every name seen in an upper layer. lower collects the
+	// directories a child directory is merged from, for as long as merging
+	// is set.
+	type state struct {
+		child   int
+		lower   []layerDir
+		merging bool
+	}
+	names := make(map[string]*state)
+	for _, l := range dirs {
+		idx := l.img.idx
+		first, count := idx.children(l.entry)
+		for i := first; i < first+count; i++ {
+			name := idx.name(i)
+			t := idx.fileType(i)
+			if s, ok := names[string(name)]; ok {
+				if s.merging {
+					if t == ImgFSDirectory {
+						s.lower = append(s.lower, layerDir{l.img, i})
+						s.merging = !idx.opaque(i)
+					} else {
+						s.merging = false
+					}
+				}
+				continue
+			}
+
+			s := &state{child: -1}
+			names[string(name)] = s
+			if t == ImgFSWhiteoutFile {
+				continue
+			}
+			s.child = len(d.children)
+			d.children = append(d.children, mergedChild{name: name, img: l.img, entry: i})
+			if t == ImgFSDirectory {
+				s.lower = []layerDir{{l.img, i}}
+				s.merging = !idx.opaque(i)
+			}
+		}
+	}
+
+	for _, s := range names {
+		if s.lower != nil {
+			d.children[s.child].dir = mergeDirs(s.lower)
+		}
+	}
+	sort.Slice(d.children, func(i, j int) bool {
+		return string(d.children[i].name) < string(d.children[j].name)
+	})
+	return d
+}
+
+// subdirs returns the number of subdirectories of d.
+func (d *mergedDir) subdirs() uint64 {
+	var n uint64
+	for i := range d.children {
+		if d.children[i].dir != nil {
+			n++
+		}
+	}
+	return n
+}
+
+// lookup returns the child of d called name.
+func (d *mergedDir) lookup(name string) (*mergedChild, bool) {
+	i := sort.Search(len(d.children), func(i int) bool {
+		return string(d.children[i].name) >= name
+	})
+	if i < len(d.children) && string(d.children[i].name) == name {
+		return &d.children[i], true
+	}
+	return nil, false
+}
+
+// mountLayers mounts the image files of layers, from the bottom layer to the
+// top one, as a single merged tree. Layers share the mount's device, and
+// their inode numbers follow each other.
+func mountLayers(ctx context.Context, msrc *fs.MountSource, files []*imageFile) *fs.Inode {
+	dev := device.NewAnonDevice()
+	var inoBase uint64
+	roots := make([]layerDir, len(files))
+	// The mount spans every layer.
+	info := &fs.Info{}
+	for n, f := range files {
+		img := newImage(f, dev, inoBase)
+		*info = fs.Info{
+			Type:        img.info.Type,
+			TotalBlocks: info.TotalBlocks + img.info.TotalBlocks,
+			TotalFiles:  info.TotalFiles + img.info.TotalFiles,
+		}
+		img.info = info
+		inoBase += uint64(img.idx.len())
+		roots[len(files)-1-n] = layerDir{img, rootEntry}
+	}
+	root := mergeDirs(roots)
+	log.Infof("imgfs: merged %d layers", len(files))
+	return newMergedDir(ctx, msrc, root)
+}
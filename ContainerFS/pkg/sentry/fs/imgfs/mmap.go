@@ -0,0 +1,103 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"fmt"
+	"syscall"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/memmap"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/platform"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/safemem"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+	"gvisor.googlesource.com/gvisor/pkg/syserror"
+)
+
+// image implements platform.File for the whole image file. Offsets are
+// absolute offsets in the image, so a translation to the image can be mapped
+// by the platform straight from the package FD, and the mapped pages are
+// shared through the host page cache with every other user of the image.
+//
+// A mapped image stays mapped for as long as a mount of it is in use (see
+// openImageFile), which outlives every application mapping of its files, so
+// the ranges referenced by translations need no counting of their own. In
+// pread mode, they are counted by img.mapper, which maps them into the
+// sentry when MapInternal first needs them and unmaps them once they are no
+// longer referenced.
+var _ platform.File = (*image)(nil)
+
+// IncRef implements platform.File.IncRef.
+func (img *image) IncRef(fr platform.FileRange) {
+	if img.mapper != nil {
+		img.mapper.IncRefOn(memmap.MappableRange{fr.Start, fr.End})
+	}
+}
+
+// DecRef implements platform.File.DecRef.
+func (img *image) DecRef(fr platform.FileRange) {
+	if img.mapper != nil {
+		img.mapper.DecRefOn(memmap.MappableRange{fr.Start, fr.End})
+	}
+}
+
+// MapInternal implements platform.File.MapInternal.
+//
+// Executable accesses are permitted: the sentry never executes through an
+// internal mapping, and the platform maps executable pages from the package
+// FD, so text segments of binaries and shared objects in the image are
+// mapped without being copied. Writes are never permitted; private mappings
+// are copied on write by the memory manager.
+func (img *image) MapInternal(fr platform.FileRange, at usermem.AccessType) (safemem.BlockSeq, error) {
+	if !fr.WellFormed() || fr.Length() == 0 {
+		panic(fmt.Sprintf("invalid range: %v", fr))
+	}
+	if at.Write {
+		return safemem.BlockSeq{}, syserror.EACCES
+	}
+	if end, _ := usermem.Addr(img.size).RoundUp(); fr.End > uint64(end) {
+		return safemem.BlockSeq{}, syserror.EFAULT
+	}
+	if v := img.verity; v != nil {
+		if err := v.verify(int64(fr.Start), int64(fr.End)); err != nil {
+			return safemem.BlockSeq{}, err
+		}
+	}
+	if img.mmap == nil {
+		return img.mapper.MapInternal(fr, img.packageFD, false)
+	}
+	return safemem.BlockSeqOf(safemem.BlockFromSafeSlice(img.mmap[fr.Start:fr.End])), nil
+}
+
+// adviseHuge asks the host to back the huge pages of file data [begin, end)
+// with transparent huge pages. It does nothing in pread mode, or unless the data starts on a
+// huge page boundary and spans at least one huge page, as zar lays out large
+// files with -hugealign; the partial huge page at the end of the file keeps
+// small pages, as it is followed by other data.
+func (img *image) adviseHuge(begin, end int64) {
+	if img.mmap == nil || begin%usermem.HugePageSize != 0 || end-begin < usermem.HugePageSize {
+		return
+	}
+	last := begin + int64(usermem.Addr(end-begin).HugeRoundDown())
+	if err := syscall.Madvise(img.mmap[begin:last], syscall.MADV_HUGEPAGE); err != nil {
+		// The host doesn't support transparent huge pages.
+		log.Debugf("imgfs: madvise(MADV_HUGEPAGE) of [%d, %d) failed: %v", begin, last, err)
+	}
+}
+
+// FD implements platform.File.FD.
+func (img *image) FD() int {
+	return img.packageFD
+}
@@ -0,0 +1,83 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"reflect"
+	"syscall"
+	"unsafe"
+
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+)
+
+// mapImageFile maps the first length bytes of the image file open at fd,
+// read-only and shared. length must be a multiple of the page size.
+//
+// Images of a huge page or more are mapped at a huge page aligned address, so
+// that file data zar aligned to huge pages in the image (-hugealign) is huge
+// page aligned in the sentry's address space too: hosts with transparent huge
+// pages for the page cache can then back it with huge pages, and the KVM
+// platform, which maps application memory from the sentry's mappings, can map
+// it with huge page table entries.
+func mapImageFile(fd int, length int) ([]byte, error) {
+	if length < usermem.HugePageSize {
+		return syscall.Mmap(fd, 0, length, syscall.PROT_READ, syscall.MAP_SHARED)
+	}
+
+	// Reserve enough address space to hold an aligned range of length
+	// bytes, map the image over that range, and release the rest.
+	reserved := uintptr(length) + usermem.HugePageSize
+	base, _, errno := syscall.Syscall6(
+		syscall.SYS_MMAP,
+		0,
+		reserved,
+		syscall.PROT_NONE,
+		syscall.MAP_PRIVATE|syscall.MAP_ANONYMOUS|syscall.MAP_NORESERVE,
+		^uintptr(0), // -1
+		0)
+	if errno != 0 {
+		return nil, errno
+	}
+	addr := (base + usermem.HugePageSize - 1) &^ (usermem.HugePageSize - 1)
+	if _, _, errno := syscall.Syscall6(
+		syscall.SYS_MMAP,
+		addr,
+		uintptr(length),
+		syscall.PROT_READ,
+		syscall.MAP_SHARED|syscall.MAP_FIXED,
+		uintptr(fd),
+		0); errno != 0 {
+		syscall.Syscall(syscall.SYS_MUNMAP, base, reserved, 0)
+		return nil, errno
+	}
+	if addr > base {
+		syscall.Syscall(syscall.SYS_MUNMAP, base, addr-base, 0)
+	}
+	if end := addr + uintptr(length); end < base+reserved {
+		syscall.Syscall(syscall.SYS_MUNMAP, end, base+reserved-end, 0)
+	}
+
+	var b []byte
+	hdr := (*reflect.SliceHeader)(unsafe.Pointer(&b))
+	hdr.Data = addr
+	hdr.Len = length
+	hdr.Cap = length
+	return b, nil
+}
+
+// unmapImageFile unmaps a mapping returned by mapImageFile.
+func unmapImageFile(b []byte) {
+	syscall.Syscall(syscall.SYS_MUNMAP, uintptr(unsafe.Pointer(&b[0])), uintptr(len(b)), 0)
+}
@@ -0,0 +1,154 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"encoding/binary"
+	"fmt"
+	"io"
+	"syscall"
+
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+)
+
+// In pread mode (see preadKey) only the index of an image is mapped, from
+// the first section to the end of the image, rather than the whole image:
+// with many multi-gigabyte layers per sandbox, mapping whole images costs
+// the sentry address space, VMAs and page tables for data most workloads
+// never touch.
+//
+// File data is then read with pread in blocks of bufferBlockSize, which are
+// kept in the chunk cache, bounded by its size like the decompressed chunks
+// of compressed images. Files mapped by applications are still translated to
+// the image itself, and the parts of the image the sentry needs to access
+// are mapped on demand by an fsutil.HostFileMapper, which unmaps them again
+// once they are no longer mapped by any application.
+
+// bufferBlockSize is the size of the blocks of file data of an uncompressed
+// image read and cached at once in pread mode.
+const bufferBlockSize = 64 << 10
+
+// preadFull reads len(b) bytes of the file open at fd at offset off.
+func preadFull(fd int, b []byte, off int64) error {
+	for len(b) > 0 {
+		n, err := syscall.Pread(fd, b, off)
+		if err == syscall.EINTR {
+			continue
+		}
+		if err != nil {
+			return err
+		}
+		if n == 0 {
+			return io.ErrUnexpectedEOF
+		}
+		b = b[n:]
+		off += int64(n)
+	}
+	return nil
+}
+
+// readTable reads the trailer and the section table of the image of size
+// bytes open at fd, and returns them with the offset of the table. The table
+// is only checked as far as needed to read it; parseImageIndex checks the
+// rest.
+func readTable(fd int, size int64) (table, trailer []byte, tableOff uint64, err error) {
+	if size < trailerSize {
+		return nil, nil, 0, fmt.Errorf("image too small: %d bytes", size)
+	}
+	trailer = make([]byte, trailerSize)
+	if err := preadFull(fd, trailer, size-trailerSize); err != nil {
+		return nil, nil, 0, err
+	}
+	tableOff = binary.LittleEndian.Uint64(trailer[0:])
+	count := uint64(binary.LittleEndian.Uint32(trailer[8:]))
+	limit := uint64(size - trailerSize)
+	if tableOff > limit || count*sectionSize > limit-tableOff {
+		return nil, nil, 0, fmt.Errorf("section table [%d, +%d) out of range", tableOff, count*sectionSize)
+	}
+	table = make([]byte, count*sectionSize)
+	if err := preadFull(fd, table, int64(tableOff)); err != nil {
+		return nil, nil, 0, err
+	}
+	return table, trailer, tableOff, nil
+}
+
+// indexStart returns the offset of the first section of the image of size
+// bytes open at fd, reading only its trailer and section table. Everything
+// from there to the end of the image is the index.
+func indexStart(fd int, size int64) (uint64, error) {
+	table, _, start, err := readTable(fd, size)
+	if err != nil {
+		return 0, err
+	}
+	for i := 0; i < len(table); i += sectionSize {
+		if off := binary.LittleEndian.Uint64(table[i+8:]); off < start {
+			start = off
+		}
+	}
+	return start, nil
+}
+
+// mapIndex maps the index of the image of size bytes open at fd, from the
+// page holding its first section to the end of the image, and returns the
+// mapping and the offset in the image at which it starts.
+func mapIndex(fd int, size int64) ([]byte, uint64, error) {
+	start, err := indexStart(fd, size)
+	if err != nil {
+		return nil, 0, err
+	}
+	base := uint64(usermem.Addr(start).RoundDown())
+	m, err := syscall.Mmap(fd, int64(base), int(size-int64(base)), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, 0, err
+	}
+	return m, base, nil
+}
+
+// readStored returns the bytes [start, end) of img, verified if the image
+// has a hash tree. They alias the mapped image, or, in pread mode, are read
+// into a new buffer.
+func (img *imageFile) readStored(start, end int64) ([]byte, error) {
+	v := img.verity
+	if img.mmap != nil {
+		if v != nil {
+			if err := v.verify(start, end); err != nil {
+				return nil, err
+			}
+		}
+		return img.mmap[start:end], nil
+	}
+
+	// Data read from the file can't be verified once and for all like
+	// mapped data, so the buffer is verified as it is read, whole blocks
+	// of the hash tree at a time.
+	lo, hi := start, end
+	if v != nil {
+		lo = start &^ (verityBlockSize - 1)
+		hi = (end + verityBlockSize - 1) &^ (verityBlockSize - 1)
+		if hi > img.size {
+			hi = img.size
+		}
+	}
+	buf := make([]byte, hi-lo)
+	if err := preadFull(img.packageFD, buf, lo); err != nil {
+		return nil, err
+	}
+	if v != nil {
+		if err := v.check(lo, buf); err != nil {
+			return nil, err
+		}
+	}
+	return buf[start-lo : end-lo], nil
+}
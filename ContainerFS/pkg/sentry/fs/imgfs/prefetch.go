@@ -0,0 +1,88 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"syscall"
+	"time"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+)
+
+// startPrefetch prefetches the hot ranges of img in the background, unless
+// they are already being prefetched for an earlier mount of the image.
+func (img *imageFile) startPrefetch() {
+	if img.idx.hotRanges() == 0 {
+		return
+	}
+	img.prefetched.Do(func() {
+		// Keep the image mapped until the prefetch is done.
+		img.IncRef()
+		go func() { // S/R-SAFE: only warms caches.
+			defer img.release()
+			img.prefetch()
+		}()
+	})
+}
+
+// prefetch brings the hot ranges of img, recorded by zar from an access
+// trace, into memory in the order the workload first accessed them, so that
+// its reads and page faults find them resident. It is run in the background
+// after the first mount of the image.
+//
+// For mapped uncompressed images the ranges are read ahead into the host page
+// cache with madvise(MADV_WILLNEED). For compressed images and images in
+// pread mode they are read into the chunk cache, up to its size, since
+// prefetching more would only evict the earlier, hotter chunks.
+func (img *imageFile) prefetch() {
+	start := time.Now()
+	var bytes int64
+	for r := 0; r < img.idx.hotRanges(); r++ {
+		begin, end := img.idx.hotRange(r)
+		if begin >= end {
+			continue
+		}
+
+		if img.chunkCache != nil {
+			chunkSize := img.chunkSize()
+			for c := begin / chunkSize; c*chunkSize < end; c++ {
+				if bytes >= img.chunkCache.limit {
+					log.Infof("imgfs: prefetch stopped at the chunk cache size, %d bytes in %v", bytes, time.Since(start))
+					return
+				}
+				data, err := img.chunk(c)
+				if err != nil {
+					log.Warningf("imgfs: prefetch of chunk %d failed: %v", c, err)
+					return
+				}
+				bytes += int64(len(data))
+			}
+			continue
+		}
+
+		first := int64(usermem.Addr(begin).RoundDown())
+		last, ok := usermem.Addr(end).RoundUp()
+		if !ok || int64(last) > int64(len(img.mmap)) {
+			continue
+		}
+		if err := syscall.Madvise(img.mmap[first:last], syscall.MADV_WILLNEED); err != nil {
+			log.Warningf("imgfs: prefetch of [%d, %d) failed: %v", first, last, err)
+			return
+		}
+		bytes += int64(last) - first
+	}
+	log.Infof("imgfs: prefetched %d hot ranges, %d bytes in %v", img.idx.hotRanges(), bytes, time.Since(start))
+}
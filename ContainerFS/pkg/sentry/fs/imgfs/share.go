@@ -0,0 +1,231 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"fmt"
+	"strings"
+	"sync"
+	"syscall"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/refs"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
+)
+
+// The containers of a sandbox commonly mount the same images, such as the
+// layers of a base image shared by an application and its sidecars. imgfs
+// shares such mounts at two levels:
+//
+//   - an image file is opened once in the sentry, and every mount of it
+//     shares its mapping, its index, its chunk cache and the blocks of its
+//     hash tree verified so far;
+//   - a mount of the same images, with the same options, as a mount still
+//     in use gets the root inode of that mount, and with it every inode and
+//     Dirent created for it so far, instead of building its own tree.
+//
+// Image files are identified by their host file and a hash of their section
+// table and trailer, which for an image with a hash tree covers its whole
+// contents. The host FDs of the images are never closed by the sentry, so an
+// image opened through one FD is served through that FD to mounts of the
+// same file through another.
+//
+// Each mount holds a reference on the image files it uses, which it drops
+// once its root inode is released by the last container using it. An image
+// file is unmapped and forgotten once no mount uses it, so the images of
+// containers that restart with updated layers don't stay mapped.
+
+// imageID identifies an image file.
+type imageID struct {
+	// dev and ino are the host file of the image, and size and ctime its
+	// size and last change.
+	dev, ino  uint64
+	size      int64
+	ctimeSec  int64
+	ctimeNsec int64
+
+	// sum is the SHA-256 of the section table and trailer of the image.
+	sum [sha256.Size]byte
+
+	// pread is set if the image file is opened in pread mode.
+	pread bool
+}
+
+// imageFiles holds the image files used by a mount, by identity.
+var imageFiles = struct {
+	mu    sync.Mutex
+	files map[imageID]*imageFile
+}{files: make(map[imageID]*imageFile)}
+
+// identifyImage returns the identity of the image open at fd.
+func identifyImage(fd int, pread bool) (imageID, error) {
+	var s syscall.Stat_t
+	if err := syscall.Fstat(fd, &s); err != nil {
+		return imageID{}, fmt.Errorf("unable to stat package file: %v", err)
+	}
+	table, trailer, _, err := readTable(fd, s.Size)
+	if err != nil {
+		return imageID{}, fmt.Errorf("can't read image section table: %v", err)
+	}
+	id := imageID{
+		dev:       s.Dev,
+		ino:       s.Ino,
+		size:      s.Size,
+		ctimeSec:  s.Ctim.Sec,
+		ctimeNsec: s.Ctim.Nsec,
+		pread:     pread,
+	}
+	h := sha256.New()
+	h.Write(table)
+	h.Write(trailer)
+	h.Sum(id.sum[:0])
+	return id, nil
+}
+
+// openImageFile returns the image file open at packageFD, with a reference
+// taken on it, loading it unless it is already open. If digest isn't nil, the
+// image must have a hash tree and that digest. The chunk cache size is that
+// of the first mount of the image.
+func openImageFile(packageFD int, digest []byte, chunkCacheSize int64, pread bool) (*imageFile, error) {
+	id, err := identifyImage(packageFD, pread)
+	if err != nil {
+		return nil, err
+	}
+	imageFiles.mu.Lock()
+	defer imageFiles.mu.Unlock()
+
+	// An image file whose last mount is being released is reloaded.
+	if f, ok := imageFiles.files[id]; ok && f.TryIncRef() {
+		if digest != nil {
+			if f.verity == nil {
+				f.DecRefWithDestructor(f.destroyLocked)
+				return nil, fmt.Errorf("image has no hash tree to verify its digest against")
+			}
+			if !bytes.Equal(f.verity.digest, digest) {
+				f.DecRefWithDestructor(f.destroyLocked)
+				return nil, fmt.Errorf("can't verify image: image digest is %x, want %x", f.verity.digest, digest)
+			}
+		}
+		log.Infof("imgfs: sharing the image open at FD %d for FD %d", f.packageFD, packageFD)
+		return f, nil
+	}
+	f, err := loadImageFile(packageFD, digest, chunkCacheSize, pread)
+	if err != nil {
+		return nil, err
+	}
+	f.id = id
+	imageFiles.files[id] = f
+	return f, nil
+}
+
+// release drops a reference on f, and unmaps it once no mount uses it.
+func (f *imageFile) release() {
+	f.DecRefWithDestructor(func() {
+		imageFiles.mu.Lock()
+		defer imageFiles.mu.Unlock()
+		f.destroyLocked()
+	})
+}
+
+// destroyLocked forgets f and unmaps it. Its host FD is left open, since it
+// belongs to the loader, which may mount it again.
+//
+// Preconditions: imageFiles.mu must be locked, and f must have no
+// references left.
+func (f *imageFile) destroyLocked() {
+	if imageFiles.files[f.id] == f {
+		delete(imageFiles.files, f.id)
+	}
+	log.Infof("imgfs: unmapping the image open at FD %d", f.packageFD)
+	unmapImageFile(f.mapping)
+	f.mapping = nil
+	f.mmap = nil
+}
+
+// releaseImageFiles drops a reference on each of files.
+func releaseImageFiles(files []*imageFile) {
+	for _, f := range files {
+		f.release()
+	}
+}
+
+// sharedMount is a mount that later mounts of the same images can share.
+type sharedMount struct {
+	key  string
+	root *refs.WeakRef
+
+	// files are the image files of the mount, on which it holds a
+	// reference.
+	files []*imageFile
+}
+
+// sharedMounts holds the mounts still in use, by mountKey.
+var sharedMounts = struct {
+	mu     sync.Mutex
+	mounts map[string]*sharedMount
+}{mounts: make(map[string]*sharedMount)}
+
+// mountKey returns the key of a mount of files, from the bottom layer up,
+// which is lazy or not, with flags.
+func mountKey(files []*imageFile, lazy bool, flags fs.MountSourceFlags) string {
+	var b strings.Builder
+	for _, f := range files {
+		fmt.Fprintf(&b, "%d:%d:%x:%t/", f.id.dev, f.id.ino, f.id.sum, f.id.pread)
+	}
+	fmt.Fprintf(&b, "lazy=%t,%+v", lazy, flags)
+	return b.String()
+}
+
+// shareMount returns the root inode of the mount identified by key if it is
+// still in use, and otherwise mounts it with mount. The mount takes over the
+// references on files, which are dropped if it isn't needed. A mount with an
+// empty key is never shared.
+func shareMount(key string, files []*imageFile, mount func() (*fs.Inode, error)) (*fs.Inode, error) {
+	sharedMounts.mu.Lock()
+	defer sharedMounts.mu.Unlock()
+
+	if m, ok := sharedMounts.mounts[key]; ok && key != "" {
+		if rc := m.root.Get(); rc != nil {
+			log.Infof("imgfs: sharing the mount of %s", key)
+			releaseImageFiles(files)
+			return rc.(*fs.Inode), nil
+		}
+	}
+	root, err := mount()
+	if err != nil {
+		releaseImageFiles(files)
+		return nil, err
+	}
+	m := &sharedMount{key: key, files: files}
+	m.root = refs.NewWeakRef(root, m)
+	if key != "" {
+		sharedMounts.mounts[key] = m
+	}
+	return root, nil
+}
+
+// WeakRefGone implements refs.WeakRefUser.WeakRefGone. It forgets the mount
+// once its root inode is released by the last container using it, and
+// releases its image files.
+func (m *sharedMount) WeakRefGone() {
+	sharedMounts.mu.Lock()
+	if sharedMounts.mounts[m.key] == m {
+		delete(sharedMounts.mounts, m.key)
+	}
+	sharedMounts.mu.Unlock()
+	releaseImageFiles(m.files)
+}
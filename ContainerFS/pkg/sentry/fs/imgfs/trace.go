@@ -0,0 +1,172 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"bytes"
+	"fmt"
+	"sync"
+	"syscall"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
+)
+
+// accessTrace records the order in which the files of an image, and the
+// pages of those files, are first accessed. It is meant to be enabled
+// during a warm-up run of a workload.
+//
+// The trace is written to a host FD as it is recorded, in the seq config
+// format understood by zar (see imgGen/src/manager/cmanager.go), so that
+// zar can rebuild the image with the startup working set laid out first and
+// contiguously. Paths are relative to the root of the image, so zar must be
+// run from the root of the source directory. The first access to a file
+// adds the file, wrapped in the folder lines of its ancestors:
+//
+//	sd|.|usr
+//	sd|./usr|lib
+//	f|./usr/lib|libc.so
+//	ed|./usr|lib
+//	ed|.|usr
+//
+// and every access to pages of the file that weren't accessed before adds a
+// page range hint, giving the first page and the number of pages:
+//
+//	p|./usr/lib|libc.so|0|4
+type accessTrace struct {
+	// fd is the host FD the trace is written to.
+	fd int
+
+	// parents holds the parent directory of every entry of the index.
+	parents []uint32
+
+	mu sync.Mutex
+
+	// pages holds, for every file accessed so far, a bitmap of the pages
+	// that have been accessed.
+	//
+	// pages is protected by mu.
+	pages map[uint32][]uint64
+
+	// failed is set once writing the trace failed, to stop tracing.
+	//
+	// failed is protected by mu.
+	failed bool
+}
+
+// newAccessTrace returns a trace of accesses to the files of idx, written to
+// fd.
+func newAccessTrace(idx *imageIndex, fd int) *accessTrace {
+	parents := make([]uint32, idx.len())
+	for i := uint32(0); i < idx.len(); i++ {
+		if idx.fileType(i) != ImgFSDirectory {
+			continue
+		}
+		first, count := idx.children(i)
+		for c := first; c < first+count; c++ {
+			parents[c] = i
+		}
+	}
+	return &accessTrace{
+		fd:      fd,
+		parents: parents,
+		pages:   make(map[uint32][]uint64),
+	}
+}
+
+// record records an access to bytes [begin, end) of file i of idx, whose
+// size is size.
+func (t *accessTrace) record(idx *imageIndex, i uint32, size, begin, end int64) {
+	if end > size {
+		end = size
+	}
+	if begin >= end {
+		return
+	}
+	first := uint64(begin) / usermem.PageSize
+	last := (uint64(end) + usermem.PageSize - 1) / usermem.PageSize
+
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	if t.failed {
+		return
+	}
+
+	var buf bytes.Buffer
+	bitmap, ok := t.pages[i]
+	if !ok {
+		pages := (uint64(size) + usermem.PageSize - 1) / usermem.PageSize
+		bitmap = make([]uint64, (pages+63)/64)
+		t.pages[i] = bitmap
+		t.writeFile(&buf, idx, i)
+	}
+
+	// Add a hint for every run of pages that weren't accessed before.
+	var dir, name string
+	for p := first; p < last; {
+		if bitmap[p/64]&(1<<(p%64)) != 0 {
+			p++
+			continue
+		}
+		start := p
+		for ; p < last && bitmap[p/64]&(1<<(p%64)) == 0; p++ {
+			bitmap[p/64] |= 1 << (p % 64)
+		}
+		if name == "" {
+			dir, name = t.path(idx, i)
+		}
+		fmt.Fprintf(&buf, "p|%s|%s|%d|%d\n", dir, name, start, p-start)
+	}
+
+	if buf.Len() == 0 {
+		return
+	}
+	if _, err := syscall.Write(t.fd, buf.Bytes()); err != nil {
+		log.Warningf("imgfs: can't write access trace, tracing stopped: %v", err)
+		t.failed = true
+	}
+}
+
+// writeFile writes the config lines adding file i to buf.
+func (t *accessTrace) writeFile(buf *bytes.Buffer, idx *imageIndex, i uint32) {
+	var ancestors []uint32
+	for d := t.parents[i]; d != rootEntry; d = t.parents[d] {
+		ancestors = append(ancestors, d)
+	}
+	dir := "."
+	for a := len(ancestors) - 1; a >= 0; a-- {
+		name := idx.name(ancestors[a])
+		fmt.Fprintf(buf, "sd|%s|%s\n", dir, name)
+		dir += "/" + string(name)
+	}
+	fmt.Fprintf(buf, "f|%s|%s\n", dir, idx.name(i))
+	for _, d := range ancestors {
+		dir = dir[:len(dir)-len(idx.name(d))-1]
+		fmt.Fprintf(buf, "ed|%s|%s\n", dir, idx.name(d))
+	}
+}
+
+// path returns the directory and name of entry i, as used in the trace.
+func (t *accessTrace) path(idx *imageIndex, i uint32) (string, string) {
+	var names [][]byte
+	for d := t.parents[i]; d != rootEntry; d = t.parents[d] {
+		names = append(names, idx.name(d))
+	}
+	dir := "."
+	for n := len(names) - 1; n >= 0; n-- {
+		dir += "/" + string(names[n])
+	}
+	return dir, string(idx.name(i))
+}
@@ -19,35 +19,71 @@ import (
 	//"path"
 	//"syscall"
 
-	//"gvisor.googlesource.com/gvisor/pkg/abi/linux"
+	"gvisor.googlesource.com/gvisor/pkg/abi/linux"
 	//"gvisor.googlesource.com/gvisor/pkg/log"
 	//"gvisor.googlesource.com/gvisor/pkg/sentry/device"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
-	//"gvisor.googlesource.com/gvisor/pkg/sentry/kernel/auth"
+	"gvisor.googlesource.com/gvisor/pkg/sentry/kernel/auth"
 	ktime "gvisor.googlesource.com/gvisor/pkg/sentry/kernel/time"
 	//"gvisor.googlesource.com/gvisor/pkg/syserror"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/usermem"
 )
 
-func stableAttr() fs.StableAttr {
+// stableAttr returns the stable attributes of index entry i of img.
+func stableAttr(img *image, i uint32, typ fs.InodeType) fs.StableAttr {
 	return fs.StableAttr{
-		Type:     fs.RegularFile,
-		DeviceID: imgfsFileDevice.DeviceID(),
-		InodeID: imgfsFileDevice.NextIno(),
+		Type:     typ,
+		DeviceID: img.dev.DeviceID(),
+		InodeID: img.inodeID(i),
 		BlockSize: usermem.PageSize,
 	}
 }
 
-func unstableAttr(ctx context.Context, offsetBegin int64, offsetEnd int64, unixTimens int64) fs.UnstableAttr {
+// unstableAttr returns the unstable attributes of regular file i of img,
+// whose data is [offsetBegin, offsetEnd) and takes usage bytes of the image.
+func unstableAttr(ctx context.Context, img *image, i uint32, offsetBegin int64, offsetEnd int64, usage int64) fs.UnstableAttr {
+	unixTimens := img.idx.modTime(i)
+	owner, perms, links := img.attr(i, fs.FileOwnerFromContext(ctx))
 	return fs.UnstableAttr{
 		Size:             offsetEnd - offsetBegin,
-		Usage:            offsetEnd - offsetBegin,
-		Perms:            fs.FilePermsFromMode(0555),
-		Owner:            fs.FileOwnerFromContext(ctx),
+		Usage:            usage,
+		Perms:            perms,
+		Owner:            owner,
 		AccessTime:       ktime.FromNanoseconds(unixTimens),
 		ModificationTime: ktime.FromNanoseconds(unixTimens),
 		StatusChangeTime: ktime.FromNanoseconds(unixTimens),
-		Links:            1,
+		Links:            links,
+	}
+}
+
+// attr returns the owner, permissions and link count of entry i of img. The
+// link count of a directory is its own, ".", its entry in its parent and the
+// ".." of every subdirectory. Images that don't record attributes keep the
+// ones imgfs always gave their files: owned by owner, read-only and
+// executable by everyone, and a single link.
+func (img *image) attr(i uint32, owner fs.FileOwner) (fs.FileOwner, fs.FilePermissions, uint64) {
+	links := uint64(1)
+	if img.idx.fileType(i) == ImgFSDirectory {
+		links = 2 + img.idx.subdirs(i)
+	}
+	a, ok := img.idx.attr(i)
+	if !ok {
+		return owner, fs.FilePermsFromMode(0555), links
+	}
+	if a.links > 1 && img.idx.fileType(i) == ImgFSRegularFile {
+		links = uint64(a.links)
+	}
+	owner = fs.FileOwner{UID: auth.KUID(a.uid), GID: auth.KGID(a.gid)}
+	return owner, fs.FilePermsFromMode(linux.FileMode(a.mode)), links
+}
+
+// statFS returns the file system information of an image of size bytes with
+// entries index entries. Images are read-only, so nothing is free.
+func statFS(size int64, entries uint32) fs.Info {
+	return fs.Info{
+		Type:        linux.TMPFS_MAGIC,
+		TotalBlocks: uint64(size+usermem.PageSize-1) / usermem.PageSize,
+		TotalFiles:  uint64(entries),
 	}
 }
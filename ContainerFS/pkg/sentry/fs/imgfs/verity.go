@@ -0,0 +1,250 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/binary"
+	"fmt"
+	"sync/atomic"
+
+	"gvisor.googlesource.com/gvisor/pkg/log"
+	"gvisor.googlesource.com/gvisor/pkg/syserror"
+)
+
+const (
+	// verityBlockSize is the size of the blocks of the hash tree.
+	verityBlockSize = 4096
+
+	// veritySHA256 is the hash algorithm of the tree.
+	veritySHA256 = 1
+
+	// verityHeaderSize is the size of the verity section before the tree
+	// levels: block size, algorithm, covered size and root hash.
+	verityHeaderSize = 16 + sha256.Size
+
+	// hashesPerBlock is the number of hashes of a level that are hashed
+	// together into one hash of the level above.
+	hashesPerBlock = verityBlockSize / sha256.Size
+)
+
+// verityTree verifies the blocks of an image against the hash tree zar
+// wrote in its verity section (zar -verity). Blocks are verified when they
+// are first read or mapped, so verification costs in proportion to the data
+// a workload touches rather than to the size of the image, and the verified
+// blocks are recorded in a bitmap so that each is only hashed once.
+//
+// The tree covers every byte of the image up to the verity section; the
+// digest of the image covers the root of the tree, the section table and the
+// trailer. The levels above the bottom one are small (1/128th of the bottom
+// level each) and are verified at mount, along with the blocks of the index;
+// the bottom level is verified one block of hashes at a time.
+type verityTree struct {
+	// size is the size of the covered part of the image, and readBlock
+	// returns block b of it, read into buf unless the image is mapped.
+	size      int64
+	readBlock func(b int64, buf []byte) ([]byte, error)
+
+	// digest is the digest of the image.
+	digest []byte
+
+	// levels holds the hashes of every level of the tree, from the bottom
+	// level up to the root.
+	levels [][]byte
+
+	// verified has a bit for every block of data that has been verified,
+	// and leafVerified one for every block of the bottom level of the
+	// tree. They are only ever set, atomically.
+	verified     []uint64
+	leafVerified []uint64
+}
+
+// parseVerity parses the verity section v, at offset off of an image whose
+// section table and trailer, table, start at tableOff, and verifies the
+// levels of its tree above the bottom one. If digest isn't nil, the image
+// must have that digest. readBlock reads the blocks of the image.
+func parseVerity(v []byte, off uint64, table []byte, tableOff uint64, digest []byte, readBlock func(int64, []byte) ([]byte, error)) (*verityTree, error) {
+	if len(v) < verityHeaderSize {
+		return nil, fmt.Errorf("bad verity section size %d", len(v))
+	}
+	if bs := binary.LittleEndian.Uint32(v[0:]); bs != verityBlockSize {
+		return nil, fmt.Errorf("unsupported verity block size %d", bs)
+	}
+	if a := binary.LittleEndian.Uint32(v[4:]); a != veritySHA256 {
+		return nil, fmt.Errorf("unsupported verity hash %d", a)
+	}
+	if size := binary.LittleEndian.Uint64(v[8:]); size != off || size == 0 {
+		return nil, fmt.Errorf("hash tree covers %d bytes, not the %d before it", size, off)
+	}
+	if off+uint64(len(v)) != tableOff {
+		return nil, fmt.Errorf("verity section isn't followed by the section table")
+	}
+	h := sha256.New()
+	h.Write(v[:verityHeaderSize])
+	h.Write(table)
+	d := h.Sum(nil)
+	if digest != nil && !bytes.Equal(d, digest) {
+		return nil, fmt.Errorf("image digest is %x, want %x", d, digest)
+	}
+
+	// Lay out the levels, bottom up; the root is in the header.
+	t := &verityTree{size: int64(off), readBlock: readBlock, digest: d}
+	counts := []uint64{(off + verityBlockSize - 1) / verityBlockSize}
+	for n := counts[0]; n > 1; {
+		n = (n + hashesPerBlock - 1) / hashesPerBlock
+		counts = append(counts, n)
+	}
+	rest := v[verityHeaderSize:]
+	for _, n := range counts[:len(counts)-1] {
+		if uint64(len(rest)) < n*sha256.Size {
+			return nil, fmt.Errorf("verity section too small for %d bytes", off)
+		}
+		t.levels = append(t.levels, rest[:n*sha256.Size])
+		rest = rest[n*sha256.Size:]
+	}
+	if len(rest) != 0 {
+		return nil, fmt.Errorf("verity section too large for %d bytes", off)
+	}
+	t.levels = append(t.levels, v[16:verityHeaderSize])
+	t.verified = make([]uint64, (counts[0]+63)/64)
+	t.leafVerified = make([]uint64, (groups(t.levels[0])+63)/64)
+
+	// Verify the upper levels top down, each against the one above it.
+	for l := len(t.levels) - 2; l >= 1; l-- {
+		for g := uint64(0); g < groups(t.levels[l]); g++ {
+			if !t.verifyGroup(l, g) {
+				return nil, fmt.Errorf("hash tree level %d is corrupted", l)
+			}
+		}
+	}
+	return t, nil
+}
+
+// groups returns the number of blocks of hashes of level.
+func groups(level []byte) uint64 {
+	return (uint64(len(level)) + verityBlockSize - 1) / verityBlockSize
+}
+
+// hashBlock returns the hash of b zero padded to a block.
+func hashBlock(b []byte) []byte {
+	h := sha256.New()
+	h.Write(b)
+	if len(b) < verityBlockSize {
+		h.Write(make([]byte, verityBlockSize-len(b)))
+	}
+	return h.Sum(nil)
+}
+
+// verifyGroup returns true if block g of the hashes of level l matches its
+// hash in level l+1, which must be verified.
+func (t *verityTree) verifyGroup(l int, g uint64) bool {
+	level := t.levels[l]
+	end := (g + 1) * verityBlockSize
+	if end > uint64(len(level)) {
+		end = uint64(len(level))
+	}
+	want := t.levels[l+1][g*sha256.Size : (g+1)*sha256.Size]
+	return bytes.Equal(hashBlock(level[g*verityBlockSize:end]), want)
+}
+
+// blockLen returns the length of block b, which is short at the end of the
+// covered data.
+func (t *verityTree) blockLen(b int64) int {
+	if rest := t.size - b*verityBlockSize; rest < verityBlockSize {
+		return int(rest)
+	}
+	return verityBlockSize
+}
+
+// checkBlock returns true if data is the contents of block b.
+func (t *verityTree) checkBlock(b int64, data []byte) bool {
+	if len(t.levels) > 1 {
+		g := uint64(b) / hashesPerBlock
+		if !testBit(t.leafVerified, g) {
+			if !t.verifyGroup(0, g) {
+				return false
+			}
+			setBit(t.leafVerified, g)
+		}
+	}
+	want := t.levels[0][b*sha256.Size : (b+1)*sha256.Size]
+	return bytes.Equal(hashBlock(data), want)
+}
+
+// verify verifies the image blocks holding [begin, end), those that weren't
+// already. Offsets past the covered data, such as the zero fill of the last
+// page, need no verification.
+func (t *verityTree) verify(begin, end int64) error {
+	if end > t.size {
+		end = t.size
+	}
+	var buf []byte
+	for b := begin / verityBlockSize; b*verityBlockSize < end; b++ {
+		if testBit(t.verified, uint64(b)) {
+			continue
+		}
+		if buf == nil {
+			buf = make([]byte, verityBlockSize)
+		}
+		data, err := t.readBlock(b, buf[:t.blockLen(b)])
+		if err != nil {
+			log.Warningf("imgfs: can't read block %d of the image: %v", b, err)
+			return syserror.EIO
+		}
+		if !t.checkBlock(b, data) {
+			log.Warningf("imgfs: block %d of the image doesn't match its hash", b)
+			return syserror.EIO
+		}
+		setBit(t.verified, uint64(b))
+	}
+	return nil
+}
+
+// check verifies data, the image bytes from offset off, a block boundary.
+// data was read from the image file rather than mapped, and could differ if
+// read again, so it is hashed every time rather than looked up in the
+// bitmap. Bytes past the covered data need no verification.
+func (t *verityTree) check(off int64, data []byte) error {
+	for b := off / verityBlockSize; b*verityBlockSize < t.size && len(data) > 0; b++ {
+		n := t.blockLen(b)
+		if n > len(data) {
+			log.Warningf("imgfs: partial block %d of the image can't be verified", b)
+			return syserror.EIO
+		}
+		if !t.checkBlock(b, data[:n]) {
+			log.Warningf("imgfs: block %d of the image doesn't match its hash", b)
+			return syserror.EIO
+		}
+		data = data[n:]
+	}
+	return nil
+}
+
+// testBit returns true if bit i of bitmap is set.
+func testBit(bitmap []uint64, i uint64) bool {
+	return atomic.LoadUint64(&bitmap[i/64])&(1<<(i%64)) != 0
+}
+
+// setBit sets bit i of bitmap.
+func setBit(bitmap []uint64, i uint64) {
+	w := &bitmap[i/64]
+	for {
+		old := atomic.LoadUint64(w)
+		if old&(1<<(i%64)) != 0 || atomic.CompareAndSwapUint64(w, old, old|1<<(i%64)) {
+			return
+		}
+	}
+}
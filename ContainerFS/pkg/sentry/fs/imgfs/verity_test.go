@@ -0,0 +1,193 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package imgfs
+
+import (
+	"fmt"
+	"io/ioutil"
+	"os"
+	"testing"
+)
+
+// testdata/verity.img was written by zar -w -verity -dir src/ from the tree
+// of testdata/image.img (see index_test.go). Its file data spans the first
+// blocks of the image, and its index the last one.
+
+// loadTestImage loads img, written to a temporary file, as imgfs does at
+// mount. The returned function releases the image.
+func loadTestImage(t *testing.T, img []byte, digest []byte, pread bool) (*imageFile, func(), error) {
+	t.Helper()
+	f, err := ioutil.TempFile("", "imgfs-verity")
+	if err != nil {
+		t.Fatalf("can't create image file: %v", err)
+	}
+	os.Remove(f.Name())
+	if _, err := f.Write(img); err != nil {
+		f.Close()
+		t.Fatalf("can't write image file: %v", err)
+	}
+	imgFile, err := loadImageFile(int(f.Fd()), digest, 1<<20, pread)
+	if err != nil {
+		f.Close()
+		return nil, nil, err
+	}
+	return imgFile, func() {
+		unmapImageFile(imgFile.mapping)
+		f.Close()
+	}, nil
+}
+
+// testImageModes runs fn for both ways imgfs reads an image.
+func testImageModes(t *testing.T, fn func(t *testing.T, pread bool)) {
+	for _, pread := range []bool{false, true} {
+		t.Run(fmt.Sprintf("pread=%t", pread), func(t *testing.T) {
+			fn(t, pread)
+		})
+	}
+}
+
+// TestVerityIntact checks that an image that wasn't tampered with verifies,
+// with or without its digest.
+func TestVerityIntact(t *testing.T) {
+	img := readTestImage(t, "verity.img")
+	testImageModes(t, func(t *testing.T, pread bool) {
+		f, release, err := loadTestImage(t, img, nil, pread)
+		if err != nil {
+			t.Fatalf("loadImageFile failed: %v", err)
+		}
+		defer release()
+		if f.verity == nil {
+			t.Fatalf("image has no hash tree")
+		}
+		if err := f.verity.verify(0, f.verity.size); err != nil {
+			t.Errorf("verify failed: %v", err)
+		}
+		if err := f.verity.check(0, img[:f.verity.size]); err != nil {
+			t.Errorf("check failed: %v", err)
+		}
+
+		f2, release2, err := loadTestImage(t, img, f.verity.digest, pread)
+		if err != nil {
+			t.Fatalf("loadImageFile with the image digest failed: %v", err)
+		}
+		defer release2()
+		if f2.verity == nil {
+			t.Errorf("image loaded with its digest isn't verified")
+		}
+	})
+}
+
+// TestVerityWrongDigest checks that an image is rejected if it doesn't have
+// the digest it is mounted with.
+func TestVerityWrongDigest(t *testing.T) {
+	img := readTestImage(t, "verity.img")
+	testImageModes(t, func(t *testing.T, pread bool) {
+		f, release, err := loadTestImage(t, img, nil, pread)
+		if err != nil {
+			t.Fatalf("loadImageFile failed: %v", err)
+		}
+		digest := append([]byte(nil), f.verity.digest...)
+		release()
+
+		digest[0] ^= 1
+		if _, release, err := loadTestImage(t, img, digest, pread); err == nil {
+			release()
+			t.Errorf("loadImageFile with a wrong digest succeeded")
+		}
+		if _, release, err := loadTestImage(t, readTestImage(t, "image.img"), digest, pread); err == nil {
+			release()
+			t.Errorf("loadImageFile of an image without a hash tree succeeded")
+		}
+	})
+}
+
+// TestVerityTamperedData checks that a block of file data that was changed is
+// rejected by both verify and check.
+func TestVerityTamperedData(t *testing.T) {
+	good := readTestImage(t, "verity.img")
+	x, err := parseImageIndex(good, 0)
+	if err != nil {
+		t.Fatalf("parseImageIndex failed: %v", err)
+	}
+	begin, _, err := x.extent(mustLookup(t, x, "big"))
+	if err != nil {
+		t.Fatalf("extent failed: %v", err)
+	}
+	off := begin + 100
+	if off >= verityBlockSize || int64(x.indexOff) < 2*verityBlockSize {
+		t.Fatalf("test image has its index in its first block")
+	}
+	img := append([]byte(nil), good...)
+	img[off] ^= 1
+
+	testImageModes(t, func(t *testing.T, pread bool) {
+		// Only the blocks of the index are verified at load.
+		f, release, err := loadTestImage(t, img, nil, pread)
+		if err != nil {
+			t.Fatalf("loadImageFile failed: %v", err)
+		}
+		defer release()
+		if err := f.verity.verify(off, off+1); err == nil {
+			t.Errorf("verify of a tampered block succeeded")
+		}
+		if err := f.verity.check(0, img[:verityBlockSize]); err == nil {
+			t.Errorf("check of a tampered block succeeded")
+		}
+		if err := f.verity.verify(verityBlockSize, 2*verityBlockSize); err != nil {
+			t.Errorf("verify of an intact block failed: %v", err)
+		}
+	})
+}
+
+// TestVerityTamperedTree checks that blocks are rejected if the hashes of the
+// tree they are checked against were changed.
+func TestVerityTamperedTree(t *testing.T) {
+	good := readTestImage(t, "verity.img")
+	x, err := parseImageIndex(good, 0)
+	if err != nil {
+		t.Fatalf("parseImageIndex failed: %v", err)
+	}
+	// Change the hash of the first block, in the bottom level of the tree.
+	img := append([]byte(nil), good...)
+	img[x.verityOff+verityHeaderSize] ^= 1
+
+	testImageModes(t, func(t *testing.T, pread bool) {
+		// The index is verified at load against the same block of
+		// hashes.
+		if _, release, err := loadTestImage(t, img, nil, pread); err == nil {
+			release()
+			t.Errorf("loadImageFile of an image with a tampered hash tree succeeded")
+		}
+	})
+
+	x, err = parseImageIndex(img, 0)
+	if err != nil {
+		t.Fatalf("parseImageIndex failed: %v", err)
+	}
+	readBlock := func(b int64, buf []byte) ([]byte, error) {
+		off := b * verityBlockSize
+		return img[off : off+int64(len(buf))], nil
+	}
+	tree, err := parseVerity(x.verity, x.verityOff, x.table, x.tableOff, nil, readBlock)
+	if err != nil {
+		t.Fatalf("parseVerity failed: %v", err)
+	}
+	if err := tree.verify(0, 1); err == nil {
+		t.Errorf("verify against a tampered hash tree succeeded")
+	}
+	if err := tree.check(0, img[:verityBlockSize]); err == nil {
+		t.Errorf("check against a tampered hash tree succeeded")
+	}
+}
@@ -33,6 +33,85 @@ func overlayCreateWhiteout(parent *Inode, name string) error {
 	return parent.InodeOperations.Setxattr(parent, XattrOverlayWhiteout(name), []byte("y"))
 }
 
+// overlayNegativeCacheSize is the maximum number of names an overlay
+// directory caches as nonexistent.
+const overlayNegativeCacheSize = 1024
+
+// hasWhiteout returns true if the upper directory of o has a whiteout for
+// name. If cache is set, the upper directory can only be modified through the
+// overlay, and its whiteouts are listed once and kept in o rather than looked
+// up by name every time.
+//
+// Preconditions: o.upper must be non-nil, and o.copyMu must be locked.
+func (o *overlayEntry) hasWhiteout(name string, cache bool) bool {
+	if !cache {
+		return overlayHasWhiteout(o.upper, name)
+	}
+	o.lookupMu.RLock()
+	if o.whiteouts != nil {
+		_, ok := o.whiteouts[name]
+		o.lookupMu.RUnlock()
+		return ok
+	}
+	o.lookupMu.RUnlock()
+
+	o.lookupMu.Lock()
+	defer o.lookupMu.Unlock()
+	if o.whiteouts == nil {
+		names, err := o.upper.Listxattr()
+		if err != nil {
+			// The upper filesystem can't list its whiteouts.
+			return overlayHasWhiteout(o.upper, name)
+		}
+		o.whiteouts = make(map[string]struct{})
+		for n := range names {
+			if strings.HasPrefix(n, XattrOverlayWhiteoutPrefix) {
+				if w := strings.TrimPrefix(n, XattrOverlayWhiteoutPrefix); overlayHasWhiteout(o.upper, w) {
+					o.whiteouts[w] = struct{}{}
+				}
+			}
+		}
+	}
+	_, ok := o.whiteouts[name]
+	return ok
+}
+
+// createWhiteout creates a whiteout for name in the upper directory of o.
+func (o *overlayEntry) createWhiteout(name string) error {
+	if err := overlayCreateWhiteout(o.upper, name); err != nil {
+		return err
+	}
+	o.lookupMu.Lock()
+	if o.whiteouts != nil {
+		o.whiteouts[name] = struct{}{}
+	}
+	o.lookupMu.Unlock()
+	return nil
+}
+
+// lookupNegative returns true if name is cached as nonexistent in o, and the
+// generation of the cache otherwise, to pass to addNegative.
+func (o *overlayEntry) lookupNegative(name string) (bool, uint64) {
+	o.lookupMu.RLock()
+	_, ok := o.negative[name]
+	gen := o.lookupGen
+	o.lookupMu.RUnlock()
+	return ok, gen
+}
+
+// addNegative caches name as nonexistent in o, unless the upper directory
+// has been modified since generation gen of the cache.
+func (o *overlayEntry) addNegative(name string, gen uint64) {
+	o.lookupMu.Lock()
+	if gen == o.lookupGen {
+		if o.negative == nil || len(o.negative) >= overlayNegativeCacheSize {
+			o.negative = make(map[string]struct{})
+		}
+		o.negative[name] = struct{}{}
+	}
+	o.lookupMu.Unlock()
+}
+
 func overlayWriteOut(ctx context.Context, o *overlayEntry) error {
 	// Hot path. Avoid defers.
 	var err error
@@ -58,6 +137,20 @@ func overlayLookup(ctx context.Context, parent *overlayEntry, inode *Inode, name
 		panic("invalid overlayEntry, needs at least one Inode")
 	}
 
+	// Whiteouts are cached if the upper directory can only change through
+	// the overlay, and names that exist in neither layer if the lower
+	// directory can't change either.
+	cache := overlayUpperStatic(inode.MountSource)
+	cacheNegative := cache && (parent.lower == nil || mountImmutable(parent.lower.MountSource))
+	var gen uint64
+	if cacheNegative {
+		var negative bool
+		if negative, gen = parent.lookupNegative(name); negative {
+			parent.copyMu.RUnlock()
+			return nil, false, syserror.ENOENT
+		}
+	}
+
 	var upperInode *Inode
 	var lowerInode *Inode
 
@@ -88,8 +181,11 @@ func overlayLookup(ctx context.Context, parent *overlayEntry, inode *Inode, name
 		}
 
 		// Are we done?
-		if overlayHasWhiteout(parent.upper, name) {
+		if parent.hasWhiteout(name, cache) {
 			if upperInode == nil {
+				if cacheNegative && !negativeUpperChild {
+					parent.addNegative(name, gen)
+				}
 				parent.copyMu.RUnlock()
 				if negativeUpperChild {
 					// If the upper fs returnd a negative
@@ -111,6 +207,7 @@ func overlayLookup(ctx context.Context, parent *overlayEntry, inode *Inode, name
 				parent.copyMu.RUnlock()
 				return nil, false, err
 			}
+			entry.lazy = lazyCopyOf(inode.MountSource, upperInode)
 			d, err := NewDirent(newOverlayInode(ctx, entry, inode.MountSource), name), nil
 			parent.copyMu.RUnlock()
 			return d, true, err
@@ -157,6 +254,9 @@ func overlayLookup(ctx context.Context, parent *overlayEntry, inode *Inode, name
 
 	// Was all of this for naught?
 	if upperInode == nil && lowerInode == nil {
+		if cacheNegative && !negativeUpperChild {
+			parent.addNegative(name, gen)
+		}
 		parent.copyMu.RUnlock()
 		// We can only return a negative dirent if the upper returned
 		// one as well. See comments above regarding negativeUpperChild
@@ -201,12 +301,17 @@ func overlayLookup(ctx context.Context, parent *overlayEntry, inode *Inode, name
 		parent.copyMu.RUnlock()
 		return nil, false, err
 	}
+	if upperInode != nil {
+		// The contents of the file may be copied up lazily.
+		entry.lazy = lazyCopyOf(inode.MountSource, upperInode)
+	}
 	d, err := NewDirent(newOverlayInode(ctx, entry, inode.MountSource), name), nil
 	parent.copyMu.RUnlock()
 	return d, upperInode != nil, err
 }
 
 func overlayCreate(ctx context.Context, o *overlayEntry, parent *Dirent, name string, flags FileFlags, perm FilePermissions) (*File, error) {
+	defer o.invalidateDir()
 	// Dirent.Create takes renameMu if the Inode is an overlay Inode.
 	if err := copyUpLockedForRename(ctx, parent); err != nil {
 		return nil, err
@@ -260,6 +365,7 @@ func overlayCreate(ctx context.Context, o *overlayEntry, parent *Dirent, name st
 }
 
 func overlayCreateDirectory(ctx context.Context, o *overlayEntry, parent *Dirent, name string, perm FilePermissions) error {
+	defer o.invalidateDir()
 	// Dirent.CreateDirectory takes renameMu if the Inode is an overlay
 	// Inode.
 	if err := copyUpLockedForRename(ctx, parent); err != nil {
@@ -269,6 +375,7 @@ func overlayCreateDirectory(ctx context.Context, o *overlayEntry, parent *Dirent
 }
 
 func overlayCreateLink(ctx context.Context, o *overlayEntry, parent *Dirent, oldname string, newname string) error {
+	defer o.invalidateDir()
 	// Dirent.CreateLink takes renameMu if the Inode is an overlay Inode.
 	if err := copyUpLockedForRename(ctx, parent); err != nil {
 		return err
@@ -277,6 +384,7 @@ func overlayCreateLink(ctx context.Context, o *overlayEntry, parent *Dirent, old
 }
 
 func overlayCreateHardLink(ctx context.Context, o *overlayEntry, parent *Dirent, target *Dirent, name string) error {
+	defer o.invalidateDir()
 	// Dirent.CreateHardLink takes renameMu if the Inode is an overlay
 	// Inode.
 	if err := copyUpLockedForRename(ctx, parent); err != nil {
@@ -285,10 +393,18 @@ func overlayCreateHardLink(ctx context.Context, o *overlayEntry, parent *Dirent,
 	if err := copyUpLockedForRename(ctx, target); err != nil {
 		return err
 	}
+	// The new link has no lower file to read the contents from.
+	if l := target.Inode.overlay.lazy; l != nil {
+		if err := l.finish(ctx); err != nil {
+			log.Warningf("copy up failed to copy up contents: %v", err)
+			return syserror.EIO
+		}
+	}
 	return o.upper.InodeOperations.CreateHardLink(ctx, o.upper, target.Inode.overlay.upper, name)
 }
 
 func overlayCreateFifo(ctx context.Context, o *overlayEntry, parent *Dirent, name string, perm FilePermissions) error {
+	defer o.invalidateDir()
 	// Dirent.CreateFifo takes renameMu if the Inode is an overlay Inode.
 	if err := copyUpLockedForRename(ctx, parent); err != nil {
 		return err
@@ -297,6 +413,7 @@ func overlayCreateFifo(ctx context.Context, o *overlayEntry, parent *Dirent, nam
 }
 
 func overlayRemove(ctx context.Context, o *overlayEntry, parent *Dirent, child *Dirent) error {
+	defer o.invalidateDir()
 	// Dirent.Remove and Dirent.RemoveDirectory take renameMu if the Inode
 	// is an overlay Inode.
 	if err := copyUpLockedForRename(ctx, parent); err != nil {
@@ -313,10 +430,11 @@ func overlayRemove(ctx context.Context, o *overlayEntry, parent *Dirent, child *
 			if err := o.upper.InodeOperations.Remove(ctx, o.upper, child.name); err != nil {
 				return err
 			}
+			forgetLazyCopy(parent.Inode.MountSource, child.Inode.overlay.upper)
 		}
 	}
 	if child.Inode.overlay.lowerExists {
-		return overlayCreateWhiteout(o.upper, child.name)
+		return o.createWhiteout(child.name)
 	}
 	return nil
 }
@@ -330,7 +448,11 @@ func overlayRename(ctx context.Context, o *overlayEntry, oldParent *Dirent, rena
 	if renamed.Inode.overlay == nil || newParent.Inode.overlay == nil || oldParent.Inode.overlay == nil {
 		return syserror.EXDEV
 	}
+	defer oldParent.Inode.overlay.invalidateDir()
+	defer newParent.Inode.overlay.invalidateDir()
 
+	// The upper Inode of the file replaced, if any.
+	var replacedUpper *Inode
 	if replacement {
 		// Check here if the file to be replaced exists and is a
 		// non-empty directory. If we copy up first, we may end up
@@ -378,6 +500,9 @@ func overlayRename(ctx context.Context, o *overlayEntry, oldParent *Dirent, rena
 				}
 			}
 
+			if inUpper && !replaced.IsNegative() && !IsDir(replaced.Inode.StableAttr) {
+				replacedUpper = replaced.Inode.overlay.upper
+			}
 			replaced.DecRef()
 		}
 	}
@@ -392,13 +517,17 @@ func overlayRename(ctx context.Context, o *overlayEntry, oldParent *Dirent, rena
 	if err := o.upper.InodeOperations.Rename(ctx, oldParent.Inode.overlay.upper, oldName, newParent.Inode.overlay.upper, newName, replacement); err != nil {
 		return err
 	}
+	if replacedUpper != nil && replacedUpper != renamed.Inode.overlay.upper {
+		forgetLazyCopy(newParent.Inode.MountSource, replacedUpper)
+	}
 	if renamed.Inode.overlay.lowerExists {
-		return overlayCreateWhiteout(oldParent.Inode.overlay.upper, oldName)
+		return oldParent.Inode.overlay.createWhiteout(oldName)
 	}
 	return nil
 }
 
 func overlayBind(ctx context.Context, o *overlayEntry, name string, data transport.BoundEndpoint, perm FilePermissions) (*Dirent, error) {
+	defer o.invalidateDir()
 	o.copyMu.RLock()
 	defer o.copyMu.RUnlock()
 	// We do not support doing anything exciting with sockets unless there
@@ -579,6 +708,9 @@ func overlayTruncate(ctx context.Context, o *overlayEntry, d *Dirent, size int64
 	if err := copyUp(ctx, d); err != nil {
 		return err
 	}
+	if o.lazy != nil {
+		return o.lazy.truncate(ctx, o.upper, size)
+	}
 	return o.upper.InodeOperations.Truncate(ctx, o.upper, size)
 }
 
@@ -21,6 +21,7 @@ import (
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/fsutil"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/fs/ramfs"
+	_ "gvisor.googlesource.com/gvisor/pkg/sentry/fs/tmpfs"
 	"gvisor.googlesource.com/gvisor/pkg/sentry/kernel/contexttest"
 	"gvisor.googlesource.com/gvisor/pkg/syserror"
 )
@@ -300,6 +301,86 @@ func TestLookupRevalidation(t *testing.T) {
 	}
 }
 
+// TestLookupNegativeCache tests that names cached as nonexistent in an overlay
+// directory, and the whiteouts of the directory, follow modifications made
+// through the overlay, and that names are only cached as nonexistent if
+// neither layer can change behind the overlay.
+func TestLookupNegativeCache(t *testing.T) {
+	for _, test := range []struct {
+		desc             string
+		lowerFlags       fs.MountSourceFlags
+		upperRevalidates bool
+		cached           bool
+	}{
+		{
+			desc:       "immutable lower",
+			lowerFlags: fs.MountSourceFlags{ReadOnly: true, Immutable: true},
+			cached:     true,
+		},
+		{
+			desc:       "read-only lower",
+			lowerFlags: fs.MountSourceFlags{ReadOnly: true},
+		},
+		{
+			desc:             "revalidating upper",
+			lowerFlags:       fs.MountSourceFlags{ReadOnly: true, Immutable: true},
+			upperRevalidates: true,
+		},
+	} {
+		t.Run(test.desc, func(t *testing.T) {
+			ctx := contexttest.Context(t)
+			root, _, lowerRoot := newTestOverlay(ctx, t, test.lowerFlags, test.upperRevalidates, map[string][]byte{"a": nil, "b": nil})
+			defer root.DecRef()
+			ctx = &rootContext{
+				Context: ctx,
+				root:    root,
+			}
+
+			check := func(name string, exists bool) {
+				t.Helper()
+				// Look up twice, the second time from the cache.
+				for i := 0; i < 2; i++ {
+					d, err := root.Walk(ctx, root, name)
+					if exists {
+						if err != nil {
+							t.Fatalf("Walk(%q) got error %v, want nil", name, err)
+						}
+						d.DecRef()
+					} else if err != syserror.ENOENT {
+						t.Fatalf("Walk(%q) got error %v, want ENOENT", name, err)
+					}
+				}
+			}
+			check("a", true)
+			check("c", false)
+
+			// A file added to the lower directory behind the overlay
+			// is only found if it wasn't cached as nonexistent.
+			check("y", false)
+			writeTestFile(ctx, t, lowerRoot, "y", nil, 0)
+			check("y", !test.cached)
+
+			f, err := root.Create(ctx, root, "c", fs.FileFlags{Read: true}, fs.FilePermsFromMode(0666))
+			if err != nil {
+				t.Fatalf("failed to create file: %v", err)
+			}
+			f.DecRef()
+			check("c", true)
+
+			if err := root.Remove(ctx, root, "a"); err != nil {
+				t.Fatalf("failed to remove file: %v", err)
+			}
+			check("a", false)
+
+			if err := fs.Rename(ctx, root, root, "b", root, "a"); err != nil {
+				t.Fatalf("failed to rename file: %v", err)
+			}
+			check("a", true)
+			check("b", false)
+		})
+	}
+}
+
 func TestCacheFlush(t *testing.T) {
 	ctx := contexttest.Context(t)
 
@@ -392,6 +473,15 @@ func (d *dir) Getxattr(inode *fs.Inode, name string) ([]byte, error) {
 	return nil, syserror.ENOATTR
 }
 
+// Listxattr implements InodeOperations.Listxattr.
+func (d *dir) Listxattr(inode *fs.Inode) (map[string]struct{}, error) {
+	names := make(map[string]struct{}, len(d.negative))
+	for _, n := range d.negative {
+		names[fs.XattrOverlayWhiteout(n)] = struct{}{}
+	}
+	return names, nil
+}
+
 // GetFile implements InodeOperations.GetFile.
 func (d *dir) GetFile(ctx context.Context, dirent *fs.Dirent, flags fs.FileFlags) (*fs.File, error) {
 	file, err := d.InodeOperations.GetFile(ctx, dirent, flags)
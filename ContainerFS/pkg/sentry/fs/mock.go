@@ -55,13 +55,14 @@ type MockMountSourceOps struct {
 
 // NewMockMountSource returns a new *MountSource using MockMountSourceOps.
 func NewMockMountSource(cache *DirentCache) *MountSource {
-	var keep bool
+	var size uint64
 	if cache != nil {
-		keep = cache.maxSize > 0
+		size = cache.maxSize
 	}
 	return &MountSource{
-		MountSourceOperations: &MockMountSourceOps{keep: keep},
+		MountSourceOperations: &MockMountSourceOps{keep: size > 0},
 		fscache:               cache,
+		fscacheSize:           size,
 		children:              make(map[*MountSource]struct{}),
 	}
 }
@@ -121,6 +121,9 @@ type MountSource struct {
 	// It must be flushed before kernel.SaveTo.
 	fscache *DirentCache `state:"nosave"`
 
+	// fscacheSize is the number of Dirents fscache holds at most.
+	fscacheSize uint64
+
 	// direntRefs is the sum of references on all Dirents in this MountSource.
 	//
 	// direntRefs is increased when a Dirent in MountSource is IncRef'd, and
@@ -163,6 +166,7 @@ func NewMountSource(mops MountSourceOperations, filesystem Filesystem, flags Mou
 		Flags:                 flags,
 		Filesystem:            filesystem,
 		fscache:               NewDirentCache(defaultDirentCacheSize),
+		fscacheSize:           defaultDirentCacheSize,
 		children:              make(map[*MountSource]struct{}),
 	}
 }
@@ -246,6 +250,23 @@ func (msrc *MountSource) FlushDirentRefs() {
 	msrc.fscache.Invalidate()
 }
 
+// SetDirentCacheSize sets the number of Dirents the MountSource holds an
+// extra reference on, instead of defaultDirentCacheSize, dropping the
+// references it holds. Mounts whose workloads walk many more files than they
+// keep open, such as container images, may need more to avoid looking their
+// files up again; a size of 0 caches nothing. It does nothing if msrc
+// already has this size, as shared mounts do when mounted again.
+//
+// Preconditions: msrc must not be in use yet, unless size is its current size.
+func (msrc *MountSource) SetDirentCacheSize(size uint64) {
+	if size == msrc.fscacheSize {
+		return
+	}
+	msrc.fscache.Invalidate()
+	msrc.fscache = NewDirentCache(size)
+	msrc.fscacheSize = size
+}
+
 // NewCachingMountSource returns a generic mount that will cache dirents
 // aggressively.
 func NewCachingMountSource(filesystem Filesystem, flags MountSourceFlags) *MountSource {
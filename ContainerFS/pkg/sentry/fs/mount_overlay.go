@@ -15,6 +15,8 @@
 package fs
 
 import (
+	"sync"
+
 	"gvisor.googlesource.com/gvisor/pkg/sentry/context"
 )
 
@@ -26,6 +28,14 @@ import (
 type overlayMountSourceOperations struct {
 	upper *MountSource
 	lower *MountSource
+
+	// lazyMu protects lazy.
+	lazyMu sync.Mutex `state:"nosave"`
+
+	// lazy maps the upper Inodes of the files of the overlay whose
+	// contents are copied up lazily to their lazyCopy, on which it holds a
+	// reference.
+	lazy map[*Inode]*lazyCopy
 }
 
 func newOverlayMountSource(upper, lower *MountSource, flags MountSourceFlags) *MountSource {
@@ -37,6 +47,28 @@ func newOverlayMountSource(upper, lower *MountSource, flags MountSourceFlags) *M
 	}, &overlayFilesystem{}, flags)
 }
 
+// overlayUpperStatic returns true if msrc is an overlay mount whose upper
+// filesystem doesn't require revalidation, so that it only changes through
+// the overlay.
+func overlayUpperStatic(msrc *MountSource) bool {
+	o, ok := msrc.MountSourceOperations.(*overlayMountSourceOperations)
+	if !ok {
+		return false
+	}
+	smo, ok := o.upper.MountSourceOperations.(*SimpleMountSourceOperations)
+	return ok && !smo.revalidate
+}
+
+// mountImmutable returns true if the files of msrc never change. An overlay
+// is immutable if both its upper and lower filesystems are, since it can't
+// copy up into an immutable upper.
+func mountImmutable(msrc *MountSource) bool {
+	if o, ok := msrc.MountSourceOperations.(*overlayMountSourceOperations); ok {
+		return mountImmutable(o.upper) && mountImmutable(o.lower)
+	}
+	return msrc.Flags.Immutable
+}
+
 // Revalidate implements MountSourceOperations.Revalidate for an overlay by
 // delegating to the upper filesystem's Revalidate method. We cannot reload
 // files from the lower filesystem, so we panic if the lower filesystem's
@@ -94,6 +126,9 @@ func (o *overlayMountSourceOperations) SaveInodeMapping(inode *Inode, path strin
 func (o *overlayMountSourceOperations) Destroy() {
 	o.upper.DecRef()
 	o.lower.DecRef()
+	for _, l := range o.lazy {
+		l.DecRef()
+	}
 }
 
 // type overlayFilesystem is the filesystem for overlay mounts.
@@ -21,5 +21,5 @@ package fs
 // "complete". Implementations (e.g. see gofer_state.go) reach into the
 // MountSourceOperations through this object, this is necessary on restore.
 func (msrc *MountSource) afterLoad() {
-	msrc.fscache = NewDirentCache(defaultDirentCacheSize)
+	msrc.fscache = NewDirentCache(msrc.fscacheSize)
 }
@@ -24,9 +24,11 @@ import (
 // cacheReallyContains iterates through the dirent cache to determine whether
 // it contains the given dirent.
 func cacheReallyContains(cache *DirentCache, d *Dirent) bool {
-	for i := cache.list.Front(); i != nil; i = i.Next() {
-		if i == d {
-			return true
+	for s := range cache.shards {
+		for i := cache.shards[s].list.Front(); i != nil; i = i.Next() {
+			if i == d {
+				return true
+			}
 		}
 	}
 	return false
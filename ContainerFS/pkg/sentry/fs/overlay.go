@@ -196,6 +196,49 @@ type overlayEntry struct {
 	// these locks is sufficient to read upper; holding all three for writing
 	// is required to mutate it.
 	upper *Inode
+
+	// lazy is set if the contents of this file are copied up lazily. It is
+	// set along with upper, and never changes once set. See lazyCopy.
+	lazy *lazyCopy
+
+	// mapped is set once a file of this Inode has been memory mapped
+	// through the overlay, after which it is never copied up lazily. It is
+	// protected by copyMu.
+	mapped bool
+
+	// dirMu protects dirCache and lowerEntries, which cache the entries
+	// of a directory for readdirEntries.
+	dirMu sync.Mutex `state:"nosave"`
+
+	// dirCache holds the merged entries of the upper and lower
+	// directories, if the upper directory can only be modified through the
+	// overlay and the lower one is immutable. It is reset whenever the
+	// upper directory is modified through the overlay, see invalidateDir.
+	dirCache *SortedDentryMap `state:"nosave"`
+
+	// lowerEntries holds the entries of the lower directory if it is on an
+	// immutable mount (see mountImmutable), and so can't change; only the
+	// upper directory is then read again once dirCache has been reset.
+	lowerEntries map[string]DentAttr `state:"nosave"`
+
+	// lookupMu protects the fields below, which cache the results of
+	// lookups in a directory for overlayLookup. They are only used if the
+	// upper directory can only be modified through the overlay, and
+	// negative only if the lower directory is also immutable.
+	lookupMu sync.RWMutex `state:"nosave"`
+
+	// lookupGen is incremented whenever the upper directory is modified,
+	// see invalidateDir.
+	lookupGen uint64 `state:"nosave"`
+
+	// negative holds names that exist in neither the upper nor the lower
+	// directory. It is reset whenever the upper directory is modified,
+	// and holds at most overlayNegativeCacheSize names.
+	negative map[string]struct{} `state:"nosave"`
+
+	// whiteouts holds the names of the whiteouts of the upper directory,
+	// once they have been loaded from its extended attributes.
+	whiteouts map[string]struct{} `state:"nosave"`
 }
 
 // newOverlayEntry returns a new overlayEntry.
@@ -235,6 +278,32 @@ func (o *overlayEntry) release() {
 	if o.lower != nil {
 		o.lower.DecRef()
 	}
+	if o.lazy != nil {
+		o.lazy.DecRef()
+	}
+}
+
+// markMapped records that a file of o is about to be memory mapped, so that
+// its contents must be copied up in full, and finishes copying them up if
+// they are copied lazily.
+func (o *overlayEntry) markMapped(ctx context.Context) error {
+	o.copyMu.RLock()
+	mapped := o.mapped
+	o.copyMu.RUnlock()
+	if mapped {
+		return nil
+	}
+
+	o.copyMu.Lock()
+	defer o.copyMu.Unlock()
+	if o.lazy != nil {
+		if err := o.lazy.finish(ctx); err != nil {
+			log.Warningf("copy up failed to copy up contents: %v", err)
+			return syserror.EIO
+		}
+	}
+	o.mapped = true
+	return nil
 }
 
 // overlayUpperMountSource gives the upper mount of an overlay mount.
@@ -295,6 +364,13 @@ func (o *overlayEntry) Translate(ctx context.Context, required, optional memmap.
 	return o.inodeLocked().Mappable().Translate(ctx, required, optional, at)
 }
 
+// MapsDirectly implements directMappable.MapsDirectly.
+func (o *overlayEntry) MapsDirectly() bool {
+	o.dataMu.RLock()
+	defer o.dataMu.RUnlock()
+	return mapsDirectly(o.inodeLocked().Mappable())
+}
+
 // InvalidateUnsavable implements memmap.Mappable.InvalidateUnsavable.
 func (o *overlayEntry) InvalidateUnsavable(ctx context.Context) error {
 	o.mapsMu.Lock()
@@ -171,6 +171,40 @@ type Config struct {
 
 	ImgPath string
 
+	// ImgFSLazy indicates that imgfs layers are mounted in lazy mode, where
+	// inodes are only created for the files that are looked up.
+	ImgFSLazy bool
+
+	// ImgFSMergeLayers indicates that multiple imgfs layers are mounted as
+	// a single imgfs mount that merges them, instead of one overlay per
+	// layer.
+	ImgFSMergeLayers bool
+
+	// ImgFSTrace is the host path to write an access trace of the image to,
+	// if not empty. The trace is a zar seq config listing the files of the
+	// image in the order they were first accessed.
+	ImgFSTrace string
+
+	// ImgFSTraceFD is the FD donated to the sandbox to write the access
+	// trace to, or -1.
+	ImgFSTraceFD int
+
+	// ImgFSVerityDigests holds the trusted digests of the imgfs layers,
+	// printed by zar -verity, separated by colons from the bottom layer
+	// up. An empty digest leaves its layer unpinned. imgfs verifies layers
+	// that have a hash tree either way.
+	ImgFSVerityDigests string
+
+	// ImgFSPread indicates that imgfs only maps the index of the images,
+	// and reads file data with pread into a bounded buffer cache, to
+	// spare the sentry's address space with many large layers.
+	ImgFSPread bool
+
+	// ImgFSDirentCacheSize is the number of Dirents each imgfs mount, and
+	// the overlays stacked on them, keep in memory beyond application
+	// references to them. Zero keeps the default.
+	ImgFSDirentCacheSize uint64
+
 	// Overlay is whether to wrap the root filesystem in an overlay.
 	Overlay bool
 
@@ -227,6 +261,12 @@ func (c *Config) ToFlags() []string {
 		"--debug-log-format=" + c.DebugLogFormat,
 		"--file-access=" + c.FileAccess.String(),
 		"--img-path=" + c.ImgPath,
+		"--imgfs-lazy=" + strconv.FormatBool(c.ImgFSLazy),
+		"--imgfs-merge-layers=" + strconv.FormatBool(c.ImgFSMergeLayers),
+		"--imgfs-trace=" + c.ImgFSTrace,
+		"--imgfs-verity-digests=" + c.ImgFSVerityDigests,
+		"--imgfs-pread=" + strconv.FormatBool(c.ImgFSPread),
+		"--imgfs-dirent-cache-size=" + strconv.FormatUint(c.ImgFSDirentCacheSize, 10),
 		"--overlay=" + strconv.FormatBool(c.Overlay),
 		"--network=" + c.Network.String(),
 		"--log-packets=" + strconv.FormatBool(c.LogPackets),
@@ -197,6 +197,13 @@ var allowedSyscalls = seccomp.SyscallRules{
 			seccomp.AllowAny{},
 			seccomp.AllowValue(syscall.MAP_PRIVATE | syscall.MAP_ANONYMOUS | syscall.MAP_NORESERVE),
 		},
+		{
+			// imgfs maps images at huge page aligned addresses.
+			seccomp.AllowAny{},
+			seccomp.AllowAny{},
+			seccomp.AllowValue(syscall.PROT_READ),
+			seccomp.AllowValue(syscall.MAP_SHARED | syscall.MAP_FIXED),
+		},
 		{
 			seccomp.AllowAny{},
 			seccomp.AllowAny{},
@@ -186,7 +186,7 @@ func createRootMount(ctx context.Context, spec *specs.Spec, conf *Config, fds *f
 	// mounted even if they are not in the spec.
 	submounts := append(subtargets("/", mounts), "/dev", "/sys", "/proc", "/tmp")
 	//rootInode, err = addSubmountOverlay
-	rootInode, err = mountExpFS(ctx, layerFDs, submounts)
+	rootInode, err = mountExpFS(ctx, conf, layerFDs, submounts)
 	if err != nil {
 		return nil, fmt.Errorf("creating root mount point: %v", err)
 	}
@@ -254,7 +254,7 @@ func getMountNameAndOptions(conf *Config, m specs.Mount, fds *fdDispenser) (stri
 
 	case imgfs:
 		fsName = m.Type
-		opts = []string{"packageFD=" + strconv.Itoa(conf.PackageFD)}
+		opts = imgfsMountOptions(conf, conf.PackageFD)
 		useOverlay = true
 		// ImgFS will always use overlay
 
@@ -708,12 +708,49 @@ func destroyContainerFS(ctx context.Context, cid string, k *kernel.Kernel) error
 	return nil
 }
 
+// imgfsMountOptions returns the imgfs mount options for the images open at
+// fds: a single image, or the layers of a merged mount from the bottom one
+// up. Only accesses to the package image are traced; tracing can't be
+// combined with merged layers, see main.go.
+func imgfsMountOptions(conf *Config, fds ...int) []string {
+	var opts []string
+	if len(fds) == 1 {
+		opts = append(opts, "packageFD="+strconv.Itoa(fds[0]))
+	} else {
+		var s []string
+		for _, fd := range fds {
+			s = append(s, strconv.Itoa(fd))
+		}
+		opts = append(opts, "layerFDs="+strings.Join(s, ":"))
+	}
+	if conf.ImgFSLazy {
+		opts = append(opts, "lazy=true")
+	}
+	if conf.ImgFSPread {
+		opts = append(opts, "pread=true")
+	}
+	if conf.ImgFSTrace != "" && conf.ImgFSTraceFD >= 0 && len(fds) == 1 && fds[0] == conf.PackageFD {
+		opts = append(opts, "traceFD="+strconv.Itoa(conf.ImgFSTraceFD))
+	}
+	return opts
+}
+
+// setImgFSDirentCacheSize sets the dirent cache size of the mount of inode,
+// an imgfs mount or an overlay on one, if the configuration overrides it.
+func setImgFSDirentCacheSize(conf *Config, inode *fs.Inode) {
+	if conf.ImgFSDirentCacheSize != 0 {
+		inode.MountSource.SetDirentCacheSize(conf.ImgFSDirentCacheSize)
+	}
+}
+
 // mountExpFS should be executed after root create ramfs stub
-func mountExpFS(ctx context.Context, layerFDs []int, submounts []string) (*fs.Inode, error) {
+func mountExpFS(ctx context.Context, conf *Config, layerFDs []int, submounts []string) (*fs.Inode, error) {
 	var currentNode *fs.Inode
 
 	if submounts != nil {
-		msrc := fs.NewPseudoMountSource()
+		// The stub directories are only ever reached as the lower of
+		// the imgfs overlays, so they never change.
+		msrc := fs.NewNonCachingMountSource(nil, fs.MountSourceFlags{Immutable: true})
 		mountTree, err := ramfs.MakeDirectoryTree(ctx, msrc, submounts)
 		if err != nil {
 			return nil, fmt.Errorf("creating mount tree: %v", err)
@@ -724,15 +761,51 @@ func mountExpFS(ctx context.Context, layerFDs []int, submounts []string) (*fs.In
 	flags := fs.MountSourceFlags{ReadOnly: true}
 	imgFS := mustFindFilesystem("imgfs")
 
+	var digests []string
+	if conf.ImgFSVerityDigests != "" {
+		digests = strings.Split(conf.ImgFSVerityDigests, ":")
+		if len(digests) != len(layerFDs) {
+			return nil, fmt.Errorf("%d imgfs verity digests for %d layers", len(digests), len(layerFDs))
+		}
+	}
+
+	if conf.ImgFSMergeLayers && len(layerFDs) > 1 {
+		// A single mount resolves whiteouts and shadowing between the
+		// layers once, so lookups don't walk an overlay per layer.
+		opts := imgfsMountOptions(conf, layerFDs...)
+		if digests != nil {
+			opts = append(opts, "verityDigest="+conf.ImgFSVerityDigests)
+		}
+		imgfsNode, err := imgFS.Mount(ctx, "imgfs-layers", flags, strings.Join(opts, ","), nil)
+		if err != nil {
+			return nil, fmt.Errorf("mounting imgfs layers %v, err: %v", layerFDs, err)
+		}
+		setImgFSDirentCacheSize(conf, imgfsNode)
+		if currentNode == nil {
+			return imgfsNode, nil
+		}
+		if currentNode, err = fs.NewOverlayRoot(ctx, imgfsNode, currentNode, flags); err != nil {
+			return nil, fmt.Errorf("creating imgfs overlay: %v", err)
+		}
+		setImgFSDirentCacheSize(conf, currentNode)
+		return currentNode, nil
+	}
+
 	for index, lfd := range layerFDs {
-		imgfsNode, err := imgFS.Mount(ctx, "imgfs-layer-" + strconv.Itoa(index), flags, "packageFD=" + strconv.Itoa(lfd), nil)
+		opts := imgfsMountOptions(conf, lfd)
+		if digests != nil && digests[index] != "" {
+			opts = append(opts, "verityDigest="+digests[index])
+		}
+		imgfsNode, err := imgFS.Mount(ctx, "imgfs-layer-" + strconv.Itoa(index), flags, strings.Join(opts, ","), nil)
 		if err != nil {
 			return nil, fmt.Errorf("mounting imgfs layer %v, layerFD %v, err: %v", index, lfd, err)
 		}
+		setImgFSDirentCacheSize(conf, imgfsNode)
     if currentNode != nil {
 	    if currentNode, err = fs.NewOverlayRoot(ctx, imgfsNode, currentNode, flags); err != nil {
 		    return nil, fmt.Errorf("creating imgfs overlay: %v", err)
       }
+	    setImgFSDirentCacheSize(conf, currentNode)
 		} else {
       currentNode = imgfsNode
     }
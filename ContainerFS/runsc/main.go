@@ -47,6 +47,13 @@ var (
 	// Debugging flags.
 	debugLog       = flag.String("debug-log", "", "additional location for logs. If it ends with '/', log files are created inside the directory with default names. The following variables are available: %TIMESTAMP%, %COMMAND%.")
   imgPath				 = flag.String("img-path", "", "image path for ImgFS")
+	imgfsLazy      = flag.Bool("imgfs-lazy", false, "create imgfs inodes on first lookup instead of for the whole image at mount time.")
+	imgfsMerge     = flag.Bool("imgfs-merge-layers", false, "mount multiple imgfs layers as one merged tree instead of stacking an overlay per layer.")
+	imgfsTrace     = flag.String("imgfs-trace", "", "write the order in which files of the image are first accessed to this path, as a zar seq config.")
+	imgfsTraceFD   = flag.Int("imgfs-trace-fd", -1, "file descriptor to write the imgfs access trace to.")
+	imgfsDigests   = flag.String("imgfs-verity-digests", "", "trusted digests of the imgfs layers, printed by zar -verity, separated by colons from the bottom layer up.")
+	imgfsPread     = flag.Bool("imgfs-pread", false, "map only the index of imgfs images and read file data with pread, instead of mapping whole images.")
+	imgfsDirents   = flag.Uint64("imgfs-dirent-cache-size", 0, "number of dirents each imgfs mount keeps in memory beyond open files. 0 keeps the default.")
 	logPackets     = flag.Bool("log-packets", false, "enable network packet logging")
 	logFD          = flag.Int("log-fd", -1, "file descriptor to log to.  If set, the 'log' flag is ignored.")
 	debugLogFD     = flag.Int("debug-log-fd", -1, "file descriptor to write debug logs to.  If set, the 'debug-log-dir' flag is ignored.")
@@ -132,6 +139,10 @@ func main() {
 		cmd.Fatalf("%v", err)
 	}
 
+	if *imgfsMerge && *imgfsTrace != "" {
+		cmd.Fatalf("imgfs-trace flag is incompatible with imgfs-merge-layers")
+	}
+
 	if *imgPath == "" {
 		cmd.Fatalf("imgPath %v is invalid", *imgPath)
 	}
@@ -145,6 +156,13 @@ func main() {
 		DebugLogFormat: *debugLogFormat,
 		FileAccess:     fsAccess,
 		ImgPath:				*imgPath,
+		ImgFSLazy:      *imgfsLazy,
+		ImgFSMergeLayers: *imgfsMerge,
+		ImgFSTrace:     *imgfsTrace,
+		ImgFSTraceFD:   *imgfsTraceFD,
+		ImgFSVerityDigests: *imgfsDigests,
+		ImgFSPread:     *imgfsPread,
+		ImgFSDirentCacheSize: *imgfsDirents,
 		Overlay:        *overlay,
 		Network:        netType,
 		LogPackets:     *logPackets,
@@ -235,6 +253,7 @@ func main() {
 	log.Infof("\t\tNetwork: %v, logging: %t", conf.Network, conf.LogPackets)
 	log.Infof("\t\tStrace: %t, max size: %d, syscalls: %s", conf.Strace, conf.StraceLogSize, conf.StraceSyscalls)
 	log.Infof("\t\tPackageFD: %v", *packageFD)
+	log.Infof("\t\tImgFS lazy: %t, merge layers: %t, trace: %q", conf.ImgFSLazy, conf.ImgFSMergeLayers, conf.ImgFSTrace)
 	log.Infof("***************************")
 
 	// Call the subcommand and pass in the configuration.
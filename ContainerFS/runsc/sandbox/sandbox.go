@@ -337,6 +337,17 @@ func (s *Sandbox) createSandboxProcess(spec *specs.Spec, conf *boot.Config, bund
     cmd.Args = append(cmd.Args, "--package-fd="+strconv.Itoa(nextFD))
 	nextFD++
 
+	if conf.ImgFSTrace != "" {
+		traceFile, err := os.OpenFile(conf.ImgFSTrace, os.O_WRONLY|os.O_CREATE|os.O_TRUNC|os.O_APPEND, 0644)
+		if err != nil {
+			return fmt.Errorf("opening imgfs trace file: %v", err)
+		}
+		defer traceFile.Close()
+		cmd.ExtraFiles = append(cmd.ExtraFiles, traceFile)
+		cmd.Args = append(cmd.Args, "--imgfs-trace-fd="+strconv.Itoa(nextFD))
+		nextFD++
+	}
+
 
 
     // Add the "boot" command to the args.
@@ -0,0 +1,666 @@
+// Package index implements the on-disk metadata index of a zar image.
+//
+// The index is designed to be used straight out of a read-only mmap of the
+// image: every record has a fixed width and every string lives in a single
+// string table, so a reader never has to decode or allocate anything before
+// looking up a file. imgfs (pkg/sentry/fs/imgfs/index.go) carries its own
+// reader for this layout; the two must be kept in sync.
+//
+// An image looks like this (all integers are little endian):
+//
+//	| file data | entries | string table | [attrs] | [chunks] | [hot] | section table | trailer |
+//
+// The trailer is the last TrailerSize bytes of the image:
+//
+//	SectionTableOffset uint64  // absolute offset of the section table
+//	SectionCount       uint32
+//	Version            uint32
+//	Magic              [8]byte
+//
+// The section table is SectionCount descriptors of SectionSize bytes:
+//
+//	Kind   uint32
+//	Flags  uint32
+//	Offset uint64  // absolute offset of the section in the image
+//	Size   uint64
+//
+// Readers must ignore sections of unknown kinds.
+//
+// Images built with zar -verity have a verity section, a hash tree over the
+// image described in verity.go, followed only by the section table and the
+// trailer.
+//
+// If the image is compressed, the file data is stored as a sequence of
+// independently compressed chunks, described by a chunks section:
+//
+//	ChunkSize uint32
+//	Algorithm uint32  // ChunkFlate
+//	DataSize  uint64  // size of the uncompressed data
+//	Offsets   [n+1]uint64
+//
+// Chunk i holds the uncompressed data [i*ChunkSize, (i+1)*ChunkSize) and is
+// stored at [Offsets[i], Offsets[i+1]) in the image. A chunk is stored
+// uncompressed if compressing it didn't make it smaller, which readers detect
+// from its stored size. Entry Begin and End are offsets in the uncompressed
+// data.
+//
+// A hot section lists the ranges of file data accessed at startup, in the
+// order they were first accessed, so that readers can prefetch them. It is an
+// array of 16 byte records:
+//
+//	Offset uint64  // offset in the (uncompressed) file data
+//	Length uint64
+//
+// If the entries section has the EntriesSorted flag, the children of every
+// directory are sorted by name (bytewise), so readers can binary search them.
+// If it has the EntriesPageAligned flag, the data of every regular file
+// starts on a page boundary and is zero padded up to the next one, so readers
+// can map file pages straight from the image. Files with the EntryPacked flag
+// are the exception: small files packed back to back into shared pages, whose
+// pages also hold the data of other files, so readers must copy them. Large
+// files may also start on a 2 MiB boundary (zar -hugealign), which readers
+// detect from their offset.
+//
+// Files with identical contents may share the same data extent.
+//
+// The entries section is an array of EntrySize byte records. Entry 0 is the
+// root directory. The children of a directory are stored contiguously, in
+// [FirstChild, FirstChild+ChildCount):
+//
+//	Begin      int64   // start of the file data, -1 if none
+//	End        int64   // end of the file data, -1 if none
+//	ModTime    int64   // modification time in nanoseconds
+//	NameOffset uint32  // offset of the name in the string table
+//	NameLen    uint32
+//	LinkOffset uint32  // offset of the symlink target in the string table
+//	LinkLen    uint32
+//	FirstChild uint32  // directories only
+//	ChildCount uint32  // directories only
+//	Type       uint32
+//	Flags      uint32  // EntryOpaque, EntryPacked; other bits are reserved and zero
+//
+// A whiteout entry records that the name was deleted in this layer of a
+// layered image, and hides it in the layers below. A directory with the
+// EntryOpaque flag hides the contents of the directories of the same name in
+// the layers below.
+//
+// An attrs section holds the ownership and permissions of every entry, as
+// records of AttrSize bytes in the order of the entries:
+//
+//	Mode  uint32  // permission bits, with the setuid, setgid and sticky bits
+//	UID   uint32
+//	GID   uint32
+//	Links uint32  // regular files only: the number of entries that are hard
+//	              // links to the same file, including this one
+//
+// Images built before zar recorded attributes have no attrs section, and
+// readers use defaults for them. Readers count the links of a directory
+// themselves, from its subdirectories.
+package index
+
+import (
+	"bytes"
+	"compress/flate"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"sort"
+)
+
+const (
+	// Version is the index version written by this package. Images
+	// produced by older versions of zar used an encoding/gob header and
+	// are implicitly version 1.
+	Version = 2
+
+	// TrailerSize is the size of the trailer at the end of the image.
+	TrailerSize = 24
+
+	// SectionSize is the size of one section table descriptor.
+	SectionSize = 24
+
+	// EntrySize is the size of one entry record.
+	EntrySize = 56
+
+	// AttrSize is the size of one record of the attrs section.
+	AttrSize = 16
+)
+
+// Magic identifies a zar image. It is the last 8 bytes of the image.
+var Magic = [8]byte{'z', 'a', 'r', 'i', 'm', 'a', 'g', 'e'}
+
+// Section kinds.
+const (
+	SectionEntries uint32 = iota + 1
+	SectionStrings
+	SectionChunks
+	SectionHot
+	SectionVerity
+	SectionAttrs
+)
+
+// ChunkFlate is the chunk compression algorithm: raw DEFLATE (RFC 1951), as
+// produced by compress/flate.
+const ChunkFlate uint32 = 1
+
+// chunksHeaderSize is the size of the chunks section before the offsets.
+const chunksHeaderSize = 16
+
+// Section flags of the entries section.
+const (
+	// EntriesSorted indicates that the children of every directory are
+	// sorted by name.
+	EntriesSorted uint32 = 1 << iota
+
+	// EntriesPageAligned indicates that the data of every regular file is
+	// page aligned and zero padded to a page boundary.
+	EntriesPageAligned
+)
+
+// Options controls how an index is encoded.
+type Options struct {
+	// PageAligned must be set if the file data of the image was written
+	// page aligned (zar -pagealign).
+	PageAligned bool
+
+	// Chunks describes the chunks of a compressed image, or is nil if
+	// the image isn't compressed.
+	Chunks *Chunks
+
+	// Hot lists the ranges of file data to prefetch, in order.
+	Hot []Range
+
+	// Verity, if not nil, adds a verity section, see verity.go.
+	Verity *Verity
+}
+
+// Range is a range of file data.
+type Range struct {
+	Offset int64
+	Length int64
+}
+
+// Chunks describes the compressed file data of an image.
+type Chunks struct {
+	// Size is the uncompressed size of every chunk but the last.
+	Size uint32
+
+	// DataSize is the uncompressed size of the data.
+	DataSize int64
+
+	// Offsets holds the offset of every chunk in the image, followed by
+	// the end of the last chunk.
+	Offsets []int64
+}
+
+// Entry types. These match the fileType values of imgfs.
+const (
+	TypeRegularFile uint32 = iota
+	TypeDirectory
+	TypeSymlink
+	TypeWhiteout
+)
+
+// Entry flags.
+const (
+	// EntryOpaque marks a directory that replaces, rather than merges
+	// with, the directories of the same name in lower layers.
+	EntryOpaque uint32 = 1 << iota
+
+	// EntryPacked marks a regular file of a page aligned image whose data
+	// is packed into pages shared with other files rather than page
+	// aligned.
+	EntryPacked
+)
+
+// Attr holds the attributes of an entry recorded in the attrs section.
+type Attr struct {
+	Mode  uint32
+	UID   uint32
+	GID   uint32
+	Links uint32
+}
+
+// DefaultAttr returns the attributes recorded for entries of type t whose
+// attributes are unknown: owned by root, writable by the owner only, and
+// with a single link.
+func DefaultAttr(t uint32) Attr {
+	switch t {
+	case TypeDirectory:
+		return Attr{Mode: 0755, Links: 1}
+	case TypeSymlink:
+		return Attr{Mode: 0777, Links: 1}
+	default:
+		return Attr{Mode: 0644, Links: 1}
+	}
+}
+
+// Entry is the in-memory form of an entry, used when building an index.
+type Entry struct {
+	Begin   int64
+	End     int64
+	ModTime int64
+	Name    string
+	Link    string
+	Type    uint32
+	Flags   uint32
+
+	// Attr holds the attributes of the entry, or is nil if they are
+	// unknown, in which case DefaultAttr is recorded.
+	Attr *Attr
+
+	// Children holds the entries of a directory, in the order they will
+	// appear in the index.
+	Children []*Entry
+}
+
+// stringTable deduplicates strings written to the string table.
+type stringTable struct {
+	buf  bytes.Buffer
+	offs map[string]uint32
+}
+
+func (t *stringTable) add(s string) (uint32, uint32) {
+	if s == "" {
+		return 0, 0
+	}
+	if off, ok := t.offs[s]; ok {
+		return off, uint32(len(s))
+	}
+	off := uint32(t.buf.Len())
+	t.buf.WriteString(s)
+	t.offs[s] = off
+	return off, uint32(len(s))
+}
+
+// Encode serializes the index rooted at root. base is the offset in the
+// image at which the returned bytes will be written; it is needed because
+// section offsets are absolute. The returned bytes include the trailer and
+// must therefore be the last thing written to the image.
+//
+// Encode sorts the children of every directory by name.
+func Encode(root *Entry, base int64, opts Options) ([]byte, error) {
+	if root.Type != TypeDirectory {
+		return nil, errors.New("index root must be a directory")
+	}
+
+	// Lay out the entries breadth first so that the children of every
+	// directory are contiguous.
+	order := []*Entry{root}
+	first := make(map[*Entry]uint32)
+	for i := 0; i < len(order); i++ {
+		e := order[i]
+		if e.Type != TypeDirectory {
+			continue
+		}
+		sort.Slice(e.Children, func(a, b int) bool {
+			return e.Children[a].Name < e.Children[b].Name
+		})
+		for j := 1; j < len(e.Children); j++ {
+			if e.Children[j].Name == e.Children[j-1].Name {
+				return nil, fmt.Errorf("duplicate entry %q", e.Children[j].Name)
+			}
+		}
+		first[e] = uint32(len(order))
+		order = append(order, e.Children...)
+	}
+	if uint64(len(order)) > uint64(^uint32(0)) {
+		return nil, fmt.Errorf("too many entries: %d", len(order))
+	}
+
+	strs := stringTable{offs: make(map[string]uint32)}
+	entries := make([]byte, len(order)*EntrySize)
+	attrs := make([]byte, len(order)*AttrSize)
+	for i, e := range order {
+		a := DefaultAttr(e.Type)
+		if e.Attr != nil {
+			a = *e.Attr
+		}
+		arec := attrs[i*AttrSize : (i+1)*AttrSize]
+		binary.LittleEndian.PutUint32(arec[0:], a.Mode)
+		binary.LittleEndian.PutUint32(arec[4:], a.UID)
+		binary.LittleEndian.PutUint32(arec[8:], a.GID)
+		binary.LittleEndian.PutUint32(arec[12:], a.Links)
+
+		rec := entries[i*EntrySize : (i+1)*EntrySize]
+		nameOff, nameLen := strs.add(e.Name)
+		linkOff, linkLen := strs.add(e.Link)
+		binary.LittleEndian.PutUint64(rec[0:], uint64(e.Begin))
+		binary.LittleEndian.PutUint64(rec[8:], uint64(e.End))
+		binary.LittleEndian.PutUint64(rec[16:], uint64(e.ModTime))
+		binary.LittleEndian.PutUint32(rec[24:], nameOff)
+		binary.LittleEndian.PutUint32(rec[28:], nameLen)
+		binary.LittleEndian.PutUint32(rec[32:], linkOff)
+		binary.LittleEndian.PutUint32(rec[36:], linkLen)
+		if e.Type == TypeDirectory {
+			binary.LittleEndian.PutUint32(rec[40:], first[e])
+			binary.LittleEndian.PutUint32(rec[44:], uint32(len(e.Children)))
+		}
+		binary.LittleEndian.PutUint32(rec[48:], e.Type)
+		binary.LittleEndian.PutUint32(rec[52:], e.Flags)
+	}
+	if uint64(strs.buf.Len()) > uint64(^uint32(0)) {
+		return nil, fmt.Errorf("string table too large: %d bytes", strs.buf.Len())
+	}
+
+	entriesFlags := EntriesSorted
+	if opts.PageAligned && opts.Chunks == nil {
+		entriesFlags |= EntriesPageAligned
+	}
+
+	var out bytes.Buffer
+	out.Write(entries)
+	out.Write(strs.buf.Bytes())
+	attrsOff := uint64(base) + uint64(out.Len())
+	out.Write(attrs)
+
+	sections := [][4]uint64{
+		{uint64(SectionEntries), uint64(entriesFlags), uint64(base), uint64(len(entries))},
+		{uint64(SectionStrings), 0, uint64(base) + uint64(len(entries)), uint64(strs.buf.Len())},
+		{uint64(SectionAttrs), 0, attrsOff, uint64(len(attrs))},
+	}
+	if c := opts.Chunks; c != nil {
+		if c.Size == 0 || int64(len(c.Offsets)) != (c.DataSize+int64(c.Size)-1)/int64(c.Size)+1 {
+			return nil, fmt.Errorf("bad chunk table: %d offsets for %d bytes in chunks of %d", len(c.Offsets), c.DataSize, c.Size)
+		}
+		off := uint64(base) + uint64(out.Len())
+		var buf [8]byte
+		binary.LittleEndian.PutUint32(buf[0:], c.Size)
+		binary.LittleEndian.PutUint32(buf[4:], ChunkFlate)
+		out.Write(buf[:])
+		binary.LittleEndian.PutUint64(buf[:], uint64(c.DataSize))
+		out.Write(buf[:])
+		for _, o := range c.Offsets {
+			binary.LittleEndian.PutUint64(buf[:], uint64(o))
+			out.Write(buf[:])
+		}
+		sections = append(sections, [4]uint64{uint64(SectionChunks), 0, off, uint64(out.Len()) - (off - uint64(base))})
+	}
+	if len(opts.Hot) > 0 {
+		off := uint64(base) + uint64(out.Len())
+		var buf [16]byte
+		for _, r := range opts.Hot {
+			if r.Offset < 0 || r.Length <= 0 {
+				return nil, fmt.Errorf("bad hot range %+v", r)
+			}
+			binary.LittleEndian.PutUint64(buf[0:], uint64(r.Offset))
+			binary.LittleEndian.PutUint64(buf[8:], uint64(r.Length))
+			out.Write(buf[:])
+		}
+		sections = append(sections, [4]uint64{uint64(SectionHot), 0, off, uint64(16 * len(opts.Hot))})
+	}
+	var verity []byte
+	if v := opts.Verity; v != nil {
+		// The tree covers everything before it
+		off := uint64(base) + uint64(out.Len())
+		var err error
+		verity, err = encodeVerity(io.MultiReader(v.Data, bytes.NewReader(out.Bytes())), int64(off))
+		if err != nil {
+			return nil, err
+		}
+		out.Write(verity)
+		sections = append(sections, [4]uint64{uint64(SectionVerity), 0, off, uint64(len(verity))})
+	}
+	tableOff := uint64(base) + uint64(out.Len())
+	var desc [SectionSize]byte
+	for _, s := range sections {
+		binary.LittleEndian.PutUint32(desc[0:], uint32(s[0]))
+		binary.LittleEndian.PutUint32(desc[4:], uint32(s[1]))
+		binary.LittleEndian.PutUint64(desc[8:], s[2])
+		binary.LittleEndian.PutUint64(desc[16:], s[3])
+		out.Write(desc[:])
+	}
+
+	var trailer [TrailerSize]byte
+	binary.LittleEndian.PutUint64(trailer[0:], tableOff)
+	binary.LittleEndian.PutUint32(trailer[8:], uint32(len(sections)))
+	binary.LittleEndian.PutUint32(trailer[12:], Version)
+	copy(trailer[16:], Magic[:])
+	out.Write(trailer[:])
+	if verity != nil {
+		opts.Verity.Digest = digest(verity, out.Bytes()[tableOff-uint64(base):])
+	}
+	return out.Bytes(), nil
+}
+
+// Index is a read-only view of the index of a mapped image.
+type Index struct {
+	data    []byte
+	entries []byte
+	strings []byte
+	chunks  []byte
+	hot     []byte
+	verity  []byte
+	attrs   []byte
+
+	// verityOff and tableOff are the offsets of the verity section and of
+	// the section table
+	verityOff uint64
+	tableOff  uint64
+}
+
+// Open locates the index of the image held in data. Nothing is copied; the
+// returned Index refers to data.
+func Open(data []byte) (*Index, error) {
+	if len(data) < TrailerSize {
+		return nil, fmt.Errorf("image too small: %d bytes", len(data))
+	}
+	trailer := data[len(data)-TrailerSize:]
+	if !bytes.Equal(trailer[16:], Magic[:]) {
+		return nil, errors.New("bad image magic, not a zar image or built by an older zar")
+	}
+	if v := binary.LittleEndian.Uint32(trailer[12:]); v != Version {
+		return nil, fmt.Errorf("unsupported image version %d", v)
+	}
+	tableOff := binary.LittleEndian.Uint64(trailer[0:])
+	count := uint64(binary.LittleEndian.Uint32(trailer[8:]))
+	limit := uint64(len(data) - TrailerSize)
+	if tableOff > limit || count*SectionSize > limit-tableOff {
+		return nil, fmt.Errorf("section table [%d, +%d) out of range", tableOff, count*SectionSize)
+	}
+
+	x := &Index{data: data, tableOff: tableOff}
+	for i := uint64(0); i < count; i++ {
+		desc := data[tableOff+i*SectionSize:]
+		kind := binary.LittleEndian.Uint32(desc[0:])
+		off := binary.LittleEndian.Uint64(desc[8:])
+		size := binary.LittleEndian.Uint64(desc[16:])
+		if off > limit || size > limit-off {
+			return nil, fmt.Errorf("section %d [%d, +%d) out of range", kind, off, size)
+		}
+		switch kind {
+		case SectionEntries:
+			x.entries = data[off : off+size]
+		case SectionStrings:
+			x.strings = data[off : off+size]
+		case SectionChunks:
+			x.chunks = data[off : off+size]
+		case SectionHot:
+			x.hot = data[off : off+size]
+		case SectionAttrs:
+			x.attrs = data[off : off+size]
+		case SectionVerity:
+			if size < verityHeaderSize {
+				return nil, fmt.Errorf("bad verity section size %d", size)
+			}
+			x.verity = data[off : off+size]
+			x.verityOff = off
+		}
+	}
+	if len(x.entries) == 0 || len(x.entries)%EntrySize != 0 {
+		return nil, fmt.Errorf("bad entries section size %d", len(x.entries))
+	}
+	if x.attrs != nil && len(x.attrs) != len(x.entries)/EntrySize*AttrSize {
+		return nil, fmt.Errorf("bad attrs section size %d", len(x.attrs))
+	}
+	if x.chunks != nil {
+		if len(x.chunks) < chunksHeaderSize || (len(x.chunks)-chunksHeaderSize)%8 != 0 {
+			return nil, fmt.Errorf("bad chunks section size %d", len(x.chunks))
+		}
+		if a := binary.LittleEndian.Uint32(x.chunks[4:]); a != ChunkFlate {
+			return nil, fmt.Errorf("unsupported chunk compression %d", a)
+		}
+	}
+	if x.Type(0) != TypeDirectory {
+		return nil, errors.New("root entry is not a directory")
+	}
+	return x, nil
+}
+
+// Len returns the number of entries in the index.
+func (x *Index) Len() uint32 {
+	return uint32(len(x.entries) / EntrySize)
+}
+
+func (x *Index) rec(i uint32) []byte {
+	return x.entries[uint64(i)*EntrySize : uint64(i+1)*EntrySize]
+}
+
+// Begin returns the start of the data of entry i.
+func (x *Index) Begin(i uint32) int64 {
+	return int64(binary.LittleEndian.Uint64(x.rec(i)[0:]))
+}
+
+// End returns the end of the data of entry i.
+func (x *Index) End(i uint32) int64 {
+	return int64(binary.LittleEndian.Uint64(x.rec(i)[8:]))
+}
+
+// ModTime returns the modification time of entry i.
+func (x *Index) ModTime(i uint32) int64 {
+	return int64(binary.LittleEndian.Uint64(x.rec(i)[16:]))
+}
+
+func (x *Index) str(off, n uint32) []byte {
+	if uint64(off)+uint64(n) > uint64(len(x.strings)) {
+		return nil
+	}
+	return x.strings[off : off+n]
+}
+
+// Name returns the name of entry i, or nil if it is out of range.
+func (x *Index) Name(i uint32) []byte {
+	r := x.rec(i)
+	return x.str(binary.LittleEndian.Uint32(r[24:]), binary.LittleEndian.Uint32(r[28:]))
+}
+
+// Link returns the symlink target of entry i, or nil if it is out of range.
+func (x *Index) Link(i uint32) []byte {
+	r := x.rec(i)
+	return x.str(binary.LittleEndian.Uint32(r[32:]), binary.LittleEndian.Uint32(r[36:]))
+}
+
+// Children returns the range of child entries of directory i. Children always
+// follow their parent in the index; an invalid range yields no children so
+// that a corrupt image can neither cause out of bounds accesses nor loops.
+func (x *Index) Children(i uint32) (first, count uint32) {
+	r := x.rec(i)
+	first = binary.LittleEndian.Uint32(r[40:])
+	count = binary.LittleEndian.Uint32(r[44:])
+	if n := x.Len(); first <= i || first > n || count > n-first {
+		return 0, 0
+	}
+	return first, count
+}
+
+// Type returns the type of entry i.
+func (x *Index) Type(i uint32) uint32 {
+	return binary.LittleEndian.Uint32(x.rec(i)[48:])
+}
+
+// Flags returns the flags of entry i.
+func (x *Index) Flags(i uint32) uint32 {
+	return binary.LittleEndian.Uint32(x.rec(i)[52:])
+}
+
+// Attr returns the attributes of entry i, or false if the image doesn't
+// record attributes.
+func (x *Index) Attr(i uint32) (Attr, bool) {
+	if x.attrs == nil {
+		return Attr{}, false
+	}
+	r := x.attrs[uint64(i)*AttrSize:]
+	return Attr{
+		Mode:  binary.LittleEndian.Uint32(r[0:]),
+		UID:   binary.LittleEndian.Uint32(r[4:]),
+		GID:   binary.LittleEndian.Uint32(r[8:]),
+		Links: binary.LittleEndian.Uint32(r[12:]),
+	}, true
+}
+
+// Compressed returns true if the file data of the image is compressed.
+func (x *Index) Compressed() bool {
+	return x.chunks != nil
+}
+
+// Hot returns the ranges of file data to prefetch.
+func (x *Index) Hot() []Range {
+	var hot []Range
+	for b := x.hot; len(b) >= 16; b = b[16:] {
+		hot = append(hot, Range{
+			Offset: int64(binary.LittleEndian.Uint64(b[0:])),
+			Length: int64(binary.LittleEndian.Uint64(b[8:])),
+		})
+	}
+	return hot
+}
+
+// Data returns the data of regular file i, decompressing it if needed.
+func (x *Index) Data(i uint32) ([]byte, error) {
+	begin, end := x.Begin(i), x.End(i)
+	if begin < 0 || end < begin {
+		return nil, fmt.Errorf("entry %d has invalid extent [%d, %d)", i, begin, end)
+	}
+	if x.chunks == nil {
+		if end > int64(len(x.data)) {
+			return nil, fmt.Errorf("entry %d has invalid extent [%d, %d)", i, begin, end)
+		}
+		return x.data[begin:end], nil
+	}
+
+	size := int64(binary.LittleEndian.Uint32(x.chunks[0:]))
+	dataSize := int64(binary.LittleEndian.Uint64(x.chunks[8:]))
+	offsets := x.chunks[chunksHeaderSize:]
+	if size == 0 || end > dataSize || int64(len(offsets)/8) != (dataSize+size-1)/size+1 {
+		return nil, fmt.Errorf("entry %d has invalid extent [%d, %d)", i, begin, end)
+	}
+	out := make([]byte, 0, end-begin)
+	for c := begin / size; c*size < end; c++ {
+		chunkEnd := (c + 1) * size
+		if chunkEnd > dataSize {
+			chunkEnd = dataSize
+		}
+		chunk, err := x.chunk(offsets, c, chunkEnd-c*size)
+		if err != nil {
+			return nil, err
+		}
+		lo, hi := int64(0), int64(len(chunk))
+		if begin > c*size {
+			lo = begin - c*size
+		}
+		if end < chunkEnd {
+			hi = end - c*size
+		}
+		out = append(out, chunk[lo:hi]...)
+	}
+	return out, nil
+}
+
+// chunk returns chunk c, of uncompressed size n.
+func (x *Index) chunk(offsets []byte, c, n int64) ([]byte, error) {
+	start := binary.LittleEndian.Uint64(offsets[c*8:])
+	end := binary.LittleEndian.Uint64(offsets[(c+1)*8:])
+	if start > end || end > uint64(len(x.data)) {
+		return nil, fmt.Errorf("chunk %d [%d, %d) out of range", c, start, end)
+	}
+	stored := x.data[start:end]
+	if int64(len(stored)) == n {
+		return stored, nil
+	}
+	buf := make([]byte, n)
+	if _, err := io.ReadFull(flate.NewReader(bytes.NewReader(stored)), buf); err != nil {
+		return nil, fmt.Errorf("can't decompress chunk %d: %v", c, err)
+	}
+	return buf, nil
+}
@@ -0,0 +1,152 @@
+package index
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+)
+
+// The verity section holds a hash tree over the image, which lets readers
+// verify the blocks of the image they use, when they first use them, instead
+// of hashing the whole image up front:
+//
+//	BlockSize uint32  // VerityBlockSize
+//	Algorithm uint32  // VeritySHA256
+//	DataSize  uint64  // the tree covers [0, DataSize) of the image
+//	Root      [32]byte
+//	Levels    []byte  // the hashes of every level but the root, bottom up
+//
+// DataSize is the offset of the verity section: the tree covers the file data
+// and every other section. Level 0 holds the hash of every BlockSize block of
+// [0, DataSize); level i+1 holds the hash of every BlockSize group of the
+// hashes of level i. The last block or group is zero padded. The level of a
+// single hash is the root, which isn't stored in Levels.
+//
+// The digest of an image is the SHA-256 of the verity header (the fields up
+// to Root), the section table and the trailer. It covers every byte of the
+// image, and is the value to trust: readers that know the digest of an image
+// verify that the image has it before trusting its tree.
+const (
+	// VerityBlockSize is the size of the blocks of the hash tree.
+	VerityBlockSize = 4096
+
+	// VeritySHA256 is the hash of the tree: SHA-256.
+	VeritySHA256 uint32 = 1
+
+	// verityHeaderSize is the size of the verity section before the
+	// levels.
+	verityHeaderSize = 16 + sha256.Size
+)
+
+// Verity asks Encode to add a verity section to the index.
+type Verity struct {
+	// Data reads the bytes of the image written before the index.
+	Data io.Reader
+
+	// Digest is set by Encode to the digest of the image.
+	Digest [sha256.Size]byte
+}
+
+// hashTree returns the levels of the hash tree of the size bytes read from r,
+// from the bottom level up to the root.
+func hashTree(r io.Reader, size int64) ([][]byte, error) {
+	var level []byte
+	block := make([]byte, VerityBlockSize)
+	for off := int64(0); off < size; off += VerityBlockSize {
+		n := size - off
+		if n > VerityBlockSize {
+			n = VerityBlockSize
+		}
+		if _, err := io.ReadFull(r, block[:n]); err != nil {
+			return nil, err
+		}
+		for i := n; i < VerityBlockSize; i++ {
+			block[i] = 0
+		}
+		sum := sha256.Sum256(block)
+		level = append(level, sum[:]...)
+	}
+	levels := [][]byte{level}
+	for len(level) > sha256.Size {
+		var next []byte
+		for off := 0; off < len(level); off += VerityBlockSize {
+			copy(block, level[off:])
+			if rest := len(level) - off; rest < VerityBlockSize {
+				for i := rest; i < VerityBlockSize; i++ {
+					block[i] = 0
+				}
+			}
+			sum := sha256.Sum256(block)
+			next = append(next, sum[:]...)
+		}
+		levels = append(levels, next)
+		level = next
+	}
+	return levels, nil
+}
+
+// encodeVerity returns the verity section of the size bytes read from r.
+func encodeVerity(r io.Reader, size int64) ([]byte, error) {
+	if size <= 0 {
+		return nil, errors.New("nothing to verify")
+	}
+	levels, err := hashTree(r, size)
+	if err != nil {
+		return nil, fmt.Errorf("can't hash image: %v", err)
+	}
+	var out bytes.Buffer
+	var buf [16]byte
+	binary.LittleEndian.PutUint32(buf[0:], VerityBlockSize)
+	binary.LittleEndian.PutUint32(buf[4:], VeritySHA256)
+	binary.LittleEndian.PutUint64(buf[8:], uint64(size))
+	out.Write(buf[:])
+	out.Write(levels[len(levels)-1])
+	for _, l := range levels[:len(levels)-1] {
+		out.Write(l)
+	}
+	return out.Bytes(), nil
+}
+
+// digest returns the digest of an image from its verity header and the rest
+// of the image after the verity section: its section table and trailer.
+func digest(header, tail []byte) [sha256.Size]byte {
+	h := sha256.New()
+	h.Write(header[:verityHeaderSize])
+	h.Write(tail)
+	var d [sha256.Size]byte
+	h.Sum(d[:0])
+	return d
+}
+
+// VerityDigest returns the digest of the image, if it has a verity section.
+func (x *Index) VerityDigest() ([sha256.Size]byte, bool) {
+	if x.verity == nil {
+		return [sha256.Size]byte{}, false
+	}
+	return digest(x.verity, x.data[x.tableOff:]), true
+}
+
+// Verify checks the whole image against its hash tree, and returns the
+// digest of the image.
+func (x *Index) Verify() ([sha256.Size]byte, error) {
+	var d [sha256.Size]byte
+	if x.verity == nil {
+		return d, errors.New("image has no verity section")
+	}
+	size := int64(binary.LittleEndian.Uint64(x.verity[8:]))
+	if uint64(size) != x.verityOff {
+		return d, fmt.Errorf("hash tree covers %d bytes, not the %d before it", size, x.verityOff)
+	}
+	want, err := encodeVerity(bytes.NewReader(x.data[:size]), size)
+	if err != nil {
+		return d, err
+	}
+	if !bytes.Equal(want, x.verity) {
+		return d, errors.New("image doesn't match its hash tree")
+	}
+	d, _ = x.VerityDigest()
+	return d, nil
+}
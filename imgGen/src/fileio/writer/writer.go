@@ -3,15 +3,20 @@ package writer
 
 import(
 	"bufio"
+	"bytes"
+	"compress/flate"
 	"errors"
 	"fmt"
+	"io"
 	"log"
 	"os"
-	"encoding/binary"
+	"runtime"
 )
 
 const(
         pageBoundary = 4096     // The boundary that needs to be upheld for page alignment
+        hugePageBoundary = 2 << 20 // The boundary of huge pages, see Align
+        copyBufferSize = 1 << 20 // The buffer size used by WriteFrom to fill chunks
  )
 
 // FileWriter struct writes to a file
@@ -24,6 +29,37 @@ type FileWriter struct {
 
         // f is the file object that the writer will write to
         F *os.File // TODO: Rename
+
+        // ChunkSize, if not zero, makes Write compress the data in
+        // independently compressed chunks of ChunkSize bytes. Count then
+        // counts uncompressed bytes. It must be set before the first Write.
+        ChunkSize int
+
+        // chunk holds the data of the chunk being filled
+        chunk []byte
+
+        // chunkOffsets holds the offset in the file of every chunk written
+        chunkOffsets []int64
+
+        // size is the number of bytes written to the file, which differs
+        // from Count while compressing
+        size int64
+
+        // compress feeds the chunk compressors, which compress chunks in
+        // parallel
+        compress chan *pendingChunk
+
+        // queue holds the chunks being compressed, in file order
+        queue []*pendingChunk
+
+        // free holds chunk buffers for reuse
+        free [][]byte
+
+        // buf is the buffer WriteFrom reads into while compressing
+        buf []byte
+
+        // Verbose prints the size and padding of every write
+        Verbose bool
 }
 
 // Initializes a writer by creating the image file and attaching a writer to it\
@@ -57,42 +93,267 @@ func (w *FileWriter) Init(fn string) error {
 // parameter (pageAlign): whether to page align the data
 func (w *FileWriter) Write(data []byte, pageAlign bool) (int64, error) {
         // Writes to FileWriter
-        n, err := w.W.Write(data)
+        n, err := w.write(data)
         if err != nil {
                 return int64(n), err
         }
+        return w.pad(int64(n), pageAlign)
+}
+
+// WriteFrom writes size bytes read from r to the zar file, like Write, without
+// holding them in memory. Uncompressed data is copied by os.File.ReadFrom,
+// which uses copy_file_range(2) where the kernel supports it if r is an
+// *os.File, so that the data doesn't pass through user space.
+//
+// parameter (r)        : the reader to read the data from, e.g. a file at its current offset
+// parameter (size)     : the number of bytes to write
+// parameter (pageAlign): whether to page align the data
+func (w *FileWriter) WriteFrom(r io.Reader, size int64, pageAlign bool) (int64, error) {
+        var n int64
+        if w.ChunkSize == 0 {
+                // Data buffered by earlier writes goes first
+                if err := w.W.Flush(); err != nil {
+                        return 0, err
+                }
+                var err error
+                n, err = io.CopyN(w.F, r, size)
+                w.size += n
+                if err != nil {
+                        return n, err
+                }
+                return w.pad(n, pageAlign)
+        }
+
+        if w.buf == nil {
+                w.buf = make([]byte, copyBufferSize)
+        }
+        for n < size {
+                b := w.buf
+                if size-n < int64(len(b)) {
+                        b = b[:size-n]
+                }
+                if _, err := io.ReadFull(r, b); err != nil {
+                        return n, err
+                }
+                m, err := w.write(b)
+                n += int64(m)
+                if err != nil {
+                        return n, err
+                }
+        }
+        return w.pad(n, pageAlign)
+}
 
-        // Adds padding if last page is not page aligned
-        n2 := 0
+// Truncate discards everything written after offset, which must not be
+// greater than Count, so that the next write starts there. It isn't possible
+// while compressing.
+func (w *FileWriter) Truncate(offset int64) error {
+        if w.ChunkSize != 0 {
+                return errors.New("can't truncate while compressing")
+        }
+        if offset > w.Count {
+                return fmt.Errorf("can't truncate to %v beyond %v", offset, w.Count)
+        }
+        if err := w.W.Flush(); err != nil {
+                return err
+        }
+        if err := w.F.Truncate(offset); err != nil {
+                return err
+        }
+        if _, err := w.F.Seek(offset, io.SeekStart); err != nil {
+                return err
+        }
+        w.Count = offset
+        w.size = offset
+        return nil
+}
+
+// Align pads the data written so far up to the next page boundary, or huge
+// page boundary if huge is set, so that the next write starts on one. Data
+// written without pageAlign, such as small files packed into shared pages,
+// doesn't end on a page boundary.
+func (w *FileWriter) Align(huge bool) error {
+        boundary := int64(pageBoundary)
+        if huge {
+                boundary = hugePageBoundary
+        }
+        pad := (boundary - w.Count % boundary) % boundary
+        if pad == 0 {
+                return nil
+        }
+        if w.Verbose {
+                fmt.Printf("alignment padding size: %v\n", pad)
+        }
+        n, err := w.write(make([]byte, pad))
+        w.Count += int64(n)
+        return err
+}
+
+// pad adds padding after n bytes of data just written if pageAlign is set and
+// the data doesn't end on a page boundary, and updates the offsets. It returns
+// the "real" end of the data.
+func (w *FileWriter) pad(n int64, pageAlign bool) (int64, error) {
+        var n2 int
+        var err error
         if pageAlign {
                 pad := (pageBoundary - n % pageBoundary) % pageBoundary
-                fmt.Printf("current write size: %v, padding size: %v\n", n, pad)
+                if w.Verbose {
+                        fmt.Printf("current write size: %v, padding size: %v\n", n, pad)
+                }
                 if pad > 0 {
                         s := make([]byte, pad)
-                        n2, err = w.W.Write(s)
+                        n2, err = w.write(s)
                 }
         }
 
         // Updates offsets
-        realEnd := w.Count + int64(n)
-        w.Count += int64(n + n2)
+        realEnd := w.Count + n
+        w.Count += n + int64(n2)
 
         return realEnd, err
 }
 
-// WriteInt64 writes a int64 to the FileWriter
-//
-// parameter (v): the value to be written
-func (w *FileWriter) WriteInt64(v int64) (int64, error) {
-        buf := make([]byte, binary.MaxVarintLen64)
-        binary.PutVarint(buf, v)
-        n, err := w.Write(buf, false)
-        return n, err
+// write writes data to the file, or to the current chunk when compressing
+func (w *FileWriter) write(data []byte) (int, error) {
+        if w.ChunkSize == 0 {
+                n, err := w.W.Write(data)
+                w.size += int64(n)
+                return n, err
+        }
+
+        written := 0
+        for len(data) > 0 {
+                n := w.ChunkSize - len(w.chunk)
+                if n > len(data) {
+                        n = len(data)
+                }
+                w.chunk = append(w.chunk, data[:n]...)
+                data = data[n:]
+                written += n
+                if len(w.chunk) == w.ChunkSize {
+                        if err := w.flushChunk(); err != nil {
+                                return written, err
+                        }
+                }
+        }
+        return written, nil
+}
+
+// pendingChunk is a chunk handed to the compressors
+type pendingChunk struct {
+        // data is the uncompressed chunk
+        data []byte
+
+        // stored is what is written to the file, set once done is closed
+        stored []byte
+        err    error
+        done   chan struct{}
+}
+
+// compressChunks is a chunk compressor. A chunk that doesn't shrink is stored
+// as is; readers recognize it by its size.
+func compressChunks(chunks <-chan *pendingChunk) {
+        c, _ := flate.NewWriter(nil, flate.BestCompression)
+        for p := range chunks {
+                var buf bytes.Buffer
+                c.Reset(&buf)
+                _, p.err = c.Write(p.data)
+                if p.err == nil {
+                        p.err = c.Close()
+                }
+                p.stored = buf.Bytes()
+                if len(p.stored) >= len(p.data) {
+                        p.stored = p.data
+                }
+                close(p.done)
+        }
+}
+
+// flushChunk hands the current chunk to the compressors, and writes out the
+// compressed chunks at the head of the queue. Chunks are compressed in
+// parallel but written in order; at most two per CPU are in flight.
+func (w *FileWriter) flushChunk() error {
+        workers := runtime.NumCPU()
+        if w.compress == nil {
+                w.compress = make(chan *pendingChunk, 2*workers)
+                for i := 0; i < workers; i++ {
+                        go compressChunks(w.compress)
+                }
+        }
+
+        p := &pendingChunk{data: w.chunk, done: make(chan struct{})}
+        w.queue = append(w.queue, p)
+        w.compress <- p
+        if n := len(w.free); n > 0 {
+                w.chunk, w.free = w.free[n-1], w.free[:n-1]
+        } else {
+                w.chunk = make([]byte, 0, w.ChunkSize)
+        }
+        return w.writeChunks(2 * workers)
+}
+
+// writeChunks writes out the compressed chunks at the head of the queue,
+// waiting for them until at most max chunks are left in the queue.
+func (w *FileWriter) writeChunks(max int) error {
+        for len(w.queue) > 0 {
+                p := w.queue[0]
+                if len(w.queue) <= max {
+                        select {
+                        case <-p.done:
+                        default:
+                                return nil
+                        }
+                }
+                <-p.done
+                w.queue = w.queue[1:]
+                if p.err != nil {
+                        return p.err
+                }
+                w.chunkOffsets = append(w.chunkOffsets, w.size)
+                n, err := w.W.Write(p.stored)
+                w.size += int64(n)
+                if err != nil {
+                        return err
+                }
+                w.free = append(w.free, p.data[:0])
+        }
+        return nil
+}
+
+// FinishChunks writes out the last chunk and stops compressing. It returns
+// the offsets in the file of every chunk followed by the end of the last
+// one, and the uncompressed size of the data. Count is the size of the file
+// again afterwards, so that the index can be written after the chunks.
+func (w *FileWriter) FinishChunks() ([]int64, int64, error) {
+        if w.ChunkSize == 0 {
+                return nil, 0, errors.New("writer is not compressing")
+        }
+        if len(w.chunk) > 0 {
+                if err := w.flushChunk(); err != nil {
+                        return nil, 0, err
+                }
+        }
+        if err := w.writeChunks(0); err != nil {
+                return nil, 0, err
+        }
+        if w.compress != nil {
+                close(w.compress)
+                w.compress = nil
+        }
+        w.free = nil
+        dataSize := w.Count
+        fmt.Printf("compressed %v bytes in %v chunks to %v bytes\n", dataSize, len(w.chunkOffsets), w.size)
+
+        offsets := append(w.chunkOffsets, w.size)
+        w.ChunkSize = 0
+        w.chunkOffsets = nil
+        w.Count = w.size
+        return offsets, dataSize, nil
 }
 
 // Close closes the filewriter by flushing any buffer
 func (w *FileWriter) Close() error {
-        fmt.Println("Written Bytes: ", w.Count, "+ metadata size")
+        fmt.Println("Written Bytes: ", w.Count)
         w.W.Flush()
         return w.F.Close()
 }
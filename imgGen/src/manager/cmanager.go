@@ -4,6 +4,8 @@ import (
 	"bufio"
 	"log"
 	"os"
+	"path/filepath"
+	"strconv"
 	"strings"
 )
 
@@ -19,6 +21,22 @@ type CManager struct {
 
         // The configuration file with the structure of the img file specified in the Format in the Format field
         ConfigFile *os.File
+
+        // Rest indicates whether the files of the root dir that the config
+        // doesn't list are included after the ones it lists. This allows a
+        // config that only lists some files, e.g. an imgfs access trace, to
+        // produce a complete image.
+        Rest bool
+}
+
+// modTime returns the modification time of the file at p, or 0 if it can't
+// be read
+func modTime(p string) int64 {
+        fi, err := os.Lstat(p)
+        if err != nil {
+                return 0
+        }
+        return fi.ModTime().UnixNano()
 }
 
 // WalkDir implements Manager.WalkDir. Overrides zarManager'si
@@ -28,12 +46,16 @@ func (c *CManager) WalkDir(dir string, foldername string, root bool) {
         case "seq":
         // seq Format is as follows
         // <File (f) or Start Dir (sd) or End Dir (ed) > | < path excluding file name > | < name > \n
+        // or a page range hint for a file listed before:
+        // p | < path excluding file name > | < name > | < first page > | < page count > \n
         // TODO: Create a file reader struct to allow for generic reading of different Formats.
         // TODO: For now, prototype will always assume seq
         default:
                 log.Fatalf("Config Format not recognized")
         }
 
+        c.rootAttr = attrAt(dir)
+
         // Close file once scanning is complete
         defer c.ConfigFile.Close()
         scanner := bufio.NewScanner(c.ConfigFile)
@@ -47,14 +69,29 @@ func (c *CManager) WalkDir(dir string, foldername string, root bool) {
 
                 switch action {
                 case "f":
-                        c.IncludeFile(name, path, 0)
-                        // TODO: change 0 to valid timestamp
+                        c.IncludeFile(name, path, modTime(filepath.Join(path, name)))
                 case "sd":
-                        c.IncludeFolderBegin(name, 0)
+                        c.IncludeFolderBegin(name, modTime(filepath.Join(path, name)))
+                        c.setAttr(attrAt(filepath.Join(path, name)))
                 case "ed":
                         c.IncludeFolderEnd()
+                case "p":
+                        if len(s) != 5 {
+                                log.Fatalf("Config page hint malformed: %v", scanner.Text())
+                        }
+                        first, err1 := strconv.ParseInt(s[3], 10, 64)
+                        count, err2 := strconv.ParseInt(s[4], 10, 64)
+                        if err1 != nil || err2 != nil {
+                                log.Fatalf("Config page hint malformed: %v", scanner.Text())
+                        }
+                        c.Hints = append(c.Hints, PageHint{filepath.Join(path, name), first, count})
                 default:
                         log.Fatalf("Config action not recognized")
                 }
         }
+
+        // Include everything the config didn't list
+        if c.Rest {
+                c.ZarManager.WalkDir(dir, foldername, 0, true)
+        }
 }
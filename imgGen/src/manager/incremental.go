@@ -0,0 +1,106 @@
+package manager
+
+import (
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+
+	"fileio/index"
+)
+
+// previous is the image a new image is incrementally built from
+type previous struct {
+	// path is the path of the previous image file, which is opened by every
+	// worker that copies data from it
+	path string
+
+	// root is the host directory the previous image was built from, which
+	// paths of the new image are made relative to
+	root string
+
+	// files maps the path of every regular file of the previous image,
+	// relative to its root, to its entry
+	files map[string]prevFile
+
+	// reused maps the extents of the previous image copied so far to their
+	// extent in the new image, so that files that shared data still do
+	reused map[extent]extent
+
+	// reusedFiles and reusedBytes count the files and bytes copied from
+	// the previous image
+	reusedFiles int64
+	reusedBytes int64
+}
+
+// prevFile is a regular file of the previous image
+type prevFile struct {
+	extent  extent
+	modTime int64
+}
+
+// UsePrevious makes files whose size and modification time are the same as
+// in a previous image be copied from that image, by extent, instead of being
+// read again: an unchanged file costs a stat and, where the kernel supports
+// it, a copy_file_range(2) (which may share the blocks with the previous
+// image) instead of reading and hashing it. Changed and new files are read
+// as usual.
+//
+// parameter (img)      : the path of the previous image, which must be uncompressed
+// parameter (x)        : the index of the previous image
+// parameter (root)     : the host directory both images are built from
+func (z *ZarManager) UsePrevious(img string, x *index.Index, root string) error {
+	if x.Compressed() {
+		return fmt.Errorf("previous image %v is compressed, its data can't be copied", img)
+	}
+	p := &previous{
+		path:   img,
+		root:   root,
+		files:  make(map[string]prevFile),
+		reused: make(map[extent]extent),
+	}
+	p.add(x, 0, "")
+	z.prev = p
+	return nil
+}
+
+// add adds the regular files below directory dir of x, whose path is dirPath.
+func (p *previous) add(x *index.Index, dir uint32, dirPath string) {
+	first, count := x.Children(dir)
+	for i := first; i < first+count; i++ {
+		name := filepath.Join(dirPath, string(x.Name(i)))
+		switch x.Type(i) {
+		case index.TypeDirectory:
+			p.add(x, i, name)
+		case index.TypeRegularFile:
+			p.files[name] = prevFile{extent{x.Begin(i), x.End(i)}, x.ModTime(i)}
+		}
+	}
+}
+
+// lookup returns the extent in the previous image of the file at host path
+// path, if it has the given size and modification time.
+func (p *previous) lookup(path string, size, modTime int64) (extent, bool) {
+	rel, err := filepath.Rel(p.root, path)
+	if err != nil {
+		return extent{}, false
+	}
+	f, ok := p.files[rel]
+	if !ok || f.modTime != modTime || f.extent.end-f.extent.begin != size {
+		return extent{}, false
+	}
+	return f.extent, true
+}
+
+// open opens the previous image at the data of e.
+func (p *previous) open(e extent) (*os.File, error) {
+	f, err := os.Open(p.path)
+	if err != nil {
+		return nil, err
+	}
+	if _, err := f.Seek(e.begin, io.SeekStart); err != nil {
+		f.Close()
+		return nil, err
+	}
+	return f, nil
+}
@@ -3,17 +3,24 @@ package manager
 
 
 import (
-	"encoding/gob"
+	"crypto/sha256"
 	"fmt"
+	"io"
 	"io/ioutil"
 	"log"
 	"os"
 	"path"
+	"path/filepath"
+	"syscall"
 
+	"fileio/index"
 	"fileio/writer"
 )
 
-// fileType is an integer representating the file type (RegularFile, Directory, Symlink)
+// pageSize is the page size used by page hints
+const pageSize = 4096
+
+// fileType is an integer representating the file type (RegularFile, Directory, Symlink, Whiteout)
 type fileType int
 
 const (
@@ -21,6 +28,7 @@ const (
     RegularFile fileType = iota
     Directory
     Symlink
+    Whiteout
 )
 
 // Manager is an interface for creating the image file.
@@ -42,12 +50,12 @@ type Manager interface {
         // IncludeFolderEnd initializes Metadata for the end of a file
         IncludeFolderEnd()
 
-        // IncludeFile reads the given file, adds it to the file, and creates the Metadata.
+        // IncludeFile creates the Metadata for the given file and queues it to be
+        // added to the file. Files are written in the order they are included.
         //
         // parameter (fn)       : name of the file to be read
         // paramter (basedir)   : name of the current directory relative to root
-        // return               : new offset into the image file
-        IncludeFile(fn string, basedir string, mod_time int64) (int64, error)
+        IncludeFile(fn string, basedir string, mod_time int64) error
 
         // WriterHeader writes the Metadata for the imagefile to the end of the image file.
         // The location of the beginning of the header is written at the very end as an int64
@@ -71,8 +79,21 @@ type FileMetadata struct {
 		// File modification time
         ModTime int64 
 
-        // Type indicated the type of a specific file (dir, symlink or regular file)
+        // Type indicated the type of a specific file (dir, symlink, regular file or whiteout)
         Type fileType
+
+        // Opaque marks a directory that hides the directories of the same
+        // name in lower layers
+        Opaque bool
+
+        // Packed marks a regular file packed into pages shared with other
+        // files in a page aligned image, see PackSize
+        Packed bool
+
+        // Attr holds the ownership and permissions of the file, or is nil if
+        // they are unknown. Files included by IncludeFile get those of the
+        // host file when it is read.
+        Attr *index.Attr
 }
 
 // Manager is the main driver of creating the image file. It writes the data and stores Metadata.
@@ -80,6 +101,63 @@ type ZarManager struct {
         // PageAlign indicates whether files will be aligned at page boundaries
         PageAlign bool
 
+        // PackSize is, with PageAlign, the size up to which regular files
+        // are packed back to back into shared pages instead of being page
+        // aligned, which saves most of a page per small file. Packed files
+        // can't be mapped straight from the image, so imgfs copies them.
+        PackSize int64
+
+        // HugeAlignSize is, with PageAlign, the size from which regular
+        // files start on a 2 MiB boundary, so that hosts with transparent
+        // huge pages can map their data with huge pages. 0 disables it.
+        HugeAlignSize int64
+
+        // Verity adds a hash tree over the image to the index, so that imgfs
+        // can verify the blocks it reads, see index.Verity
+        Verity bool
+
+        // ChunkSize, if not zero, makes the file data be compressed in
+        // independent chunks of ChunkSize bytes
+        ChunkSize int
+
+        // Dedup indicates whether files with identical contents share a
+        // single extent in the image instead of being written again
+        Dedup bool
+
+        // extents maps the SHA-256 of the contents of every file written so
+        // far to its extent, for Dedup
+        extents map[[sha256.Size]byte]extent
+
+        // DedupBytes is the number of bytes not written thanks to Dedup
+        DedupBytes int64
+
+        // Workers is the number of files read in parallel, or the number of
+        // CPUs if not positive
+        Workers int
+
+        // Verbose prints every file and folder included
+        Verbose bool
+
+        // pipe holds the files being read and written, see pipeline.go
+        pipe *pipeline
+
+        // prev is the image unchanged files are copied from, see UsePrevious
+        prev *previous
+
+        // links holds the hard links included by IncludeTar
+        links []hardLink
+
+        // rootAttr holds the attributes of the root directory, if known
+        rootAttr *index.Attr
+
+        // included maps the absolute host path of every file included so
+        // far to the index of its entry in Metadata, so that WalkDir can skip
+        // files a config already included and page hints can be resolved
+        included map[string]int
+
+        // Hints holds the page range hints read from a config
+        Hints []PageHint
+
         // The FileWriter for this zar image
         Writer writer.FileWriter
 
@@ -87,17 +165,65 @@ type ZarManager struct {
         Metadata []FileMetadata
 }
 
+// PageHint records that pages [First, First+Count) of a file were accessed
+// while tracing a workload
+type PageHint struct {
+        // Path is the host path of the file
+        Path string
+
+        First int64
+        Count int64
+}
+
+// extent is the location of file data in the image file
+type extent struct {
+        begin int64
+        end   int64
+}
+
 type DirInfo struct {
         Name string
         ModTime int64 
 }
 
+// attrOf returns the ownership and permissions of the host file described
+// by fi. Hard links are included as separate files, so the host link count
+// isn't kept.
+func attrOf(fi os.FileInfo) *index.Attr {
+        a := &index.Attr{Mode: uint32(fi.Mode().Perm()), Links: 1}
+        if st, ok := fi.Sys().(*syscall.Stat_t); ok {
+                a.Mode = st.Mode & 07777
+                a.UID, a.GID = st.Uid, st.Gid
+        }
+        return a
+}
+
+// attrAt returns the attributes of the host file at p, or nil if they can't
+// be read
+func attrAt(p string) *index.Attr {
+        fi, err := os.Lstat(p)
+        if err != nil {
+                return nil
+        }
+        return attrOf(fi)
+}
+
+// setAttr sets the attributes of the entry included last
+func (z *ZarManager) setAttr(a *index.Attr) {
+        z.Metadata[len(z.Metadata)-1].Attr = a
+}
+
 // WalkDir implemented Manager.WalkDir
 func (z *ZarManager) WalkDir(dir string, foldername string, mod_time int64, root bool) {
         // root dir not marked as directory
-        if !root {
+        if !root && z.Verbose {
                 fmt.Printf("including folder: %v, name: %v\n", dir, foldername)
+        }
+        if !root {
                 z.IncludeFolderBegin(foldername, mod_time)
+                z.setAttr(attrAt(dir))
+        } else {
+                z.rootAttr = attrAt(dir)
         }
 
         // Retrieve all files in current directory
@@ -117,16 +243,24 @@ func (z *ZarManager) WalkDir(dir string, foldername string, mod_time int64, root
 
                 if symlink {
                         // Symbolic link is an indirection, thus read and include
-                        fmt.Printf("%v is symlink.", file_path)
+                        if z.Verbose {
+                                fmt.Printf("%v is symlink.\n", file_path)
+                        }
                         real_dest, err := os.Readlink(file_path)
                         if err != nil {
                                 log.Fatalf("error. Can't read symlink file. %v", real_dest)
                         }
                         // TODO: Can we replace with file redirecting to here? Could eliminate symbolic links
                         z.IncludeSymlink(name, real_dest, mod_time)
+                        z.setAttr(attrOf(file))
                 } else {
                         if !file.IsDir() {
-                                fmt.Printf("including file: %v\n", name)
+                                if z.isIncluded(file_path) {
+                                        continue
+                                }
+                                if z.Verbose {
+                                        fmt.Printf("including file: %v\n", name)
+                                }
                                 z.IncludeFile(name, dir, mod_time)
                         } else {
                                 dirs = append(dirs, &DirInfo{name, mod_time})
@@ -194,48 +328,244 @@ func (z *ZarManager) IncludeSymlink(name string, link string, mod_time int64) {
         z.Metadata = append(z.Metadata, *h)
 }
 
-// IncludeFile implements Manager.IncludeFile
-func (z *ZarManager) IncludeFile(fn string, basedir string, mod_time int64) (int64, error) {
-        content, err := ioutil.ReadFile(path.Join(basedir, fn))
-        if err != nil {
-                log.Fatalf("can't include file %v, err: %v", fn, err)
-                return 0, nil
+// IncludeWhiteout adds Metadata for a whiteout, which hides the file called
+// name in the lower layers of a layered image.
+//
+// parameter (name)     : name of the hidden file
+func (z *ZarManager) IncludeWhiteout(name string) {
+        h := &FileMetadata{
+                        Begin   : -1,
+                        End     : -1,
+                        Name    : name,
+                        Type    : Whiteout,
         }
+        z.Metadata = append(z.Metadata, *h)
+}
 
-        // Retrieve the current offset into the file and write the file contents
-        oldCounter := z.Writer.Count
-        real_end, err := z.Writer.Write(content, z.PageAlign)
+// isIncluded returns whether the file at host path p was already included
+func (z *ZarManager) isIncluded(p string) bool {
+        abs, err := filepath.Abs(p)
         if err != nil {
-                        log.Fatalf("can't write to file")
-                        return 0, err
+                return false
+        }
+        _, ok := z.included[abs]
+        return ok
+}
+
+// IncludeFile implements Manager.IncludeFile
+//
+// The file is read by a pool of workers and written to the image by a single
+// writer (see pipeline.go); its extent is filled in by WriteHeader.
+func (z *ZarManager) IncludeFile(fn string, basedir string, mod_time int64) error {
+        h := &FileMetadata{
+                        Begin   : -1,
+                        End     : -1,
+                        Name    : fn,
+                        Type    : RegularFile,
+                        ModTime : mod_time,
         }
+        z.Metadata = append(z.Metadata, *h)
+        z.markIncluded(path.Join(basedir, fn), len(z.Metadata)-1)
+        z.includeFile(path.Join(basedir, fn), len(z.Metadata)-1)
+        return nil
+}
 
-        // Create the file Metadata
+// IncludeData adds a file with the given contents, read from elsewhere than
+// the host file system (e.g. another image), like IncludeFile.
+//
+// parameter (fn)       : name of the file
+// parameter (data)     : the contents of the file, which must not change until WriteHeader
+// parameter (mod_time) : the modification time of the file
+func (z *ZarManager) IncludeData(fn string, data []byte, mod_time int64) {
         h := &FileMetadata{
-                        Begin   : oldCounter,
-                        End     : real_end,
+                        Begin   : -1,
+                        End     : -1,
                         Name    : fn,
                         Type    : RegularFile,
                         ModTime : mod_time,
         }
         z.Metadata = append(z.Metadata, *h)
+        z.includeData(fn, data, len(z.Metadata)-1)
+}
+
+// markIncluded records that the file at host path p was included as
+// Metadata[i]
+func (z *ZarManager) markIncluded(p string, i int) {
+        abs, err := filepath.Abs(p)
+        if err != nil {
+                return
+        }
+        if z.included == nil {
+                z.included = make(map[string]int)
+        }
+        z.included[abs] = i
+}
 
-        return real_end, err
+// HotRanges resolves the page hints to ranges of the image's file data, in
+// the order of the hints. Contiguous ranges are merged and hints for files
+// that weren't included are ignored. It must be called after the files are
+// written.
+func (z *ZarManager) HotRanges() []index.Range {
+        var hot []index.Range
+        for _, h := range z.Hints {
+                abs, err := filepath.Abs(h.Path)
+                if err != nil {
+                        continue
+                }
+                i, ok := z.included[abs]
+                if !ok || h.First < 0 || h.Count <= 0 {
+                        fmt.Printf("ignoring page hint for %v\n", h.Path)
+                        continue
+                }
+                e := extent{z.Metadata[i].Begin, z.Metadata[i].End}
+                begin := e.begin + h.First*pageSize
+                end := begin + h.Count*pageSize
+                if end > e.end {
+                        end = e.end
+                }
+                if begin >= end {
+                        continue
+                }
+                if n := len(hot); n > 0 && hot[n-1].Offset+hot[n-1].Length == begin {
+                        hot[n-1].Length += end - begin
+                        continue
+                }
+                hot = append(hot, index.Range{Offset: begin, Length: end - begin})
+        }
+        return hot
+}
+
+// BuildIndex converts the flat Metadata list, in which folders are delimited
+// by IncludeFolderBegin and IncludeFolderEnd entries, into the directory tree
+// stored in the image index.
+//
+// A folder may be begun several times in the same parent, e.g. by a config
+// that lists files of a folder out of order; its entries are then merged.
+func (z *ZarManager) BuildIndex() (*index.Entry, error) {
+        root := &index.Entry{Begin: -1, End: -1, Type: index.TypeDirectory, Attr: z.rootAttr}
+        stack := []*index.Entry{root}
+        dirs := make(map[*index.Entry]map[string]*index.Entry)
+
+        for _, m := range z.Metadata {
+                parent := stack[len(stack)-1]
+                if m.Type == Directory && m.Name == ".." {
+                        if len(stack) == 1 {
+                                return nil, fmt.Errorf("unbalanced folder end in metadata")
+                        }
+                        stack = stack[:len(stack)-1]
+                        continue
+                }
+
+                if m.Type == Directory {
+                        if d, ok := dirs[parent][m.Name]; ok {
+                                if d.ModTime == 0 {
+                                        d.ModTime = m.ModTime
+                                }
+                                if d.Attr == nil {
+                                        d.Attr = m.Attr
+                                }
+                                if m.Opaque {
+                                        d.Flags |= index.EntryOpaque
+                                }
+                                stack = append(stack, d)
+                                continue
+                        }
+                }
+
+                e := &index.Entry{
+                        Begin   : m.Begin,
+                        End     : m.End,
+                        ModTime : m.ModTime,
+                        Name    : m.Name,
+                        Link    : m.Link,
+                        Type    : uint32(m.Type),
+                        Attr    : m.Attr,
+                }
+                if m.Opaque {
+                        e.Flags |= index.EntryOpaque
+                }
+                if m.Packed {
+                        e.Flags |= index.EntryPacked
+                }
+                parent.Children = append(parent.Children, e)
+                if m.Type == Directory {
+                        if dirs[parent] == nil {
+                                dirs[parent] = make(map[string]*index.Entry)
+                        }
+                        dirs[parent][m.Name] = e
+                        stack = append(stack, e)
+                }
+        }
+
+        if len(stack) != 1 {
+                return nil, fmt.Errorf("%d folders not closed in metadata", len(stack)-1)
+        }
+        return root, nil
 }
 
-// TODO: Is gob the best choice here?
 // WriteHeader implements Manager.WriteHeader
+//
+// The Metadata is written as a fixed-layout index (see package fileio/index)
+// that imgfs reads directly from the mmapped image.
 func (z *ZarManager) WriteHeader() error {
+        z.flushFiles()
+        z.resolveLinks()
+
+        opts := index.Options{PageAligned: z.PageAlign, Hot: z.HotRanges()}
+        if len(opts.Hot) > 0 {
+                fmt.Printf("hot ranges: %v\n", len(opts.Hot))
+        }
+        if z.ChunkSize != 0 {
+                offsets, dataSize, err := z.Writer.FinishChunks()
+                if err != nil {
+                        log.Fatalf("can't write last chunk: %v", err)
+                        return err
+                }
+                opts.Chunks = &index.Chunks{
+                        Size     : uint32(z.ChunkSize),
+                        DataSize : dataSize,
+                        Offsets  : offsets,
+                }
+        }
+
         headerLoc := z.Writer.Count     // Offset for Metadata in image file
         fmt.Printf("header location: %v bytes\n", headerLoc)
 
-        mEnc := gob.NewEncoder(z.Writer.W)
+        if z.Verity {
+                // The tree is built over the data as written to the file
+                if err := z.Writer.W.Flush(); err != nil {
+                        log.Fatalf("can't write image data: %v", err)
+                        return err
+                }
+                opts.Verity = &index.Verity{Data: io.NewSectionReader(z.Writer.F, 0, headerLoc)}
+        }
 
-        fmt.Println("current Metadata:", z.Metadata)
-        mEnc.Encode(z.Metadata)
+        root, err := z.BuildIndex()
+        if err != nil {
+                log.Fatalf("can't build image index: %v", err)
+                return err
+        }
 
-        // Write location of Metadata to end of file
-        z.Writer.WriteInt64(int64(headerLoc))
+        idx, err := index.Encode(root, headerLoc, opts)
+        if err != nil {
+                log.Fatalf("can't encode image index: %v", err)
+                return err
+        }
+
+        if _, err := z.Writer.Write(idx, false); err != nil {
+                log.Fatalf("can't write image index: %v", err)
+                return err
+        }
+        fmt.Printf("index size: %v bytes, entries: %v\n", len(idx), len(z.Metadata))
+        if opts.Verity != nil {
+                fmt.Printf("verity digest: %x\n", opts.Verity.Digest)
+        }
+        if z.Dedup {
+                fmt.Printf("deduplicated: %v bytes\n", z.DedupBytes)
+        }
+        if z.prev != nil {
+                fmt.Printf("copied from previous image: %v files, %v bytes\n", z.prev.reusedFiles, z.prev.reusedBytes)
+        }
 
         if err := z.Writer.Close(); err != nil {
                 log.Fatalf("can't close zar file: %v", err)
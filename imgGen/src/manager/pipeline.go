@@ -0,0 +1,403 @@
+package manager
+
+import (
+	"crypto/sha256"
+	"fmt"
+	"io"
+	"log"
+	"os"
+	"runtime"
+
+	"fileio/index"
+)
+
+const (
+	// smallFileSize is the size up to which workers read a whole file into
+	// memory; larger files are streamed into the image by the writer
+	smallFileSize = 256 << 10
+
+	// pipelineDepth is the number of files that can be queued for the
+	// writer. Together with smallFileSize it bounds the memory held by
+	// files waiting to be written, and it bounds the number of open files.
+	pipelineDepth = 64
+
+	// hashBufferSize is the size of the buffer used to hash large files
+	hashBufferSize = 1 << 20
+)
+
+// fileJob is a file included by IncludeFile or IncludeData. Workers open, stat and hash it
+// in parallel, then the writer writes it to the image in inclusion order, so
+// that the layout of the image is the same as if files were written one by
+// one.
+type fileJob struct {
+	// path is the host path of the file, or its name for files added with
+	// IncludeData
+	path string
+
+	// preset is set for files added with IncludeData, whose data is
+	// already in memory, or with includeStream
+	preset bool
+
+	// stream is the reader the data of the file is streamed from by the
+	// writer, which closes streamed once it is done with it
+	stream   io.Reader
+	streamed chan struct{}
+
+	// meta is the index of the file's entry in Metadata
+	meta int
+
+	// done is closed by the worker once the fields below are set
+	done chan struct{}
+
+	// f is the open file, for files larger than smallFileSize, or the
+	// previous image at the file's data if reused is set
+	f *os.File
+
+	// reused is set if the file is unchanged since the previous image, at
+	// prevExtent
+	reused     bool
+	prevExtent extent
+
+	// data holds the contents of files up to smallFileSize
+	data []byte
+
+	// attr holds the attributes of the host file, for files included by
+	// path
+	attr *index.Attr
+
+	size int64
+	sum  [sha256.Size]byte
+	err  error
+
+	// begin and end are the extent of the file, set by the writer
+	begin int64
+	end   int64
+}
+
+// pipeline holds the state of the files being included
+type pipeline struct {
+	// jobs feeds the workers
+	jobs chan *fileJob
+
+	// ordered feeds the writer, in inclusion order
+	ordered chan *fileJob
+
+	// written is closed by the writer once all files are written
+	written chan struct{}
+
+	// all holds every file included, in inclusion order
+	all []*fileJob
+}
+
+// includeFile queues the file at host path p, whose entry is Metadata[meta],
+// to be written to the image.
+func (z *ZarManager) includeFile(p string, meta int) {
+	z.queue(&fileJob{path: p, meta: meta})
+}
+
+// includeData queues data, the contents of the file whose entry is
+// Metadata[meta], to be written to the image.
+func (z *ZarManager) includeData(name string, data []byte, meta int) {
+	z.queue(&fileJob{
+		path:   name,
+		meta:   meta,
+		preset: true,
+		data:   data,
+		size:   int64(len(data)),
+	})
+}
+
+// includeStream writes the size bytes read from r as the contents of the
+// file whose entry is Metadata[meta], and returns once they are written. The
+// data is hashed as it is written; with Dedup, if it turns out to duplicate
+// an earlier file it is discarded again, unless compressing.
+func (z *ZarManager) includeStream(name string, r io.Reader, size int64, meta int) {
+	j := &fileJob{
+		path:     name,
+		meta:     meta,
+		preset:   true,
+		size:     size,
+		stream:   r,
+		streamed: make(chan struct{}),
+	}
+	z.queue(j)
+	<-j.streamed
+}
+
+// queue hands j to the workers and the writer.
+func (z *ZarManager) queue(j *fileJob) {
+	if z.pipe == nil {
+		z.startPipeline()
+	}
+	j.done = make(chan struct{})
+	z.pipe.all = append(z.pipe.all, j)
+
+	// The job is handed to the workers before the writer, so the writer
+	// never waits for a job no worker can pick up.
+	z.pipe.jobs <- j
+	z.pipe.ordered <- j
+}
+
+// startPipeline starts the workers and the writer.
+func (z *ZarManager) startPipeline() {
+	workers := z.Workers
+	if workers <= 0 {
+		workers = runtime.NumCPU()
+	}
+	z.pipe = &pipeline{
+		jobs:    make(chan *fileJob, pipelineDepth),
+		ordered: make(chan *fileJob, pipelineDepth),
+		written: make(chan struct{}),
+	}
+	for i := 0; i < workers; i++ {
+		go z.readFiles(z.pipe.jobs)
+	}
+	go z.writeFiles(z.pipe.ordered, z.pipe.written)
+}
+
+// flushFiles waits for every included file to be written and fills in the
+// extents of their entries in Metadata.
+func (z *ZarManager) flushFiles() {
+	if z.pipe == nil {
+		return
+	}
+	close(z.pipe.jobs)
+	close(z.pipe.ordered)
+	<-z.pipe.written
+	for _, j := range z.pipe.all {
+		z.Metadata[j.meta].Begin = j.begin
+		z.Metadata[j.meta].End = j.end
+		z.Metadata[j.meta].Packed = z.packed(j.size)
+		if z.Metadata[j.meta].Attr == nil {
+			z.Metadata[j.meta].Attr = j.attr
+		}
+	}
+	z.pipe = nil
+}
+
+// readFiles is a worker. It opens and stats the files of jobs, reads small
+// files and hashes them if deduplicating.
+func (z *ZarManager) readFiles(jobs <-chan *fileJob) {
+	var buf []byte
+	for j := range jobs {
+		if z.Dedup && buf == nil {
+			buf = make([]byte, hashBufferSize)
+		}
+		j.err = z.readFile(j, buf)
+		close(j.done)
+	}
+}
+
+// readFile opens the file of j and reads or hashes it.
+func (z *ZarManager) readFile(j *fileJob, buf []byte) error {
+	if j.preset {
+		if z.Dedup && j.stream == nil {
+			j.sum = sha256.Sum256(j.data)
+		}
+		return nil
+	}
+
+	f, err := os.Open(j.path)
+	if err != nil {
+		return err
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return err
+	}
+	j.size = fi.Size()
+	j.attr = attrOf(fi)
+
+	if z.prev != nil {
+		if e, ok := z.prev.lookup(j.path, j.size, fi.ModTime().UnixNano()); ok {
+			f.Close()
+			j.reused, j.prevExtent = true, e
+			j.f, err = z.prev.open(e)
+			return err
+		}
+	}
+
+	if j.size <= smallFileSize {
+		defer f.Close()
+		j.data = make([]byte, j.size)
+		if _, err := io.ReadFull(f, j.data); err != nil {
+			return err
+		}
+		if z.Dedup {
+			j.sum = sha256.Sum256(j.data)
+		}
+		return nil
+	}
+
+	if z.Dedup {
+		h := sha256.New()
+		if _, err := io.CopyBuffer(h, io.LimitReader(f, j.size), buf); err != nil {
+			f.Close()
+			return err
+		}
+		h.Sum(j.sum[:0])
+		if _, err := f.Seek(0, io.SeekStart); err != nil {
+			f.Close()
+			return err
+		}
+	}
+	j.f = f
+	return nil
+}
+
+// writeFiles is the writer. It writes the files of ordered to the image in
+// order, as soon as each has been read.
+func (z *ZarManager) writeFiles(ordered <-chan *fileJob, written chan<- struct{}) {
+	for j := range ordered {
+		<-j.done
+		if j.err != nil {
+			log.Fatalf("can't include file %v, err: %v", j.path, j.err)
+		}
+		if err := z.writeFile(j); err != nil {
+			log.Fatalf("can't write file %v to image, err: %v", j.path, err)
+		}
+	}
+	close(written)
+}
+
+// writeFile writes the contents of j to the image, or points it at the data
+// of an identical file if there is one.
+func (z *ZarManager) writeFile(j *fileJob) error {
+	if j.f != nil {
+		defer j.f.Close()
+	}
+
+	if j.reused {
+		return z.writeReused(j)
+	}
+	if j.stream != nil {
+		return z.writeStream(j)
+	}
+
+	if z.Dedup && j.size > 0 {
+		if e, ok := z.extents[j.sum]; ok {
+			if z.Verbose {
+				fmt.Printf("%v has the same contents as [%v, %v)\n", j.path, e.begin, e.end)
+			}
+			z.DedupBytes += j.size
+			j.begin, j.end = e.begin, e.end
+			return nil
+		}
+	}
+
+	pageAlign, err := z.align(j.size)
+	if err != nil {
+		return err
+	}
+	begin := z.Writer.Count
+	var end int64
+	if j.f != nil {
+		end, err = z.Writer.WriteFrom(j.f, j.size, pageAlign)
+	} else {
+		end, err = z.Writer.Write(j.data, pageAlign)
+	}
+	if err != nil {
+		return err
+	}
+	j.begin, j.end = begin, end
+	j.data = nil
+
+	if z.Dedup && j.size > 0 {
+		if z.extents == nil {
+			z.extents = make(map[[sha256.Size]byte]extent)
+		}
+		z.extents[j.sum] = extent{begin, end}
+	}
+	return nil
+}
+
+// writeStream writes the data of j from its stream, hashing it on the way
+// if deduplicating.
+func (z *ZarManager) writeStream(j *fileJob) error {
+	defer close(j.streamed)
+	r := j.stream
+	h := sha256.New()
+	if z.Dedup {
+		r = io.TeeReader(r, h)
+	}
+	// A duplicate is discarded along with the padding written to align it
+	start := z.Writer.Count
+	pageAlign, err := z.align(j.size)
+	if err != nil {
+		return err
+	}
+	begin := z.Writer.Count
+	end, err := z.Writer.WriteFrom(r, j.size, pageAlign)
+	if err != nil {
+		return err
+	}
+	j.begin, j.end = begin, end
+	if !z.Dedup || j.size == 0 {
+		return nil
+	}
+
+	h.Sum(j.sum[:0])
+	if e, ok := z.extents[j.sum]; ok {
+		if z.ChunkSize != 0 {
+			return nil
+		}
+		if err := z.Writer.Truncate(start); err != nil {
+			return err
+		}
+		z.DedupBytes += j.size
+		j.begin, j.end = e.begin, e.end
+		return nil
+	}
+	if z.extents == nil {
+		z.extents = make(map[[sha256.Size]byte]extent)
+	}
+	z.extents[j.sum] = extent{begin, end}
+	return nil
+}
+
+// writeReused copies the data of j from the previous image. Files that shared
+// an extent in the previous image share one in the new image if
+// deduplicating; their contents weren't hashed, so they aren't matched with
+// other files.
+func (z *ZarManager) writeReused(j *fileJob) error {
+	p := z.prev
+	if e, ok := p.reused[j.prevExtent]; ok && z.Dedup && j.size > 0 {
+		z.DedupBytes += j.size
+		j.begin, j.end = e.begin, e.end
+		return nil
+	}
+
+	pageAlign, err := z.align(j.size)
+	if err != nil {
+		return err
+	}
+	begin := z.Writer.Count
+	end, err := z.Writer.WriteFrom(j.f, j.size, pageAlign)
+	if err != nil {
+		return err
+	}
+	j.begin, j.end = begin, end
+	p.reused[j.prevExtent] = extent{begin, end}
+	p.reusedFiles++
+	p.reusedBytes += j.size
+	return nil
+}
+
+// packed returns true if a regular file of size bytes is packed into pages
+// shared with other files, see PackSize. Empty files have no data to pack.
+func (z *ZarManager) packed(size int64) bool {
+	return z.PageAlign && size > 0 && size <= z.PackSize
+}
+
+// align prepares the writer for the data of a file of size bytes, and returns
+// whether the data must be page aligned. The data of a file that isn't packed
+// starts on a page boundary even if packed files were written before it, or
+// on a huge page boundary if it is at least HugeAlignSize bytes; empty files
+// take no room, wherever they start.
+func (z *ZarManager) align(size int64) (bool, error) {
+	if !z.PageAlign || size == 0 || z.packed(size) {
+		return false, nil
+	}
+	return true, z.Writer.Align(z.HugeAlignSize > 0 && size >= z.HugeAlignSize)
+}
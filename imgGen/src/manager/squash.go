@@ -0,0 +1,137 @@
+package manager
+
+import (
+	"fmt"
+	"sort"
+
+	"fileio/index"
+)
+
+// layerDir is a directory of one of the layers being squashed
+type layerDir struct {
+	idx   *index.Index
+	entry uint32
+}
+
+// squashChild is an entry of a squashed directory
+type squashChild struct {
+	name string
+
+	// idx and entry are the entry in the topmost layer that has it
+	idx   *index.Index
+	entry uint32
+
+	// lower holds the directories a directory is merged from, top first,
+	// which are collected for as long as merging is set
+	lower   []layerDir
+	merging bool
+}
+
+// Squash includes the contents of the images of layers, ordered from the
+// bottom layer to the top one, as a single tree, the way runsc presents them
+// with overlays or an imgfs layered mount:
+//
+//   - a name is resolved in the topmost layer that has it
+//   - a whiteout hides the name in the layers below it and is dropped
+//   - a directory is merged with the directories of the same name in the
+//     layers below it, down to the first layer where the name is a whiteout
+//     or not a directory, or where the directory is opaque
+//
+// Files are laid out directory by directory like WalkDir does, and with
+// Dedup files with identical contents in different layers are stored once.
+// The data of the layers must stay mapped until WriteHeader.
+func (z *ZarManager) Squash(layers []*index.Index) error {
+	if len(layers) == 0 {
+		return fmt.Errorf("no layers to squash")
+	}
+	roots := make([]layerDir, len(layers))
+	for n, x := range layers {
+		roots[len(layers)-1-n] = layerDir{x, 0}
+	}
+	z.rootAttr = squashAttr(layers[len(layers)-1], 0)
+	return z.squashDir(roots)
+}
+
+// squashAttr returns the attributes of entry i of layer x, or nil if the
+// layer doesn't record them. Hard links of the layers are included as
+// separate files, so they have a single link.
+func squashAttr(x *index.Index, i uint32) *index.Attr {
+	a, ok := x.Attr(i)
+	if !ok {
+		return nil
+	}
+	a.Links = 1
+	return &a
+}
+
+// squashDir includes the merge of dirs, ordered from the top layer down.
+func (z *ZarManager) squashDir(dirs []layerDir) error {
+	var children []*squashChild
+	// seen maps every name found so far to its child, or to nil for
+	// whiteouts
+	seen := make(map[string]*squashChild)
+	for _, d := range dirs {
+		first, count := d.idx.Children(d.entry)
+		for i := first; i < first+count; i++ {
+			name := string(d.idx.Name(i))
+			t := d.idx.Type(i)
+			if c, ok := seen[name]; ok {
+				if c != nil && c.merging {
+					if t == index.TypeDirectory {
+						c.lower = append(c.lower, layerDir{d.idx, i})
+						c.merging = d.idx.Flags(i)&index.EntryOpaque == 0
+					} else {
+						c.merging = false
+					}
+				}
+				continue
+			}
+			if t == index.TypeWhiteout {
+				seen[name] = nil
+				continue
+			}
+			c := &squashChild{name: name, idx: d.idx, entry: i}
+			if t == index.TypeDirectory {
+				c.lower = []layerDir{{d.idx, i}}
+				c.merging = d.idx.Flags(i)&index.EntryOpaque == 0
+			}
+			seen[name] = c
+			children = append(children, c)
+		}
+	}
+	sort.Slice(children, func(i, j int) bool {
+		return children[i].name < children[j].name
+	})
+
+	// Files first, then subdirectories, for spatial locality
+	for _, c := range children {
+		switch c.idx.Type(c.entry) {
+		case index.TypeDirectory:
+			continue
+		case index.TypeSymlink:
+			z.IncludeSymlink(c.name, string(c.idx.Link(c.entry)), c.idx.ModTime(c.entry))
+			z.setAttr(squashAttr(c.idx, c.entry))
+		case index.TypeRegularFile:
+			data, err := c.idx.Data(c.entry)
+			if err != nil {
+				return fmt.Errorf("can't read %v: %v", c.name, err)
+			}
+			z.IncludeData(c.name, data, c.idx.ModTime(c.entry))
+			z.setAttr(squashAttr(c.idx, c.entry))
+		default:
+			return fmt.Errorf("%v has unknown type %v", c.name, c.idx.Type(c.entry))
+		}
+	}
+	for _, c := range children {
+		if c.lower == nil {
+			continue
+		}
+		z.IncludeFolderBegin(c.name, c.idx.ModTime(c.entry))
+		z.setAttr(squashAttr(c.idx, c.entry))
+		if err := z.squashDir(c.lower); err != nil {
+			return err
+		}
+		z.IncludeFolderEnd()
+	}
+	return nil
+}
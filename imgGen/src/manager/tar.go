@@ -0,0 +1,217 @@
+package manager
+
+import (
+	"archive/tar"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"path"
+	"strings"
+
+	"fileio/index"
+)
+
+const (
+	// whiteoutPrefix marks a whiteout in a tar layer: .wh.<name> records
+	// that <name> was deleted in the layer
+	whiteoutPrefix = ".wh."
+
+	// opaqueWhiteout marks, in a tar layer, a directory that replaces the
+	// directories of the same name in lower layers
+	opaqueWhiteout = ".wh..wh..opq"
+)
+
+// tarFolder is a folder begun by IncludeTar and not ended yet
+type tarFolder struct {
+	name string
+
+	// meta is the index of the folder's begin entry in Metadata
+	meta int
+}
+
+// hardLink is a regular file that shares the data of another one
+type hardLink struct {
+	meta   int
+	target int
+}
+
+// IncludeTar includes the contents of the tar stream r, such as an OCI or
+// Docker image layer, in a single pass: no entry is extracted to disk. Small
+// files are read and hashed by the workers; larger ones are streamed into
+// the image by the writer.
+//
+// Whiteouts (.wh.<name>) become whiteout entries, and opaque whiteouts
+// (.wh..wh..opq) mark their directory opaque. Hard links share the data of
+// their target. Devices, FIFOs and other special files can't be represented
+// in an image and are skipped.
+//
+// Entries can come in any order: a folder may be begun several times, and
+// BuildIndex merges its contents.
+func (z *ZarManager) IncludeTar(r io.Reader) error {
+	tr := tar.NewReader(r)
+	var open []tarFolder
+	files := make(map[string]int)
+
+	for {
+		hdr, err := tr.Next()
+		if err == io.EOF {
+			break
+		}
+		if err != nil {
+			return err
+		}
+
+		name := path.Clean("/" + hdr.Name)[1:]
+		if name == "" {
+			// The root directory
+			z.rootAttr = tarAttr(hdr)
+			continue
+		}
+		dir, base := path.Split(name)
+		var folders []string
+		if dir != "" {
+			folders = strings.Split(strings.TrimSuffix(dir, "/"), "/")
+		}
+		open = z.openFolders(open, folders)
+		mod_time := hdr.ModTime.UnixNano()
+
+		switch {
+		case base == opaqueWhiteout:
+			if len(open) == 0 {
+				log.Printf("ignoring opaque whiteout of the root directory")
+				continue
+			}
+			z.Metadata[open[len(open)-1].meta].Opaque = true
+			continue
+		case strings.HasPrefix(base, whiteoutPrefix):
+			z.IncludeWhiteout(strings.TrimPrefix(base, whiteoutPrefix))
+			continue
+		}
+
+		switch hdr.Typeflag {
+		case tar.TypeDir:
+			z.IncludeFolderBegin(base, mod_time)
+			z.setAttr(tarAttr(hdr))
+			open = append(open, tarFolder{base, len(z.Metadata) - 1})
+		case tar.TypeSymlink:
+			z.IncludeSymlink(base, hdr.Linkname, mod_time)
+			z.setAttr(tarAttr(hdr))
+		case tar.TypeLink:
+			target, ok := files[path.Clean("/" + hdr.Linkname)[1:]]
+			if !ok {
+				return fmt.Errorf("hard link %v to unknown file %v", name, hdr.Linkname)
+			}
+			z.includeTarFile(base, mod_time)
+			z.setAttr(tarAttr(hdr))
+			z.links = append(z.links, hardLink{len(z.Metadata) - 1, target})
+			files[name] = len(z.Metadata) - 1
+		case tar.TypeReg, tar.TypeRegA:
+			if hdr.Size <= smallFileSize {
+				data, err := ioutil.ReadAll(tr)
+				if err != nil {
+					return fmt.Errorf("can't read %v: %v", name, err)
+				}
+				z.IncludeData(base, data, mod_time)
+				z.setAttr(tarAttr(hdr))
+			} else {
+				z.includeTarFile(base, mod_time)
+				z.setAttr(tarAttr(hdr))
+				z.includeStream(name, tr, hdr.Size, len(z.Metadata)-1)
+			}
+			files[name] = len(z.Metadata) - 1
+		default:
+			if z.Verbose {
+				fmt.Printf("skipping %v of type %q\n", name, hdr.Typeflag)
+			}
+		}
+	}
+
+	z.openFolders(open, nil)
+	return nil
+}
+
+// tarAttr returns the ownership and permissions recorded in hdr
+func tarAttr(hdr *tar.Header) *index.Attr {
+	return &index.Attr{
+		Mode:  uint32(hdr.Mode) & 07777,
+		UID:   uint32(hdr.Uid),
+		GID:   uint32(hdr.Gid),
+		Links: 1,
+	}
+}
+
+// includeTarFile adds the Metadata of a regular file whose extent is filled
+// in later.
+func (z *ZarManager) includeTarFile(name string, mod_time int64) {
+	h := &FileMetadata{
+		Begin:   -1,
+		End:     -1,
+		Name:    name,
+		Type:    RegularFile,
+		ModTime: mod_time,
+	}
+	z.Metadata = append(z.Metadata, *h)
+}
+
+// openFolders ends and begins folders so that the open folders, open, become
+// folders. It returns the new open folders.
+func (z *ZarManager) openFolders(open []tarFolder, folders []string) []tarFolder {
+	common := 0
+	for common < len(open) && common < len(folders) && open[common].name == folders[common] {
+		common++
+	}
+	for len(open) > common {
+		z.IncludeFolderEnd()
+		open = open[:len(open)-1]
+	}
+	for _, f := range folders[common:] {
+		// The modification time is set if the folder has its own entry
+		z.IncludeFolderBegin(f, 0)
+		open = append(open, tarFolder{f, len(z.Metadata) - 1})
+	}
+	return open
+}
+
+// resolveLinks points hard links at the data of their target, and sets the
+// link count of every file that has hard links. It must be called after the
+// files are written.
+func (z *ZarManager) resolveLinks() {
+	// file follows hard links to hard links to the file they link to
+	targets := make(map[int]int)
+	for _, l := range z.links {
+		targets[l.meta] = l.target
+	}
+	file := func(i int) int {
+		for {
+			t, ok := targets[i]
+			if !ok {
+				return i
+			}
+			i = t
+		}
+	}
+	links := make(map[int]uint32)
+	for _, l := range z.links {
+		links[file(l.target)]++
+	}
+
+	setLinks := func(i int, n uint32) {
+		a := index.DefaultAttr(index.TypeRegularFile)
+		if z.Metadata[i].Attr != nil {
+			a = *z.Metadata[i].Attr
+		}
+		a.Links = n
+		z.Metadata[i].Attr = &a
+	}
+	for _, l := range z.links {
+		f := file(l.target)
+		z.Metadata[l.meta].Begin = z.Metadata[f].Begin
+		z.Metadata[l.meta].End = z.Metadata[f].End
+		z.Metadata[l.meta].Packed = z.Metadata[f].Packed
+		setLinks(l.meta, links[f]+1)
+	}
+	for f, n := range links {
+		setLinks(f, n+1)
+	}
+}
@@ -1,16 +1,20 @@
 package main
 
 import (
-	"bytes"
+	"bufio"
+	"compress/gzip"
 	"flag"
 	"fmt"
-	"encoding/binary"
-	"encoding/gob"
+	"io"
 	"log"
 	"os"
+	"path/filepath"
+	"sort"
 	"syscall"
+	"time"
 
 	// TODO: Change paths to be remotely imported from github
+	"fileio/index"
 	"manager"
 )
 
@@ -20,14 +24,44 @@ import (
 // parameter (dir)	: the root dir name
 // parameter (output)	: the name of the image file
 // parameter (pageAlign): whether the files in the image will be page aligned
+// parameter (packSize)	: with pageAlign, the size up to which files are packed into shared pages
+// parameter (hugeAlignSize): with pageAlign, the size from which files are aligned to 2 MiB, 0 for none
+// parameter (chunkSize): if not zero, compress the file data in chunks of this size
+// parameter (dedup)	: whether files with identical contents share their data
+// parameter (verity)	: whether to add a hash tree over the image, for imgfs to verify it
 // parameter (config)	: whether the image file is initialized from a config file
 // parameter (configPath): the path to the config file
+// parameter (configRest): whether to include the files of dir the config doesn't list
 // parameter (format)	: the format of the config file
-func writeImage(dir string, output string, pageAlign bool, config bool, configPath string, format string) {
+// parameter (workers)	: the number of files read in parallel, 0 for the number of CPUs
+// parameter (verbose)	: whether to print every file included
+// parameter (prev)	: if not empty, a previous image of dir to copy unchanged files from
+func writeImage(dir string, output string, pageAlign bool, packSize int64, hugeAlignSize int64, chunkSize int, dedup bool, verity bool, config bool, configPath string, configRest bool, format string, workers int, verbose bool, prev string) {
 	var z *manager.ZarManager
 	var c *manager.CManager
 
-	z = &manager.ZarManager{PageAlign:pageAlign}
+	z = &manager.ZarManager{PageAlign:pageAlign, PackSize:packSize, HugeAlignSize:hugeAlignSize, ChunkSize:chunkSize, Dedup:dedup, Verity:verity, Workers:workers, Verbose:verbose}
+	z.Writer.ChunkSize = chunkSize
+	z.Writer.Verbose = verbose
+	start := time.Now()
+	defer func() { fmt.Printf("image written in %v\n", time.Since(start)) }()
+
+	if prev != "" {
+		// The previous image is read while the new one is written, so it
+		// can't be overwritten.
+		if pfi, err := os.Stat(prev); err != nil {
+			log.Fatalf("can't stat previous image %v, err: %v", prev, err)
+		} else if ofi, err := os.Stat(output); err == nil && os.SameFile(pfi, ofi) {
+			log.Fatalf("the previous image %v can't be overwritten, write to another file", prev)
+		}
+		idx, err := index.Open(mapImage(prev))
+		if err != nil {
+			log.Fatalf("can't open image index of %v, err: %v", prev, err)
+		}
+		if err := z.UsePrevious(prev, idx, dir); err != nil {
+			log.Fatalf("can't use previous image: %v", err)
+		}
+	}
 
 	// Create the manager
 	// TODO: Make this not redundant code
@@ -42,6 +76,7 @@ func writeImage(dir string, output string, pageAlign bool, config bool, configPa
 			ZarManager		: z,
 			Format		: format,
 			ConfigFile	: f,
+			Rest		: configRest,
 		}
 		c.Writer.Init(output)
 
@@ -61,18 +96,108 @@ func writeImage(dir string, output string, pageAlign bool, config bool, configPa
 	}
 }
 
-// TODO: Break up into smaller methods
-// readImage will open the given file, extract the metadata, and print out
-// the structure and/or data for each file and directory in the image file.
+// squashImage writes the layers, ordered from the bottom layer to the top one,
+// to a single image, applying their whiteouts and shadowing.
 //
-// parameter (img)	: name of the image file to be read
-// parameter (detail)	: whether to print extra information (file data)
-func readImage(img string, detail bool) error {
+// parameter (layers)	: the image files of the layers
+// parameter (output)	: the name of the image file
+// parameter (pageAlign): whether the files in the image will be page aligned
+// parameter (packSize)	: with pageAlign, the size up to which files are packed into shared pages
+// parameter (hugeAlignSize): with pageAlign, the size from which files are aligned to 2 MiB, 0 for none
+// parameter (chunkSize): if not zero, compress the file data in chunks of this size
+// parameter (dedup)	: whether files with identical contents share their data
+// parameter (verity)	: whether to add a hash tree over the image, for imgfs to verify it
+// parameter (workers)	: the number of files hashed in parallel, 0 for the number of CPUs
+// parameter (verbose)	: whether to print every file included
+func squashImage(layers []string, output string, pageAlign bool, packSize int64, hugeAlignSize int64, chunkSize int, dedup bool, verity bool, workers int, verbose bool) {
+	z := &manager.ZarManager{PageAlign:pageAlign, PackSize:packSize, HugeAlignSize:hugeAlignSize, ChunkSize:chunkSize, Dedup:dedup, Verity:verity, Workers:workers, Verbose:verbose}
+	z.Writer.ChunkSize = chunkSize
+	z.Writer.Verbose = verbose
+
+	var idxs []*index.Index
+	for _, l := range layers {
+		fmt.Printf("layer: %v\n", l)
+		idx, err := index.Open(mapImage(l))
+		if err != nil {
+			log.Fatalf("can't open image index of %v, err: %v", l, err)
+		}
+		idxs = append(idxs, idx)
+	}
+
+	z.Writer.Init(output)
+	if err := z.Squash(idxs); err != nil {
+		log.Fatalf("can't squash layers: %v", err)
+	}
+	z.WriteHeader()
+}
+
+// tarImage converts a tar layer, optionally gzip compressed, to an image in a
+// single pass.
+//
+// parameter (layer)	: the tar file, or - for the standard input
+// parameter (output)	: the name of the image file
+// parameter (pageAlign): whether the files in the image will be page aligned
+// parameter (packSize)	: with pageAlign, the size up to which files are packed into shared pages
+// parameter (hugeAlignSize): with pageAlign, the size from which files are aligned to 2 MiB, 0 for none
+// parameter (chunkSize): if not zero, compress the file data in chunks of this size
+// parameter (dedup)	: whether files with identical contents share their data
+// parameter (verity)	: whether to add a hash tree over the image, for imgfs to verify it
+// parameter (workers)	: the number of files hashed in parallel, 0 for the number of CPUs
+// parameter (verbose)	: whether to print every file skipped
+func tarImage(layer string, output string, pageAlign bool, packSize int64, hugeAlignSize int64, chunkSize int, dedup bool, verity bool, workers int, verbose bool) {
+	z := &manager.ZarManager{PageAlign:pageAlign, PackSize:packSize, HugeAlignSize:hugeAlignSize, ChunkSize:chunkSize, Dedup:dedup, Verity:verity, Workers:workers, Verbose:verbose}
+	z.Writer.ChunkSize = chunkSize
+	z.Writer.Verbose = verbose
+	start := time.Now()
+	defer func() { fmt.Printf("image written in %v\n", time.Since(start)) }()
+
+	f := os.Stdin
+	if layer != "-" {
+		var err error
+		if f, err = os.Open(layer); err != nil {
+			log.Fatalf("can't open tar layer %v, err: %v", layer, err)
+		}
+		defer f.Close()
+	}
+
+	// Layers are usually gzip compressed, which is recognized by its magic
+	r := bufio.NewReaderSize(f, 1<<20)
+	var tr io.Reader = r
+	if magic, err := r.Peek(2); err == nil && magic[0] == 0x1f && magic[1] == 0x8b {
+		gz, err := gzip.NewReader(r)
+		if err != nil {
+			log.Fatalf("can't read gzip layer %v, err: %v", layer, err)
+		}
+		defer gz.Close()
+		tr = gz
+	}
+
+	z.Writer.Init(output)
+	if err := z.IncludeTar(tr); err != nil {
+		log.Fatalf("can't convert tar layer %v: %v", layer, err)
+	}
+	z.WriteHeader()
+}
+
+// imageLayers returns the layers in dir, in the order runsc stacks them: the
+// *.img files sorted by name, from the bottom layer to the top one.
+func imageLayers(dir string) []string {
+	layers, err := filepath.Glob(filepath.Join(dir, "*.img"))
+	if err != nil {
+		log.Fatalf("can't list layers in %v, err: %v", dir, err)
+	}
+	sort.Strings(layers)
+	return layers
+}
+
+// mapImage maps the image file img read-only, and exits on failure. The
+// mapping is never unmapped.
+func mapImage(img string) []byte {
 	f, err := os.Open(img)
 	if err != nil {
 		log.Fatalf("can't open image file %v, err: %v", img, err)
-		return err
 	}
+	defer f.Close()
 
 	fi, err := f.Stat()
 	if err != nil {
@@ -87,74 +212,112 @@ func readImage(img string, detail bool) error {
 	if err != nil {
 		log.Fatalf("can't mmap the image file, err: %v", err)
 	}
+	return mmap
+}
+
+// TODO: Break up into smaller methods
+// readImage will open the given file, extract the metadata, and print out
+// the structure and/or data for each file and directory in the image file.
+//
+// parameter (img)	: name of the image file to be read
+// parameter (detail)	: whether to print extra information (file data)
+func readImage(img string, detail bool) error {
+	mmap := mapImage(img)
 
 	if detail {
 		fmt.Println("MMAP data:", mmap)
 	}
 
-	// header location is specifed by int64 at last 10 bits (bytes?)
-	headerLoc := mmap[length - 10 : length]
-	fmt.Println("header data:", headerLoc)
-
-	// Setup reader for header data
-	headerReader := bytes.NewReader(headerLoc)
-	n, err := binary.ReadVarint(headerReader)
+	// The index is read in place from the mapped image
+	idx, err := index.Open(mmap)
 	if err != nil {
-		log.Fatalf("can't read header location, err: %v", err)
+		log.Fatalf("can't open image index, err: %v", err)
+		return err
+	}
+	fmt.Printf("index entries: %v, compressed: %v, hot ranges: %v\n", idx.Len(), idx.Compressed(), len(idx.Hot()))
+	if d, ok := idx.VerityDigest(); ok {
+		fmt.Printf("verity digest: %x\n", d)
 	}
-	fmt.Printf("headerLoc: %v bytes\n", n)
 
-	var metadata []manager.FileMetadata
-	header := mmap[int(n) : length - 10]
-	fmt.Println("metadata data:", header)
+	// Print the structure (and data) of the image file
+	printDir(idx, mmap, 0, 0, detail)
+	return nil
+}
 
-	// Decode the metadata in the header
-	metadataReader := bytes.NewReader(header)
-	dec := gob.NewDecoder(metadataReader)
-	errDec := dec.Decode(&metadata)
-	if errDec != nil {
-		  log.Fatalf("can't decode metadata data, err: %v", errDec)
-			return err
+// verifyImage checks the whole image against its hash tree and prints its
+// digest.
+//
+// parameter (img)	: the name of the image file
+func verifyImage(img string) {
+	idx, err := index.Open(mapImage(img))
+	if err != nil {
+		log.Fatalf("can't open image index, err: %v", err)
+	}
+	d, err := idx.Verify()
+	if err != nil {
+		log.Fatalf("can't verify image: %v", err)
 	}
-	fmt.Println("metadata data decoded:", metadata)
+	fmt.Printf("verified, digest: %x\n", d)
+}
 
-	level := 0
+// printDir prints the children of directory entry dir, recursing into
+// subdirectories.
+//
+// parameter (idx)	: the image index
+// parameter (mmap)	: the mapped image
+// parameter (dir)	: the directory entry to print
+// parameter (level)	: the nesting level of dir, used for indentation
+// parameter (detail)	: whether to print extra information (file data)
+func printDir(idx *index.Index, mmap []byte, dir uint32, level int, detail bool) {
 	space := 2
-
-	// Print the structure (and data) of the image file
-	for _, v := range metadata {
-		for i := 0; i < space * level; i++ {
+	first, count := idx.Children(dir)
+	for i := first; i < first+count; i++ {
+		for j := 0; j < space*level; j++ {
 			fmt.Printf(" ")
 		}
-		if v.Begin == -1 {
-			if v.Type == manager.Directory {
-				if v.Name != ".." {
-					fmt.Printf("[folder] %v\n", v.Name)
-					level += 1
-				} else {
-					fmt.Printf("[flag] leave folder\n")
-					level -= 1
-				}
+		// attrs shows the recorded ownership and permissions
+		var attrs string
+		if a, ok := idx.Attr(i); ok {
+			attrs = fmt.Sprintf(" (%04o %d:%d)", a.Mode, a.UID, a.GID)
+			if a.Links > 1 {
+				attrs += fmt.Sprintf(" (%d links)", a.Links)
+			}
+		}
+		switch idx.Type(i) {
+		case index.TypeDirectory:
+			if idx.Flags(i)&index.EntryOpaque != 0 {
+				fmt.Printf("[folder] %s%s (opaque)\n", idx.Name(i), attrs)
 			} else {
-				fmt.Printf("[symlink] %v -> %v\n", v.Name, v.Link)
+				fmt.Printf("[folder] %s%s\n", idx.Name(i), attrs)
 			}
-		} else {
+			printDir(idx, mmap, i, level+1, detail)
+		case index.TypeSymlink:
+			fmt.Printf("[symlink] %s -> %s%s\n", idx.Name(i), idx.Link(i), attrs)
+		case index.TypeWhiteout:
+			fmt.Printf("[whiteout] %s\n", idx.Name(i))
+		default:
 			var fileString string
 			if detail {
-				fileBytes := mmap[v.Begin : v.End]
+				fileBytes, err := idx.Data(i)
+				if err != nil {
+					log.Fatalf("can't read %s, err: %v", idx.Name(i), err)
+				}
 				fileString = string(fileBytes)
 			} else {
 				fileString = "ignored"
 			}
-			fmt.Printf("[regular file] %v (data: %v)\n", v.Name, fileString)
+			if idx.Flags(i)&index.EntryPacked != 0 {
+				fmt.Printf("[regular file] %s%s (packed) (data: %v)\n", idx.Name(i), attrs, fileString)
+			} else {
+				fmt.Printf("[regular file] %s%s (data: %v)\n", idx.Name(i), attrs, fileString)
+			}
 		}
 	}
-	return nil
 }
 
 func main() {
 	// TODO: Add config file for version number
-	fmt.Println("zar image generator version 1")
+	fmt.Println("zar image generator version 2")
 
 	// TODO: Add flag for info logging
 	// Handle flags
@@ -163,17 +326,72 @@ func main() {
 	output := flag.String("o", "test.img", "output img name")
 	writeMode := flag.Bool("w", false, "generate image mode")
 	readMode := flag.Bool("r", false, "read image mode")
+	tarLayer := flag.String("tar", "", "convert this tar layer, optionally gzip compressed (- for the standard input), to an image")
+	squashMode := flag.Bool("squash", false, "squash the layers given as arguments, bottom first, or the *.img layers of -dir, into one image")
 	pageAlign := flag.Bool("pagealign", false, "align the page")
+	packSize := flag.Int64("pack", 2048, "with -pagealign, pack files of up to this size into shared pages instead of aligning them (0 to align every file)")
+	hugeAlignSize := flag.Int64("hugealign", 0, "with -pagealign, align files of at least this size, 2097152 or more, to 2 MiB so they can be mapped with huge pages (0 to disable)")
+	compress := flag.Bool("compress", false, "compress the file data in independent chunks")
+	dedup := flag.Bool("dedup", true, "store the data of files with identical contents once")
+	verity := flag.Bool("verity", false, "add a hash tree over the image, so that imgfs verifies the blocks it uses, and print the digest of the image")
+	verifyMode := flag.Bool("verify", false, "verify the image selected with -img against its hash tree")
+	chunkSize := flag.Int("chunksize", 64<<10, "uncompressed size of a chunk when compressing, a multiple of 4096")
 	detailMode := flag.Bool("detail", false, "show original context when read")
 	config := flag.Bool("config", false, "img generated from config file")
 	configPath := flag.String("configPath", "", "path to config file for img")
+	configRest := flag.Bool("configRest", false, "after the files listed in the config, include the other files of -dir (e.g. for an imgfs access trace)")
 	configFormat := flag.String("configFormat", "seq", "format of config. Known: seq")
+	workers := flag.Int("j", 0, "number of files read in parallel when generating an image (default: number of CPUs)")
+	prev := flag.String("prev", "", "previous image of -dir to copy the files whose size and modification time haven't changed from")
+	verbose := flag.Bool("v", false, "print every file included when generating an image")
 	flag.Parse()
 
 	// TODO: Create a config struct for all flags
+	size := 0
+	if *compress {
+		if *pageAlign {
+			log.Fatalf("-pagealign and -compress can't be combined: compressed data can't be mapped from the image")
+		}
+		if *chunkSize <= 0 || *chunkSize%4096 != 0 {
+			log.Fatalf("invalid chunk size %v, must be a positive multiple of 4096", *chunkSize)
+		}
+		size = *chunkSize
+	}
+	if *packSize < 0 {
+		log.Fatalf("invalid pack size %v", *packSize)
+	}
+	if *hugeAlignSize != 0 {
+		if !*pageAlign {
+			log.Fatalf("-hugealign requires -pagealign")
+		}
+		if *hugeAlignSize < 2<<20 {
+			log.Fatalf("invalid huge alignment size %v, must be at least 2097152", *hugeAlignSize)
+		}
+	}
+
 	if *writeMode {
 		fmt.Printf("root dir: %v\n", *dir)
-		writeImage(*dir, *output, *pageAlign, *config, *configPath, *configFormat)
+		writeImage(*dir, *output, *pageAlign, *packSize, *hugeAlignSize, size, *dedup, *verity, *config, *configPath, *configRest, *configFormat, *workers, *verbose, *prev)
+	}
+
+	if *tarLayer != "" {
+		tarImage(*tarLayer, *output, *pageAlign, *packSize, *hugeAlignSize, size, *dedup, *verity, *workers, *verbose)
+	}
+
+	if *squashMode {
+		layers := flag.Args()
+		if len(layers) == 0 {
+			layers = imageLayers(*dir)
+		}
+		if len(layers) == 0 {
+			log.Fatalf("no layers to squash")
+		}
+		squashImage(layers, *output, *pageAlign, *packSize, *hugeAlignSize, size, *dedup, *verity, *workers, *verbose)
+	}
+
+	if *verifyMode {
+		fmt.Printf("img selected: %v\n", *img)
+		verifyImage(*img)
 	}
 
 	if (*readMode) {